@@ -0,0 +1,294 @@
+#include "picomc_bridge.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+/***
+ *	Frame level access to the memory card served by PicoMemcard, see picomc_bridge.h.
+ *	Requests are CP_OP_FRAMES frames of the CDC protocol (src/cdc_protocol.c, docs/picomc_cdc.py).
+ */
+
+#define HEADER_SIZE		8
+#define CRC_SIZE		4
+#define MAX_PAYLOAD		(32 * PMC_FRAME_SIZE + 64)
+#define OP_FRAMES		0x08
+#define FRAME_READ		'R'
+#define FRAME_WRITE		'W'
+#define FRAME_ID		'S'
+#define TIMEOUT_MS		1000
+#define RETRIES			5		// attempts of single frame operations answered with PMC_FRAME_RETRY
+
+struct pmc {
+	#ifdef _WIN32
+	HANDLE port;
+	#else
+	int port;
+	#endif
+	uint8_t seq;
+	uint8_t frame[HEADER_SIZE + MAX_PAYLOAD + CRC_SIZE];
+};
+
+static uint32_t crc32(const uint8_t* data, uint32_t len) {
+	uint32_t crc = 0xFFFFFFFF;
+	while(len--) {
+		crc ^= *data++;
+		for(int i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static inline uint16_t get16(const uint8_t* p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get32(const uint8_t* p) {
+	return get16(p) | ((uint32_t) get16(p + 2) << 16);
+}
+
+static inline void put16(uint8_t* p, uint16_t v) {
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static inline void put32(uint8_t* p, uint32_t v) {
+	put16(p, v & 0xFFFF);
+	put16(p + 2, v >> 16);
+}
+
+#ifdef _WIN32
+pmc_t* pmc_open(const char* port) {
+	char path[64];
+	DCB dcb = {0};
+	COMMTIMEOUTS timeouts = {0};
+	pmc_t* pmc = calloc(1, sizeof(pmc_t));
+	if(!pmc)
+		return NULL;
+	snprintf(path, sizeof(path), "\\\\.\\%s", port);
+	pmc->port = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if(pmc->port == INVALID_HANDLE_VALUE) {
+		free(pmc);
+		return NULL;
+	}
+	dcb.DCBlength = sizeof(dcb);
+	GetCommState(pmc->port, &dcb);
+	dcb.BaudRate = CBR_115200;		// ignored by CDC ACM
+	dcb.ByteSize = 8;
+	dcb.Parity = NOPARITY;
+	dcb.StopBits = ONESTOPBIT;
+	dcb.fDtrControl = DTR_CONTROL_ENABLE;	// tud_cdc_connected() needs DTR
+	SetCommState(pmc->port, &dcb);
+	timeouts.ReadTotalTimeoutConstant = TIMEOUT_MS;
+	timeouts.WriteTotalTimeoutConstant = TIMEOUT_MS;
+	SetCommTimeouts(pmc->port, &timeouts);
+	PurgeComm(pmc->port, PURGE_RXCLEAR);
+	return pmc;
+}
+
+void pmc_close(pmc_t* pmc) {
+	CloseHandle(pmc->port);
+	free(pmc);
+}
+
+static int port_write(pmc_t* pmc, const uint8_t* data, uint32_t len) {
+	DWORD written;
+	return WriteFile(pmc->port, data, len, &written, NULL) && written == len ? PMC_OK : PMC_ERR_IO;
+}
+
+static int port_read(pmc_t* pmc, uint8_t* data, uint32_t len) {
+	DWORD bytes_read;
+	while(len) {
+		if(!ReadFile(pmc->port, data, len, &bytes_read, NULL) || !bytes_read)
+			return PMC_ERR_IO;
+		data += bytes_read;
+		len -= bytes_read;
+	}
+	return PMC_OK;
+}
+#else
+pmc_t* pmc_open(const char* port) {
+	struct termios tio;
+	pmc_t* pmc = calloc(1, sizeof(pmc_t));
+	if(!pmc)
+		return NULL;
+	pmc->port = open(port, O_RDWR | O_NOCTTY);
+	if(pmc->port < 0) {
+		free(pmc);
+		return NULL;
+	}
+	if(tcgetattr(pmc->port, &tio) == 0) {
+		cfmakeraw(&tio);
+		tio.c_cflag |= CLOCAL | CREAD;
+		tcsetattr(pmc->port, TCSANOW, &tio);
+	}
+	tcflush(pmc->port, TCIFLUSH);
+	return pmc;
+}
+
+void pmc_close(pmc_t* pmc) {
+	close(pmc->port);
+	free(pmc);
+}
+
+static int port_write(pmc_t* pmc, const uint8_t* data, uint32_t len) {
+	while(len) {
+		ssize_t written = write(pmc->port, data, len);
+		if(written <= 0)
+			return PMC_ERR_IO;
+		data += written;
+		len -= written;
+	}
+	return PMC_OK;
+}
+
+static int port_read(pmc_t* pmc, uint8_t* data, uint32_t len) {
+	struct pollfd pfd = {pmc->port, POLLIN, 0};
+	while(len) {
+		if(poll(&pfd, 1, TIMEOUT_MS) <= 0)
+			return PMC_ERR_IO;
+		ssize_t bytes_read = read(pmc->port, data, len);
+		if(bytes_read <= 0)
+			return PMC_ERR_IO;
+		data += bytes_read;
+		len -= bytes_read;
+	}
+	return PMC_OK;
+}
+#endif
+
+/**
+ * @brief Sends the batch of frame operations built in the payload of pmc->frame, returns its sequence number in out_seq
+ */
+static int send_batch(pmc_t* pmc, uint32_t payload_len, uint8_t* out_seq) {
+	uint8_t* f = pmc->frame;
+	f[0] = 'P';
+	f[1] = 'M';
+	f[2] = OP_FRAMES;
+	f[3] = *out_seq = pmc->seq++;
+	f[4] = 0;
+	f[5] = 0;
+	put16(&f[6], payload_len);
+	put32(&f[HEADER_SIZE + payload_len], crc32(f, HEADER_SIZE + payload_len));
+	return port_write(pmc, f, HEADER_SIZE + payload_len + CRC_SIZE);
+}
+
+/**
+ * @brief Receives the response to the batch with the given sequence number, its results are left in the payload of pmc->frame
+ */
+static int receive_batch(pmc_t* pmc, uint8_t seq, uint32_t expected_len) {
+	uint8_t* f = pmc->frame;
+	int ret = port_read(pmc, f, HEADER_SIZE);
+	if(ret != PMC_OK)
+		return ret;
+	uint32_t len = get16(&f[6]);
+	if(f[0] != 'P' || f[1] != 'M' || len > MAX_PAYLOAD)
+		return PMC_ERR_PROTOCOL;
+	ret = port_read(pmc, &f[HEADER_SIZE], len + CRC_SIZE);
+	if(ret != PMC_OK)
+		return ret;
+	if(crc32(f, HEADER_SIZE + len) != get32(&f[HEADER_SIZE + len]) || f[2] != OP_FRAMES || f[3] != seq)
+		return PMC_ERR_PROTOCOL;
+	if(f[5])
+		return PMC_ERR_DEVICE;
+	return len == expected_len ? PMC_OK : PMC_ERR_PROTOCOL;
+}
+
+/**
+ * @brief Reads or writes frames in batches of PMC_BATCH_FRAMES, keeping PMC_WINDOW of them in flight
+ */
+static int transfer_frames(pmc_t* pmc, uint8_t op, const uint16_t* frames, int count, uint8_t* data, uint8_t* out_status) {
+	uint8_t seqs[PMC_WINDOW];
+	int batches = (count + PMC_BATCH_FRAMES - 1) / PMC_BATCH_FRAMES;
+	uint32_t result_size = op == FRAME_READ ? 2 + PMC_FRAME_SIZE : 2;
+	int sent = 0;
+	int received = 0;
+	int ret;
+
+	while(received < batches) {
+		while(sent < batches && sent - received < PMC_WINDOW) {
+			uint8_t* p = &pmc->frame[HEADER_SIZE];
+			for(int i = sent * PMC_BATCH_FRAMES; i < count && i < (sent + 1) * PMC_BATCH_FRAMES; i++) {
+				*p++ = op;
+				put16(p, frames[i]);
+				p += 2;
+				if(op == FRAME_WRITE) {
+					memcpy(p, &data[i * PMC_FRAME_SIZE], PMC_FRAME_SIZE);
+					p += PMC_FRAME_SIZE;
+				}
+			}
+			ret = send_batch(pmc, p - &pmc->frame[HEADER_SIZE], &seqs[sent % PMC_WINDOW]);
+			if(ret != PMC_OK)
+				return ret;
+			sent++;
+		}
+		int first = received * PMC_BATCH_FRAMES;
+		int n = count - first < PMC_BATCH_FRAMES ? count - first : PMC_BATCH_FRAMES;
+		ret = receive_batch(pmc, seqs[received % PMC_WINDOW], n * result_size);
+		if(ret != PMC_OK)
+			return ret;
+		const uint8_t* r = &pmc->frame[HEADER_SIZE];
+		for(int i = first; i < first + n; i++, r += result_size) {
+			out_status[i] = r[0];
+			if(op == FRAME_READ)
+				memcpy(&data[i * PMC_FRAME_SIZE], &r[2], PMC_FRAME_SIZE);
+		}
+		received++;
+	}
+	return PMC_OK;
+}
+
+/**
+ * @brief Reads count frames, their status (PMC_FRAME_*) is returned in out_status
+ */
+int pmc_read_frames(pmc_t* pmc, const uint16_t* frames, int count, uint8_t* out_data, uint8_t* out_status) {
+	return transfer_frames(pmc, FRAME_READ, frames, count, out_data, out_status);
+}
+
+/**
+ * @brief Writes count frames like the console does, their status (PMC_FRAME_*) is returned in out_status
+ */
+int pmc_write_frames(pmc_t* pmc, const uint16_t* frames, int count, const uint8_t* data, uint8_t* out_status) {
+	return transfer_frames(pmc, FRAME_WRITE, frames, count, (uint8_t*) data, out_status);
+}
+
+static int single_frame(pmc_t* pmc, uint8_t op, uint16_t frame, uint8_t* data) {
+	uint8_t status = PMC_FRAME_RETRY;
+	for(int i = 0; i < RETRIES && status == PMC_FRAME_RETRY; i++) {
+		int ret = transfer_frames(pmc, op, &frame, 1, data, &status);
+		if(ret != PMC_OK)
+			return ret;
+	}
+	return status == PMC_FRAME_GOOD ? PMC_OK : PMC_ERR_FRAME;
+}
+
+int pmc_read_frame(pmc_t* pmc, uint16_t frame, uint8_t* out_data) {
+	return single_frame(pmc, FRAME_READ, frame, out_data);
+}
+
+int pmc_write_frame(pmc_t* pmc, uint16_t frame, const uint8_t* data) {
+	return single_frame(pmc, FRAME_WRITE, frame, (uint8_t*) data);
+}
+
+/**
+ * @brief Returns the answer to the ID command and the current flag byte (bit 3 set until the first write)
+ */
+int pmc_get_id(pmc_t* pmc, uint8_t* out_id, uint8_t* out_flag) {
+	uint8_t seq;
+	pmc->frame[HEADER_SIZE] = FRAME_ID;
+	int ret = send_batch(pmc, 1, &seq);
+	if(ret == PMC_OK)
+		ret = receive_batch(pmc, seq, 2 + PMC_ID_SIZE);
+	if(ret != PMC_OK)
+		return ret;
+	*out_flag = pmc->frame[HEADER_SIZE + 1];
+	memcpy(out_id, &pmc->frame[HEADER_SIZE + 2], PMC_ID_SIZE);
+	return PMC_OK;
+}
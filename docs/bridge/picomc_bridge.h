@@ -0,0 +1,47 @@
+#ifndef __PICOMC_BRIDGE_H__
+#define __PICOMC_BRIDGE_H__
+
+/*
+	Host shim letting PC emulators use the memory card served by PicoMemcard (built with
+	USB_CONCURRENT_MODE) as their own, through CP_OP_FRAMES of the CDC protocol (src/cdc_protocol.c).
+
+	Frames are read and written in batches of PMC_BATCH_FRAMES per request, with up to
+	PMC_WINDOW requests in flight, so reading a whole block costs about one USB round trip.
+
+	Build as a shared library:
+		cc -O2 -shared -fPIC -o libpicomc_bridge.so picomc_bridge.c
+		x86_64-w64-mingw32-gcc -O2 -shared -o picomc_bridge.dll picomc_bridge.c
+*/
+
+#include <stdint.h>
+
+#define PMC_FRAME_SIZE		128
+#define PMC_FRAME_COUNT		1024
+#define PMC_ID_SIZE			6
+#define PMC_BATCH_FRAMES	31		// frames per request, 31 writes (or 32 reads) fit a request
+#define PMC_WINDOW			4		// requests in flight
+
+/* Return codes */
+#define PMC_OK				0
+#define PMC_ERR_OPEN		-1		// serial port could not be opened
+#define PMC_ERR_IO			-2		// serial port read or write failed, or timed out
+#define PMC_ERR_PROTOCOL	-3		// corrupted or unexpected response
+#define PMC_ERR_DEVICE		-4		// request rejected, e.g. memory card not served
+#define PMC_ERR_FRAME		-5		// frame out of range, or still busy after retries
+
+/* Per frame status, same values the console gets */
+#define PMC_FRAME_GOOD		0x47
+#define PMC_FRAME_BAD		0xFF
+#define PMC_FRAME_RETRY		0x4E
+
+typedef struct pmc pmc_t;
+
+pmc_t* pmc_open(const char* port);
+void pmc_close(pmc_t* pmc);
+int pmc_read_frames(pmc_t* pmc, const uint16_t* frames, int count, uint8_t* out_data, uint8_t* out_status);
+int pmc_write_frames(pmc_t* pmc, const uint16_t* frames, int count, const uint8_t* data, uint8_t* out_status);
+int pmc_read_frame(pmc_t* pmc, uint16_t frame, uint8_t* out_data);
+int pmc_write_frame(pmc_t* pmc, uint16_t frame, const uint8_t* data);
+int pmc_get_id(pmc_t* pmc, uint8_t* out_id, uint8_t* out_flag);
+
+#endif
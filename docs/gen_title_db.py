@@ -0,0 +1,114 @@
+"""
+Generates the flash resident title database (see src/title_db.c) from titleid_name.txt.
+
+usage: gen_title_db.py <titleid_name.txt> <title_prefix.h> <output.c>
+
+Title IDs are packed in the same 32-bit keys used by the SD card index: position of
+the prefix in TITLE_PREFIXES (plus one) followed by the 17 bits of the 5-digit number.
+Names are compressed with a dictionary of frequent words, a word found in the
+dictionary is replaced by a two bytes reference whose first byte is a control
+character (0x01-0x1F), all other bytes are copied as they are. Names are 0 terminated
+and grouped in buckets of TITLE_DB_BUCKET_SIZE, only the offset of each bucket is stored.
+"""
+import collections
+import re
+import sys
+
+BUCKET_SIZE = 16        # must match TITLE_DB_BUCKET_SIZE in title_db.h
+NUMBER_BITS = 17
+MAX_DICT_WORDS = 0x1F * 256
+MIN_WORD_LEN = 3
+
+def read_prefixes(header_path):
+    with open(header_path, encoding='utf-8') as f:
+        return re.findall(r'X\((\w{4})\)', f.read())
+
+def read_titles(db_path, prefixes):
+    titles = {}
+    skipped = 0
+    with open(db_path, 'rb') as f:
+        for line in f.read().split(b'\n'):
+            line = line.rstrip(b'\r')
+            m = re.match(rb'^(\w{4})-(\d{5}) (.*)$', line)
+            if not m or m.group(1).decode() not in prefixes:
+                skipped += line != b''
+                continue
+            key = ((prefixes.index(m.group(1).decode()) + 1) << NUMBER_BITS) | int(m.group(2))
+            name = m.group(3)
+            if any(b < 0x20 for b in name):
+                raise ValueError('control character in name: %r' % line)
+            titles.setdefault(key, name)
+    if skipped:
+        print('gen_title_db: skipped %d lines with unknown prefix or bad format' % skipped)
+    return sorted(titles.items())
+
+def split_words(name):
+    return re.findall(rb'[^ ]+ ?| ', name)
+
+def build_dictionary(names):
+    counts = collections.Counter(w for name in names for w in split_words(name))
+    # bytes saved by replacing every occurrence, minus the cost of storing the word
+    gains = [(count * (len(word) - 2) - len(word) - 4, word) for word, count in counts.items()
+             if len(word) >= MIN_WORD_LEN and count >= 2]
+    gains.sort(key=lambda g: (-g[0], g[1]))
+    return [word for gain, word in gains[:MAX_DICT_WORDS] if gain > 0]
+
+def encode(name, codes):
+    out = bytearray()
+    for word in split_words(name):
+        code = codes.get(word)
+        if code is None:
+            out += word
+        else:
+            out += bytes([(code >> 8) + 1, code & 0xFF])
+    return bytes(out) + b'\0'
+
+def c_bytes(data, indent='\t'):
+    rows = []
+    for i in range(0, len(data), 16):
+        rows.append(indent + ', '.join('0x%02x' % b for b in data[i:i + 16]) + ',')
+    return '\n'.join(rows)
+
+def c_words(values, indent='\t'):
+    rows = []
+    for i in range(0, len(values), 8):
+        rows.append(indent + ', '.join('0x%08x' % v for v in values[i:i + 8]) + ',')
+    return '\n'.join(rows)
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit(__doc__)
+    prefixes = read_prefixes(sys.argv[2])
+    titles = read_titles(sys.argv[1], prefixes)
+    dictionary = build_dictionary([name for key, name in titles])
+    codes = {word: i for i, word in enumerate(dictionary)}
+
+    names = bytearray()
+    bucket_ofs = []
+    for i, (key, name) in enumerate(titles):
+        if i % BUCKET_SIZE == 0:
+            bucket_ofs.append(len(names))
+        names += encode(name, codes)
+
+    dict_data = bytearray()
+    dict_ofs = []
+    for word in dictionary:
+        dict_ofs.append(len(dict_data))
+        dict_data += word
+    dict_ofs.append(len(dict_data))
+
+    with open(sys.argv[3], 'w', encoding='utf-8') as f:
+        f.write('/* Generated by docs/gen_title_db.py from %s, do not edit */\n' % sys.argv[1].replace('\\', '/').split('/')[-1])
+        f.write('#include "title_db.h"\n\n')
+        f.write('const uint32_t title_db_count = %d;\n' % len(titles))
+        f.write('const uint32_t title_db_dict_count = %d;\n\n' % len(dictionary))
+        f.write('const uint32_t title_db_keys[] = {\n%s\n};\n\n' % c_words([key for key, name in titles]))
+        f.write('const uint32_t title_db_bucket_ofs[] = {\n%s\n};\n\n' % c_words(bucket_ofs))
+        f.write('const uint8_t title_db_names[] = {\n%s\n};\n\n' % c_bytes(names))
+        f.write('const uint32_t title_db_dict_ofs[] = {\n%s\n};\n\n' % c_words(dict_ofs))
+        f.write('const uint8_t title_db_dict[] = {\n%s\n};\n' % c_bytes(dict_data or b'\0'))
+    raw = sum(len(name) + 1 for key, name in titles)
+    print('gen_title_db: %d titles, names %d -> %d bytes (+%d dictionary)' % (len(titles), raw, len(names), len(dict_data)))
+
+if __name__ == '__main__':
+    main()
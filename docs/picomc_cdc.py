@@ -0,0 +1,277 @@
+"""
+Host side of the PicoMemcard CDC protocol (see src/cdc_protocol.c), requires pyserial.
+
+usage: picomc_cdc.py <port> stats
+       picomc_cdc.py <port> list
+       picomc_cdc.py <port> read <image|-> <output.mcr> [first sector] [sector count]
+       picomc_cdc.py <port> write <image|-> <input.mcr> [first sector]
+       picomc_cdc.py <port> switch <image>
+       picomc_cdc.py <port> create
+       picomc_cdc.py <port> dex <image|->
+       picomc_cdc.py <port> compact
+       picomc_cdc.py <port> scan
+
+"-" stands for the image being served. "dex" selects the image accessed by DexDrive
+software (e.g. MemcardRex) opening the same port. Whole images are moved as a series of requests of
+MAX_SECTORS sectors, up to WINDOW of them in flight, each LZ compressed when smaller.
+"""
+import struct
+import sys
+import time
+import zlib
+
+import serial
+
+MAGIC = b'PM'
+HEADER = struct.Struct('<2sBBBBH')
+SEC_SIZE = 128
+SEC_COUNT = 1024
+MAX_SECTORS = 32        # must match CDC_MAX_SECTORS in config.h
+WINDOW = 4              # requests in flight
+
+OP_STATS, OP_LIST, OP_READ, OP_WRITE, OP_SWITCH, OP_CREATE, OP_DEX_IMAGE, OP_FRAMES, OP_COMPACT, OP_SCAN = range(1, 11)
+FLAG_COMPRESSED = 0x01
+FLAG_COMPRESS = 0x02
+SCAN_PROBLEMS = ['bad size', 'bad checksum', 'broken chain', 'bad save', 'read error', 'bad header']
+STATUS = ['ok', 'bad frame', 'unknown operation', 'bad parameter', 'busy', 'no such image',
+          'unsupported', 'I/O error']
+STATUS_BUSY = 4
+BUSY_RETRIES = 8        # attempts of a request answered busy, waiting twice as long each time
+BUSY_DELAY = 0.05       # seconds before the first retry
+
+MIN_MATCH = 3
+MAX_MATCH = 0x7F + MIN_MATCH
+MAX_LITERALS = 0x80
+
+def lz_compress(data):
+    """Same format as src/lz.c, greedy with the most recent candidate of each 3 bytes sequence."""
+    out = bytearray()
+    head = {}
+    literal_start = i = 0
+    def literals(end):
+        for start in range(literal_start, end, MAX_LITERALS):
+            run = data[start:min(end, start + MAX_LITERALS)]
+            out.append(len(run) - 1)
+            out.extend(run)
+    while i + MIN_MATCH <= len(data):
+        key = data[i:i + MIN_MATCH]
+        candidate = head.get(key)
+        head[key] = i
+        match = 0
+        if candidate is not None:
+            while match < MAX_MATCH and i + match < len(data) and data[candidate + match] == data[i + match]:
+                match += 1
+        if match < MIN_MATCH:
+            i += 1
+            continue
+        literals(i)
+        out += bytes([0x80 | (match - MIN_MATCH)]) + struct.pack('<H', i - candidate)
+        i += match
+        literal_start = i
+    literals(len(data))
+    return bytes(out)
+
+def lz_decompress(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        token = data[i]
+        i += 1
+        if token < 0x80:
+            out += data[i:i + token + 1]
+            i += token + 1
+        else:
+            distance, = struct.unpack_from('<H', data, i)
+            i += 2
+            for _ in range((token & 0x7F) + MIN_MATCH):
+                out.append(out[-distance])
+    return bytes(out)
+
+class ProtocolError(Exception):
+    pass
+
+class BusyError(ProtocolError):
+    """Device could not serve the request right now (e.g. reloads pending), it may be sent again."""
+    pass
+
+class PicoMemcard:
+    def __init__(self, port):
+        self.port = serial.Serial(port, timeout=5)
+        self.port.reset_input_buffer()
+        self.seq = 0
+
+    def send(self, op, payload=b'', flags=0):
+        seq = self.seq
+        self.seq = (self.seq + 1) & 0xFF
+        frame = HEADER.pack(MAGIC, op, seq, flags, 0, len(payload)) + payload
+        self.port.write(frame + struct.pack('<I', zlib.crc32(frame)))
+        return seq
+
+    def receive(self, seq):
+        header = self.port.read(HEADER.size)
+        if len(header) != HEADER.size:
+            raise ProtocolError('timeout')
+        magic, op, rseq, flags, status, length = HEADER.unpack(header)
+        body = self.port.read(length + 4)
+        if magic != MAGIC or len(body) != length + 4 or zlib.crc32(header + body[:length]) != struct.unpack('<I', body[length:])[0]:
+            raise ProtocolError('corrupted response')
+        if rseq != seq:
+            raise ProtocolError('response %d out of order, expected %d' % (rseq, seq))
+        if status == STATUS_BUSY:
+            raise BusyError(STATUS[status])
+        if status:
+            raise ProtocolError(STATUS[status] if status < len(STATUS) else 'status %d' % status)
+        payload = body[:length]
+        return lz_decompress(payload) if flags & FLAG_COMPRESSED else payload
+
+    @staticmethod
+    def _backoff(attempt, error):
+        if attempt + 1 >= BUSY_RETRIES:
+            raise error
+        time.sleep(BUSY_DELAY * (1 << attempt))
+
+    def request(self, op, payload=b'', flags=0):
+        for attempt in range(BUSY_RETRIES):
+            try:
+                return self.receive(self.send(op, payload, flags))
+            except BusyError as e:
+                self._backoff(attempt, e)
+
+    def pipeline(self, requests):
+        """Sends (op, payload, flags) requests keeping WINDOW of them in flight, returns the responses in order.
+        Requests answered busy are sent again after the ones in flight, so every request ends up served."""
+        requests = list(requests)
+        responses = [None] * len(requests)
+        pending = []            # (seq, index, attempt) in the order the device answers
+        def receive_next():
+            seq, index, attempt = pending.pop(0)
+            try:
+                responses[index] = self.receive(seq)
+            except BusyError as e:
+                self._backoff(attempt, e)
+                pending.append((self.send(*requests[index]), index, attempt + 1))
+        for index, request in enumerate(requests):
+            if len(pending) == WINDOW:
+                receive_next()
+            pending.append((self.send(*request), index, 0))
+        while pending:
+            receive_next()
+        return responses
+
+    def stats(self):
+        p = self.request(OP_STATS)
+        fields = struct.unpack_from('<IBIIIIBI6I', p)
+        name = p[51:51 + p[50]].decode()
+        return {
+            'uptime_ms': fields[0], 'serving': bool(fields[1]), 'images': fields[2],
+            'elided_writes': fields[3], 'pending_syncs': fields[4], 'pending_reloads': fields[5],
+            'pending_commit': bool(fields[6]), 'sd_baud_rate': fields[7],
+            'cache_data': fields[8:10], 'cache_dir': fields[10:12], 'cache_fat': fields[12:14],
+            'active': name,
+        }
+
+    def list(self):
+        names = []
+        while True:
+            p = self.request(OP_LIST, struct.pack('<H', len(names)))
+            count, = struct.unpack_from('<H', p)
+            i = 2
+            while i < len(p):
+                names.append(p[i + 1:i + 1 + p[i]].decode())
+                i += 1 + p[i]
+            if len(names) >= count or i == 2:
+                return names
+
+    @staticmethod
+    def _name(image):
+        name = b'' if image in (None, '-') else image.encode()
+        return bytes([len(name)]) + name
+
+    def read(self, image, first=0, count=SEC_COUNT):
+        requests = []
+        for sector in range(first, first + count, MAX_SECTORS):
+            n = min(MAX_SECTORS, first + count - sector)
+            requests.append((OP_READ, self._name(image) + struct.pack('<HH', sector, n), FLAG_COMPRESS))
+        return b''.join(self.pipeline(requests))
+
+    def write(self, image, data, first=0):
+        requests = []
+        for ofs in range(0, len(data), MAX_SECTORS * SEC_SIZE):
+            chunk = data[ofs:ofs + MAX_SECTORS * SEC_SIZE]
+            params = self._name(image) + struct.pack('<HH', first + ofs // SEC_SIZE, len(chunk) // SEC_SIZE)
+            packed = lz_compress(chunk)
+            if len(packed) < len(chunk):
+                requests.append((OP_WRITE, params + packed, FLAG_COMPRESSED))
+            else:
+                requests.append((OP_WRITE, params + chunk, 0))
+        self.pipeline(requests)
+
+    def switch(self, image):
+        self.request(OP_SWITCH, self._name(image))
+
+    def dex_image(self, image):
+        self.request(OP_DEX_IMAGE, self._name(image))
+
+    def compact(self):
+        return self.request(OP_COMPACT)[0]
+
+    def scan(self):
+        p = self.request(OP_SCAN)
+        fields = struct.unpack_from('<6I', p)
+        stats = dict(zip(('passes', 'position', 'images', 'scanned', 'skipped', 'bad'), fields))
+        bad = []
+        i = 24
+        while i < len(p):
+            problems = [text for bit, text in enumerate(SCAN_PROBLEMS) if p[i] & (1 << bit)]
+            bad.append((p[i + 2:i + 2 + p[i + 1]].decode(), problems))
+            i += 2 + p[i + 1]
+        return stats, bad
+
+    def create(self):
+        p = self.request(OP_CREATE)
+        return p[1:1 + p[0]].decode()
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit(__doc__)
+    mc = PicoMemcard(sys.argv[1])
+    cmd, args = sys.argv[2], sys.argv[3:]
+    start = time.monotonic()
+    if cmd == 'stats':
+        for key, value in mc.stats().items():
+            print('%s: %s' % (key, value))
+    elif cmd == 'list':
+        print('\n'.join(mc.list()))
+    elif cmd == 'read' and len(args) >= 2:
+        first = int(args[2]) if len(args) > 2 else 0
+        count = int(args[3]) if len(args) > 3 else SEC_COUNT - first
+        data = mc.read(args[0], first, count)
+        with open(args[1], 'wb') as f:
+            f.write(data)
+        print('read %d bytes in %.2fs' % (len(data), time.monotonic() - start))
+    elif cmd == 'write' and len(args) >= 2:
+        with open(args[1], 'rb') as f:
+            data = f.read()
+        if len(data) % SEC_SIZE:
+            sys.exit('input size must be a multiple of %d bytes' % SEC_SIZE)
+        mc.write(args[0], data, int(args[2]) if len(args) > 2 else 0)
+        print('wrote %d bytes in %.2fs' % (len(data), time.monotonic() - start))
+    elif cmd == 'switch' and len(args) == 1:
+        mc.switch(args[0])
+    elif cmd == 'create':
+        print(mc.create())
+    elif cmd == 'dex' and len(args) == 1:
+        mc.dex_image(args[0])
+    elif cmd == 'compact':
+        print('%d blocks moved' % mc.compact())
+    elif cmd == 'scan':
+        stats, bad = mc.scan()
+        for key, value in stats.items():
+            print('%s: %s' % (key, value))
+        for name, problems in bad:
+            print('%s: %s' % (name, ', '.join(problems)))
+    else:
+        sys.exit(__doc__)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,45 @@
+#ifndef __BLOCK_STORE_H__
+#define __BLOCK_STORE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ff.h"
+#include "memory_card.h"
+
+/* Error codes */
+#define BS_OK				0
+#define BS_BAD_PARAM		1
+#define BS_FILE_OPEN_ERR	2
+#define BS_FILE_READ_ERR	3
+#define BS_FILE_WRITE_ERR	4
+#define BS_BAD_MANIFEST		5
+#define BS_HASH_COLLISION	6
+
+#define BS_MANIFEST_EXT		".MCM"
+
+typedef uint64_t block_hash_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	block_hash_t blocks[MC_BLOCK_COUNT];	// content hash of every block of the image
+} block_manifest_t;
+
+bool block_store_is_manifest(uint8_t* file_name);
+block_hash_t block_store_hash(const uint8_t* block_data);
+uint8_t* block_store_scratch_block();
+
+uint32_t block_store_read_manifest(uint8_t* file_name, block_manifest_t* out_manifest);
+uint32_t block_store_write_manifest(uint8_t* file_name, block_manifest_t* manifest);
+uint32_t block_store_put(const uint8_t* block_data, uint32_t refs, block_hash_t* out_hash);
+uint32_t block_store_ref(block_hash_t hash, int32_t amount);
+uint32_t block_store_load(block_hash_t hash, uint8_t* out_block);
+uint32_t block_store_open_block(block_hash_t hash, FIL* out_fil);
+uint32_t block_store_set_block(uint8_t* manifest_name, uint8_t block, FIL* src, FSIZE_t src_offset);
+uint32_t block_store_write_block(uint8_t* manifest_name, uint8_t block, const uint8_t* block_data);
+
+uint32_t block_store_create_image(uint8_t* manifest_name, const uint8_t* directory_block);
+uint32_t block_store_clone(uint8_t* src_manifest_name, uint8_t* dst_manifest_name);
+uint32_t block_store_export(uint8_t* manifest_name, uint8_t* mcr_name);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __BYTE_ORDER_H__
+#define __BYTE_ORDER_H__
+
+#include <stdint.h>
+
+/* Little-endian fields of card frames, FAT entries and protocol frames, at any alignment */
+
+static inline uint16_t get16(const uint8_t* p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get32(const uint8_t* p) {
+	return get16(p) | ((uint32_t) get16(p + 2) << 16);
+}
+
+static inline void put16(uint8_t* p, uint16_t v) {
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static inline void put32(uint8_t* p, uint32_t v) {
+	put16(p, v & 0xFFFF);
+	put16(p + 2, v >> 16);
+}
+
+#endif
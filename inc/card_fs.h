@@ -0,0 +1,68 @@
+#ifndef __CARD_FS_H__
+#define __CARD_FS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "memory_card.h"
+
+/* Directory frames (sectors 1 to 15, one per data block) */
+#define CF_FRAME_FIRST		0x51	// first block of a save
+#define CF_FRAME_MIDDLE		0x52
+#define CF_FRAME_LAST		0x53
+#define CF_FRAME_FREE		0xA0	// 0xA1 to 0xA3 are deleted saves, free as well
+#define CF_FRAME_SIZE		0x04	// save size in bytes, first block only
+#define CF_FRAME_NEXT		0x08	// next block - 1, CF_NO_NEXT on the last block
+#define CF_FRAME_NAME		0x0A	// save name, first block only
+#define CF_FRAME_CHECKSUM	(MC_SEC_SIZE - 1)
+#define CF_NO_NEXT			0xFFFF
+
+#define CF_SAVE_BLOCKS		(MC_BLOCK_COUNT - 1)
+#define CF_NAME_LEN			20		// region (2), product code (10) and game specific part
+#define CF_PRODUCT_LEN		10
+#define CF_TITLE_LEN		LCD_SCROLL_MAX_LEN
+
+/* Block types, as told by their directory frame */
+#define CF_BLOCK_FREE		0
+#define CF_BLOCK_FIRST		1
+#define CF_BLOCK_MIDDLE		2
+#define CF_BLOCK_LAST		3
+
+typedef struct {
+	uint8_t first_block;		// 0 = no save starting at this slot
+	uint8_t block_count;
+	uint8_t blocks[CF_SAVE_BLOCKS];	// blocks of the save in link order
+	char region;				// 'J', 'U', 'E' or 0 when unknown
+	char name[CF_NAME_LEN + 1];
+	char product_code[CF_PRODUCT_LEN + 1];	// title ID, e.g. SLUS-00594
+	bool title_resolved;
+	char title[CF_TITLE_LEN + 1];	// name of the game, empty when unknown
+} card_fs_save_t;
+
+typedef struct {
+	const uint8_t* frames;		// directory block the model is built from
+	uint8_t block_type[MC_BLOCK_COUNT];
+	uint8_t owner[MC_BLOCK_COUNT];	// first block of the save using each block, 0 = none
+	card_fs_save_t saves[CF_SAVE_BLOCKS];	// indexed by first block - 1
+	uint8_t used_blocks;
+	volatile uint8_t frame_gen[MC_BLOCK_COUNT];	// bumped by the simulation core on every frame write
+	uint8_t parsed_gen[MC_BLOCK_COUNT];		// generation of each frame the model reflects
+} card_fs_t;
+
+void card_fs_build(card_fs_t* fs, const uint8_t* directory);
+bool card_fs_refresh(card_fs_t* fs);
+bool card_fs_resolve_next_title(card_fs_t* fs);
+card_fs_save_t* card_fs_get_save(card_fs_t* fs, uint8_t block);
+const char* card_fs_get_title(card_fs_save_t* save);
+void card_fs_set_frame(uint8_t* frame, uint8_t state, uint32_t size, uint16_t next, const uint8_t* name);
+uint16_t card_fs_compact(card_fs_t* fs, uint8_t* data, uint8_t* temp_block);
+
+/**
+ * @brief Records a write to a sector, only directory frames are tracked (simulation core)
+ */
+static inline void card_fs_sector_written(card_fs_t* fs, sector_t sector) {
+	if(sector >= 1 && sector < MC_BLOCK_COUNT)
+		fs->frame_gen[sector]++;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef __CDC_PROTOCOL_H__
+#define __CDC_PROTOCOL_H__
+
+#include <stdint.h>
+#include "config.h"
+#include "memory_card.h"
+
+/*
+	Frame layout (little endian), requests and responses alike:
+	magic (2) | op (1) | seq (1) | flags (1) | status (1) | payload length (2) | payload | CRC-32 of all previous bytes (4)
+	Responses carry the op and seq of their request and are sent in the order requests were received,
+	so the host can keep several requests in flight. An empty image name stands for the image being served.
+*/
+#define CP_MAGIC0			'P'
+#define CP_MAGIC1			'M'
+#define CP_HEADER_SIZE		8
+#define CP_CRC_SIZE			4
+#define CP_MAX_DATA			(CDC_MAX_SECTORS * MC_SEC_SIZE)
+#define CP_MAX_PAYLOAD		(CP_MAX_DATA + 64)		// data and its parameters
+
+/* Operations */
+#define CP_OP_STATS			0x01	// -> device stats
+#define CP_OP_LIST			0x02	// first index (2) -> image count (2), then name length (1) and name of as many images as fit
+#define CP_OP_READ			0x03	// name length (1), name, first sector (2), sector count (2) -> sector data
+#define CP_OP_WRITE			0x04	// name length (1), name, first sector (2), sector count (2), sector data
+#define CP_OP_SWITCH		0x05	// name length (1), name
+#define CP_OP_CREATE		0x06	// -> name length (1), name of the new image
+#define CP_OP_DEX_IMAGE		0x07	// name length (1), name: image accessed by the DexDrive emulation
+#define CP_OP_FRAMES		0x08	// batch of frame operations on the image being served -> their results in the same order
+#define CP_OP_COMPACT		0x09	// -> blocks moved (1): compacts the image being served
+#define CP_OP_SCAN			0x0A	// -> integrity scan stats (24), then problems (LS_*) (1), name length (1) and name of each bad image
+
+/* Frame operations, answered with a status (MC_GOOD, MC_BAD_SEC or MC_BAD_CHK to retry) and the flag byte */
+#define CP_FRAME_READ		'R'		// frame (2) -> status, flag, frame data
+#define CP_FRAME_WRITE		'W'		// frame (2), frame data -> status, flag
+#define CP_FRAME_ID			'S'		// -> status, flag, ID command answer (MC_ID_SIZE)
+
+/* Flags */
+#define CP_FLAG_COMPRESSED	0x01	// sector data is LZ compressed (see lz.h)
+#define CP_FLAG_COMPRESS	0x02	// request: compress the sector data of the response when smaller
+
+/* Status codes */
+#define CP_OK				0
+#define CP_ERR_FRAME		1		// bad checksum or payload length
+#define CP_ERR_UNKNOWN_OP	2
+#define CP_ERR_BAD_PARAM	3
+#define CP_ERR_BUSY			4		// memory card not served or not ready, retry later
+#define CP_ERR_NO_IMAGE		5
+#define CP_ERR_UNSUPPORTED	6		// images kept as manifests can only be accessed while active, .VMP ones are read-only
+#define CP_ERR_IO			7
+
+void cdc_protocol_task();
+bool cdc_protocol_write(const uint8_t* data, uint32_t len);
+uint32_t cdc_image_read(uint8_t* file_name, sector_t first, uint32_t count, uint8_t* out_data);
+uint32_t cdc_image_write(uint8_t* file_name, sector_t first, uint32_t count, const uint8_t* data);
+
+#endif
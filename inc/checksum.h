@@ -0,0 +1,13 @@
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+#include <stdint.h>
+
+#define CRC32_INIT	0xFFFFFFFF
+#define FNV1A_INIT	0x811C9DC5
+
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, uint32_t length);
+#define crc32(data, length) (~crc32_update(CRC32_INIT, (data), (length)))
+uint32_t fnv1a_update(uint32_t hash, const uint8_t* data, uint32_t length);
+
+#endif
@@ -3,11 +3,53 @@
 
 /* Global configuration options for PicoMemcard */
 #define TUD_MOUNT_TIMEOUT	3000			// max time (in ms) before giving up on MSC mode (USB) and starting memcard simulation
-#define MSC_WRITE_SYNC_TIMEOUT 1 * 1000		// time (in ms) expired since last MSC write before exporting RAM disk into LFS
+#define MSC_WRITE_SYNC_TIMEOUT 1 * 1000		// time (in ms) expired since last MSC write before the write-back cache is flushed to the SD card
+#define MSC_WRITE_CACHE_BLOCKS	32			// sectors held by the MSC write-back cache (not used in USB_CONCURRENT_MODE)
+#define MSC_WRITE_CACHE_MAX_RUN	4			// longer MSC writes (file data) go straight to the SD card
+//#define MSC_VIRTUAL_FAT				// expose a FAT volume generated from the images (one folder per image, one .mcs file per save) instead of the raw SD card
+#define VFAT_MAX_IMAGES	1024				// images shown in the virtual FAT volume
+#define VFAT_IMAGE_CACHE	8				// images whose saves are kept parsed by the virtual FAT volume
+//#define USB_CONCURRENT_MODE				// keep USB mass storage running while the memory card is served (USB powered rigs with 3.3V line isolated only)
+#define MC_RELOAD_MAX_SECTORS	64			// memory card sectors written by the USB host waiting to be reloaded by the simulation core
+#define MC_RELOAD_TIMEOUT	50				// time (in ms) a USB write waits for the simulation core to reload the previous one
+#define MC_HOST_SYNC_MAX_SECTORS	(MC_SEC_COUNT / 2)	// sync queue entries CDC writes may fill, the rest is kept for the console
+#define CDC_MAX_SECTORS	32					// memory card sectors moved by a single CDC read or write request (at most MC_RELOAD_MAX_SECTORS)
+#define CDC_WRITE_TIMEOUT	500				// time (in ms) a CDC response waits for the host to read before being dropped
+#define MSC_READ_AHEAD_BLOCKS	16			// sectors read ahead of sequential MSC reads (must be a power of 2, not used in USB_CONCURRENT_MODE)
 #define IDLE_AUTOSYNC_TIMEOUT 5 * 1000		// time (in ms) the memory card must be inactive before automatic sync from RAM to LFS
 #define MAX_MC_FILENAME_LEN	32				// max length of memory card file name (including extension)
-#define MAX_MC_IMAGES	255					// maximum number of different mc images
+#define MAX_MC_IMAGES	2048				// maximum number of different mc images
+#define MC_INDEX_FILE	"MCINDEX.BIN"		// sorted list of mc images, avoids scanning the SD card at every boot
+#define MC_INDEX_RECONCILE_DELAY	3 * 1000	// time (in ms) the memory card must be idle before checking the image index against the SD card
 #define MC_RECONNECT_TIME	1000				// time (in ms) the memory card stays disconnected when simulating reconnection
+#define SAVE_BURST_TIMEOUT	2 * 1000		// time (in ms) without sector writes after which a save is considered complete
+#define SAVE_HISTORY_MAX_ENTRIES	8		// number of completed saves kept in the history of each image
+#define SAVE_HISTORY_DIR	"HISTORY"		// directory holding the save history of every image
+#define SAVE_EXPORT_DIR	"SAVES"			// directory receiving saves exported from the images (.MCS/.PSV)
+#define SAVE_IMPORT_DIR	"IMPORT"		// directory holding saves to import into the image being served, moved to SAVE_EXPORT_DIR once imported
+#define BLOCK_STORE_DIR		"BLOCKS"		// directory holding the blocks shared by images stored as manifests (.MCM)
+#define BLOCK_STORE_COMMIT_TIMEOUT	500		// time (in ms) without sector writes before modified blocks are committed to the block store
+#define LIBRARY_SCAN_FILE	"MCSCAN.BIN"		// result of the last integrity scan of every image, unchanged images are not read again
+#define LIBRARY_SCAN_INTERVAL	30 * 60 * 1000	// time (in ms) between two integrity scans of the whole image library
+//#define MC_BLOCK_STORE					// create new images as manifests in the block store instead of plain .MCR files
+//#define MC_FLASH_STORE					// without SD card, serve a single image kept in onboard flash instead of halting
+#define FLASH_STORE_SIZE	512 * 1024		// bytes at the end of the onboard flash holding the image log (multiple of 4096)
+#define FLASH_STORE_BATCH	64				// sectors staged in RAM before being programmed into flash
+#define FLASH_STORE_RESERVE	40				// erased flash sectors kept ready, so that saving never has to wait for an erase
+#define FLASH_STORE_WEAR_DELTA	64			// spread of erase counts after which data that never changes is moved
+#define FLASH_STORE_PROGRAM_QUIET	2 * 1000	// time (in us) since the last memory card access before a flash page is programmed
+#define FLASH_STORE_ERASE_QUIET	200 * 1000	// time (in us) since the last memory card access before a flash sector is erased
+
+/* LCD Configuration */
+#define LCD_REFRESH_INTERVAL_US	250			// period (in us) of the timer sending changed characters to the LCD, one character per tick
+#define LCD_SCROLL_INTERVAL_MS	350			// time (in ms) between two steps of a scrolling line
+#define LCD_SCROLL_PAUSE_MS	1500			// time (in ms) the start of a scrolling line stays visible
+#define LCD_SCROLL_MAX_LEN	64				// longest text that can scroll on a line
+#define LCD_SCROLL_GAP	4					// blank characters between the end and the start of a scrolling text
+
+/* LED Configuration */
+#define LED_TICK_MS	10						// period (in ms) of the timer playing LED patterns
+#define LED_EVENT_QUEUE_LEN	8				// LED patterns waiting to be played, further ones are dropped
 
 /* Board targeted by build */
 //#define PICO
@@ -32,7 +74,13 @@
 
 /* SD Card Configuration */
 #define BLOCK_SIZE	512				// SD card communicate using only 512 block size for consistency
-#define BAUD_RATE	5000 * 1000
+#define BAUD_RATE	5000 * 1000			// initial SPI clock, raised after init up to SD_MAX_BAUD_RATE if the card keeps up
+#define SD_MAX_BAUD_RATE	31250 * 1000	// highest SPI clock tried when negotiating the SD bus speed
+#define SD_PROFILE_FILE		"SDPROF.BIN"	// negotiated speed and measured latency of the SD card, avoids benchmarking at every boot
+#define SD_SCRATCH_FILE		"SDSCRATCH.BIN"	// contiguous file used to test the SD card at each speed
+#define DISK_CACHE_SETS		8				// number of sets of the sector cache between FatFs and the SD card
+#define DISK_CACHE_WAYS		4				// sectors cached in each set (cache size is DISK_CACHE_SETS * DISK_CACHE_WAYS * BLOCK_SIZE)
+#define SD_SYNC_BATCH_BUDGET	5 * 1000		// time (in us) the sync loop may spend syncing sectors before handling other requests
 #ifdef PICO
 	#define PIN_MISO	16
 	#define PIN_MOSI	19
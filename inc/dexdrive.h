@@ -0,0 +1,11 @@
+#ifndef __DEXDRIVE_H__
+#define __DEXDRIVE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+bool dexdrive_feed(uint8_t byte);
+bool dexdrive_is_busy();
+void dexdrive_set_image(const uint8_t* file_name);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __DISK_CACHE_H__
+#define __DISK_CACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ff.h"
+
+/* Kind of sector held by a cache line, higher kinds stay cached longer */
+enum DISK_CACHE_CLASS {
+	DC_CLASS_DATA,
+	DC_CLASS_DIR,
+	DC_CLASS_FAT,
+	DC_CLASS_COUNT,
+};
+
+typedef struct {
+	uint32_t hits[DC_CLASS_COUNT];
+	uint32_t misses[DC_CLASS_COUNT];
+	uint32_t bypassed;		// multi-sector transfers going straight to the card
+} disk_cache_stats_t;
+
+void disk_cache_get_stats(disk_cache_stats_t* out_stats);
+void disk_cache_invalidate();
+void disk_cache_invalidate_range(LBA_t sector, uint32_t count);
+
+#endif
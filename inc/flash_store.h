@@ -0,0 +1,25 @@
+#ifndef __FLASH_STORE_H__
+#define __FLASH_STORE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "memory_card.h"
+
+/* Error codes */
+#define FL_OK				0
+#define FL_NO_SPACE			1		// store overlaps the firmware, or every flash sector is full of live data
+#define FL_WRITE_ERR		2		// programmed data does not read back
+#define FL_BUSY				3		// console kept accessing the card, maintenance postponed
+
+#define FL_NAME				"FLASH"	// shown instead of an image name
+
+uint32_t flash_store_init();
+void flash_store_load(uint8_t* out_data);
+uint32_t flash_store_write(sector_t sector, const uint8_t* data);
+uint32_t flash_store_flush();
+bool flash_store_has_pending();
+uint32_t flash_store_maintain();
+void flash_store_run_job(uint32_t quiet_us);
+
+#endif
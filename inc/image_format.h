@@ -0,0 +1,25 @@
+#ifndef __IMAGE_FORMAT_H__
+#define __IMAGE_FORMAT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ff.h"
+
+/* Error codes */
+#define IF_OK				0
+#define IF_FILE_OPEN_ERR	1
+#define IF_BAD_FORMAT		2		// size or header not matching any known container
+#define IF_READ_ONLY		3		// container cannot be written back, opened for writing
+
+/* Containers of the raw memory card data, written back in place unless read-only */
+#define IF_FORMAT_RAW		0		// .MCR, .PSM: raw dump
+#define IF_FORMAT_GME		1		// .GME: DexPlorer / InterAct, header with save comments
+#define IF_FORMAT_VGS		2		// .VGS, .MEM: Connectix Virtual Game Station
+#define IF_FORMAT_VMP		3		// .VMP: PSP / PS3 virtual memory card, signed header (read-only)
+
+bool image_format_is_image_name(const uint8_t* file_name);
+bool image_format_is_size_valid(FSIZE_t size);
+bool image_format_is_writable(FSIZE_t data_offset);
+uint32_t image_format_open(FIL* fil, const uint8_t* file_name, BYTE mode, FSIZE_t* out_offset);
+
+#endif
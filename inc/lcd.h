@@ -4,5 +4,7 @@
 void lcd_string(const char *s);
 void lcd_clear(void) ;
 void lcd_set_cursor(int line, int position);
+/* Show s on line, text longer than the display scrolls by itself */
+void lcd_scroll_string(int line, const char *s);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef __LIBRARY_SCAN_H__
+#define __LIBRARY_SCAN_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+
+/* Problems found in an image, 0 = image is sound */
+#define LS_BAD_SIZE			0x01	// not MC_SIZE bytes of card data in a known container, or manifest unreadable
+#define LS_BAD_CHECKSUM		0x02	// header, directory or broken sector list frame fails its XOR checksum
+#define LS_BAD_CHAIN		0x04	// orphan block, unterminated chain or save size not matching its blocks
+#define LS_BAD_SAVE			0x08	// first block of a save without its "SC" header
+#define LS_READ_ERR			0x10	// image or one of its blocks could not be read
+#define LS_BAD_HEADER		0x20	// header frame does not start with "MC"
+
+#define LS_MAX_REPORTED		16		// bad images remembered for the LCD and CDC reports
+
+/* Outcome of a scan step */
+#define LS_STEP_IDLE		0		// nothing to scan
+#define LS_STEP_DONE		1		// one image checked
+#define LS_STEP_BAD			2		// one image checked and newly found bad
+
+typedef struct {
+	uint32_t passes;			// complete scans of the library
+	uint32_t position;			// index position of the next image of the current pass
+	uint32_t scanned;			// images read during the current pass
+	uint32_t skipped;			// unchanged images taken from the cache during the current pass
+	uint32_t bad;				// bad images met by the current pass
+} library_scan_stats_t;
+
+uint32_t library_scan_check(uint8_t* file_name);
+uint32_t library_scan_step(uint8_t* out_file_name, uint8_t* out_flags);
+void library_scan_invalidate(const uint8_t* file_name);
+void library_scan_get_stats(library_scan_stats_t* out_stats);
+bool library_scan_get_bad(uint32_t index, uint8_t* out_file_name, uint8_t* out_flags);
+const char* library_scan_describe(uint8_t flags);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stdint.h>
+
+/*
+	Byte oriented LZ77 used for bulk transfers, every token starts with a control byte t:
+	- t < 0x80: literal run, t + 1 bytes follow
+	- t >= 0x80: match of (t & 0x7F) + LZ_MIN_MATCH bytes, followed by its distance (16-bit, little endian)
+	A mostly empty memory card sector range shrinks to a few bytes per LZ_MAX_MATCH bytes.
+*/
+#define LZ_MIN_MATCH	3
+#define LZ_MAX_MATCH	(0x7F + LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS	0x80
+#define LZ_MAX_INPUT	0xFFFF		// longest buffer compressed in one call
+
+uint32_t lz_compress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t dst_size);
+uint32_t lz_decompress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t dst_size);
+
+#endif
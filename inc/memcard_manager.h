@@ -14,13 +14,18 @@
 #define MM_FILE_OPEN_ERR		6
 #define MM_FILE_WRITE_ERR		7
 
+uint32_t memcard_manager_init();
+uint32_t memcard_manager_reconcile();
 bool memcard_manager_exist(uint8_t* filename);
+uint32_t memcard_manager_find(uint8_t* filename, uint32_t* out_index);
 uint32_t memcard_manager_count();
 uint32_t memcard_manager_get(uint32_t index, uint8_t* out_filename);
 #define memcard_manager_get_first(out_filename) memcard_manager_get(0, (out_filename))
 uint32_t memcard_manager_get_next(uint8_t* filename, uint8_t* out_nextfile);
 uint32_t memcard_manager_get_prev(uint8_t* filename, uint8_t* out_prevfile);
 uint32_t memcard_manager_create(uint8_t* out_filename);
+uint32_t memcard_manager_clone(uint8_t* filename, uint8_t* out_filename);
+const uint8_t* memcard_manager_get_template_block(uint8_t block);
 
 void memcard_manager_write_last_memcard(const char* lastmemcard);
 uint32_t memcard_manager_get_last(uint8_t* out_filename);
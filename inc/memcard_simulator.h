@@ -3,7 +3,36 @@
 #ifndef __MEMCARD_SIMULATOR_H__
 #define __MEMCARD_SIMULATOR_H__
 
+#include <stdbool.h>
+#include "memory_card.h"
+#include "config.h"
+
 _Noreturn
 int simulate_memory_card();
 
+#define MC_ID_SIZE	6		// bytes answered to the ID command (MEMCARD_ID)
+
+uint32_t memcard_simulator_compact(uint32_t* out_blocks);
+
+#ifdef USB_CONCURRENT_MODE
+typedef struct {
+	uint32_t elided_writes;		// sector syncs skipped since contents did not change
+	uint32_t pending_syncs;		// sectors written by the console not stored yet
+	uint32_t pending_reloads;	// sectors written over USB not copied into RAM yet
+	bool pending_commit;		// blocks not committed to the block store yet
+} memcard_simulator_stats_t;
+
+bool memcard_simulator_reserve_reload(uint32_t count);
+void memcard_simulator_reload_sector(sector_t sector, const uint8_t* sector_data);
+bool memcard_simulator_is_reload_pending(sector_t sector);
+bool memcard_simulator_write_sectors(sector_t first, uint32_t count, const uint8_t* data);
+bool memcard_simulator_write_frame(sector_t sector, const uint8_t* data);
+uint8_t memcard_simulator_get_flag();
+void memcard_simulator_get_id(uint8_t* out_id);
+bool memcard_simulator_read_sectors(sector_t first, uint32_t count, uint8_t* out_data);
+void memcard_simulator_get_active(uint8_t* out_file_name);
+uint32_t memcard_simulator_switch(uint8_t* file_name);
+void memcard_simulator_get_stats(memcard_simulator_stats_t* out_stats);
+#endif
+
 #endif
\ No newline at end of file
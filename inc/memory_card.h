@@ -8,6 +8,9 @@
 #define MC_SEC_SIZE			128		// size of single sector in bytes
 #define MC_SEC_COUNT		1024	// number of sector in one memory card
 #define MC_SIZE				MC_SEC_SIZE * MC_SEC_COUNT		// size of memory card in bytes
+#define MC_SEC_PER_BLOCK	64		// number of sectors forming one save block
+#define MC_BLOCK_SIZE		(MC_SEC_SIZE * MC_SEC_PER_BLOCK)	// size of single block in bytes
+#define MC_BLOCK_COUNT		(MC_SEC_COUNT / MC_SEC_PER_BLOCK)	// number of blocks in one memory card (including directory block)
 #define MC_FLAG_BYTE_DEF	0x08	// bit 3 set = new memory card inserted
 
 #define MC_ID1 0x5A
@@ -31,6 +34,15 @@
 typedef struct {
 	uint8_t flag_byte;
 	uint8_t* data;
+	uint32_t* sec_fingerprint;	// fingerprint of the last durable contents of each sector
+	uint32_t* sec_fingerprint_valid;	// bitmap of sectors whose fingerprint matches storage
+	uint32_t elided_writes;		// number of sector syncs skipped since contents did not change
+	bool block_store;			// image is a manifest of blocks kept in the block store
+	bool flash_store;			// image is the one kept in onboard flash (no SD card)
+	bool read_only;				// container cannot be written back (.VMP), changes stay in RAM
+	uint32_t data_offset;		// start of the card data in the image file, after the header of foreign containers
+	uint64_t block_hash[MC_BLOCK_COUNT];	// hash of each block as last committed to the block store
+	uint16_t dirty_blocks;		// bit n set = block n has changes not yet committed to the block store
 } memory_card_t;
 
 typedef uint16_t sector_t;
@@ -40,6 +52,14 @@ uint32_t memory_card_import(memory_card_t* mc, uint8_t* file_name);
 bool memory_card_is_sector_valid(memory_card_t* mc, sector_t sector);
 uint8_t* memory_card_get_sector_ptr(memory_card_t* mc, sector_t sector);
 void memory_card_reset_seen_flag(memory_card_t* mc);
+bool memory_card_is_sector_changed(memory_card_t* mc, sector_t sector);
 uint32_t memory_card_sync_sector(memory_card_t* mc, sector_t sector, uint8_t* file_name);
+uint32_t memory_card_commit(memory_card_t* mc, uint8_t* file_name);
+void memory_card_reload_sector(memory_card_t* mc, sector_t sector, const uint8_t* sector_data);
+bool memory_card_has_pending_commit(memory_card_t* mc);
 uint32_t memory_card_check(uint8_t* file_name);
+uint32_t memory_card_get_elided_writes(memory_card_t* mc);
+#ifdef MC_FLASH_STORE
+uint32_t memory_card_import_flash(memory_card_t* mc);
+#endif
 #endif
\ No newline at end of file
@@ -0,0 +1,15 @@
+#ifndef __MSC_HANDLER_H__
+#define __MSC_HANDLER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "config.h"
+
+void msc_task();
+bool msc_flush();
+#ifdef USB_CONCURRENT_MODE
+bool msc_share_image(uint8_t* file_name, const uint8_t* image_data);
+void msc_unshare_image();
+#endif
+
+#endif
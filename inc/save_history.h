@@ -0,0 +1,27 @@
+#ifndef __SAVE_HISTORY_H__
+#define __SAVE_HISTORY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Error codes */
+#define SH_OK				0
+#define SH_BAD_PARAM		1
+#define SH_NO_ENTRY			2
+#define SH_FILE_OPEN_ERR	3
+#define SH_FILE_READ_ERR	4
+#define SH_FILE_WRITE_ERR	5
+
+typedef struct {
+	uint32_t seq;			// sequence number of the save, increasing for every image
+	uint32_t timestamp;		// time (in ms since boot) at which the save started
+	uint16_t block_mask;	// bit n set = block n was modified by the save
+	uint8_t block_count;	// number of blocks modified by the save
+} save_history_info_t;
+
+uint32_t save_history_record_block(uint8_t* mc_file_name, uint8_t block);
+void save_history_end_burst();
+uint32_t save_history_get_info(uint8_t* mc_file_name, uint32_t index, save_history_info_t* out_info, uint32_t* out_count);
+uint32_t save_history_rollback(uint8_t* mc_file_name, uint32_t amount, save_history_info_t* out_info);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef __SAVE_TRANSFER_H__
+#define __SAVE_TRANSFER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "card_fs.h"
+
+/* Error codes */
+#define ST_OK				0
+#define ST_BAD_PARAM		1
+#define ST_NO_SAVE			2		// block is not used by any save
+#define ST_NO_SPACE			3		// not enough free blocks
+#define ST_NAME_CONFLICT	4		// a save with the same name is already on the image
+#define ST_BAD_FORMAT		5
+#define ST_FILE_OPEN_ERR	6
+#define ST_FILE_READ_ERR	7
+#define ST_FILE_WRITE_ERR	8
+
+#define ST_FILE_NAME_LEN	(sizeof(SAVE_EXPORT_DIR) + CF_NAME_LEN + sizeof(".MCS"))
+
+/* Save file formats */
+#define ST_FORMAT_MCS		0		// directory frame followed by the blocks
+#define ST_FORMAT_PSV		1		// PS3 virtual memory card save
+
+uint32_t save_transfer_export(uint8_t* mc_file_name, uint8_t block, uint8_t format, char* out_file_name);
+uint32_t save_transfer_import(uint8_t* mc_file_name, const char* save_file_name, uint8_t* out_first_block);
+uint32_t save_transfer_import_all(uint8_t* mc_file_name, uint32_t* out_imported);
+
+#endif
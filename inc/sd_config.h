@@ -13,6 +13,23 @@ extern "C" {
     size_t spi_get_num();
     spi_t *spi_get_by_num(size_t num);
 
+    /* SPI clock negotiated for the card and measured transfer latency */
+    typedef struct {
+        uint32_t magic;
+        uint64_t sectors;           // size of the card the profile belongs to
+        uint32_t baud_rate;         // highest SPI clock at which the card passed verification
+        uint32_t read_single_us;    // latency of a single block read
+        uint32_t write_single_us;   // latency of a single block write
+        uint32_t read_multi_us;     // latency of a SD_BENCH_MULTI_BLOCKS blocks read
+        uint32_t write_multi_us;    // latency of a SD_BENCH_MULTI_BLOCKS blocks write
+    } sd_profile_t;
+
+    #define SD_BENCH_MULTI_BLOCKS 8
+
+    void sd_negotiate_speed(sd_card_t *p_sd);
+    const sd_profile_t *sd_get_profile();
+    uint32_t sd_get_sync_batch_size();
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,20 @@
+#ifndef __TITLE_DB_H__
+#define __TITLE_DB_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TITLE_DB_BUCKET_SIZE	16	// names stored between two bucket offsets, must match docs/gen_title_db.py
+
+/* Tables generated at build time by docs/gen_title_db.py, kept in flash */
+extern const uint32_t title_db_count;
+extern const uint32_t title_db_dict_count;
+extern const uint32_t title_db_keys[];
+extern const uint32_t title_db_bucket_ofs[];
+extern const uint8_t title_db_names[];
+extern const uint32_t title_db_dict_ofs[];
+extern const uint8_t title_db_dict[];
+
+bool title_db_find(uint32_t key, char* out_name, uint32_t max_len);
+
+#endif
@@ -1,7 +1,16 @@
-#ifndef __TITLE_ID_H__
-#define __TITLE_ID_H__
-
-void title_id_make_index();
-const char* title_id_find_name(const char* title_id);
-
+#ifndef __TITLE_ID_H__
+#define __TITLE_ID_H__
+
+#include <stdint.h>
+
+typedef struct {
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t evictions;
+} title_cache_stats_t;
+
+void title_id_make_index();
+void title_id_get_cache_stats(title_cache_stats_t* out_stats);
+const char* title_id_find_name(const char* title_id);
+
 #endif
\ No newline at end of file
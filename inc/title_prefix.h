@@ -0,0 +1,33 @@
+#ifndef __TITLE_PREFIX_H__
+#define __TITLE_PREFIX_H__
+
+/***
+ *	Known title ID prefixes (first 4 letters of e.g. SLUS-00594).
+ *	The position of a prefix is part of the packed title key, so new
+ *	prefixes must keep the list in alphabetical order to keep keys sorted
+ *	like the lines of titleid_name.txt. Keys change whenever this list does,
+ *	stored indexes are rebuilt automatically.
+ */
+#define TITLE_PREFIXES(X) \
+	X(PAPX) \
+	X(PBPX) \
+	X(PCPD) \
+	X(PCPX) \
+	X(PEPX) \
+	X(PTPX) \
+	X(PUPX) \
+	X(SCED) \
+	X(SCES) \
+	X(SCPM) \
+	X(SCPS) \
+	X(SCUS) \
+	X(SCZS) \
+	X(SIPS) \
+	X(SLED) \
+	X(SLES) \
+	X(SLKA) \
+	X(SLPM) \
+	X(SLPS) \
+	X(SLUS)
+
+#endif
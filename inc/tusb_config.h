@@ -97,15 +97,15 @@
 #define CFG_TUD_MIDI             0
 #define CFG_TUD_VENDOR           0
 
-// CDC FIFO size of TX and RX
-#define CFG_TUD_CDC_RX_BUFSIZE   (TUD_OPT_HIGH_SPEED ? 512 : 64)
-#define CFG_TUD_CDC_TX_BUFSIZE   (TUD_OPT_HIGH_SPEED ? 512 : 64)
+// CDC FIFO size of TX and RX, large enough to keep pipelined protocol requests streaming
+#define CFG_TUD_CDC_RX_BUFSIZE   (TUD_OPT_HIGH_SPEED ? 2048 : 1024)
+#define CFG_TUD_CDC_TX_BUFSIZE   (TUD_OPT_HIGH_SPEED ? 2048 : 1024)
 
 // CDC Endpoint transfer buffer size, more is faster
 #define CFG_TUD_CDC_EP_BUFSIZE   (TUD_OPT_HIGH_SPEED ? 512 : 64)
 
-// MSC Buffer size of Device Mass storage
-#define CFG_TUD_MSC_EP_BUFSIZE   512
+// MSC Buffer size of Device Mass storage, several sectors so the SD card is accessed with multi-block transfers
+#define CFG_TUD_MSC_EP_BUFSIZE   (8 * 512)
 
 #ifdef __cplusplus
  }
@@ -0,0 +1,21 @@
+#ifndef __VIRTUAL_FAT_H__
+#define __VIRTUAL_FAT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Error codes */
+#define VF_OK				0
+#define VF_NOT_MOUNTED		1
+#define VF_FILE_OPEN_ERR	2
+#define VF_FILE_READ_ERR	3
+#define VF_FILE_WRITE_ERR	4
+#define VF_READ_ONLY		5		// sector not backed by a writable save
+
+uint32_t virtual_fat_init();
+bool virtual_fat_is_ready();
+uint32_t virtual_fat_sector_count();
+uint32_t virtual_fat_read(uint32_t sector, uint8_t* out_buffer);
+uint32_t virtual_fat_write(uint32_t sector, const uint8_t* buffer);
+
+#endif
@@ -0,0 +1,357 @@
+#include "block_store.h"
+#include <string.h>
+#include <stdio.h>
+#include "config.h"
+#include "checksum.h"
+
+/***
+ *	Content-addressed storage for memory card blocks.
+ *
+ *	An image stored in this format is a small manifest (N.MCM) listing the hash of
+ *	each of its 16 blocks. Blocks live once in BLOCK_STORE_DIR, named after their
+ *	hash, and carry a reference count of the manifests using them. Identical blocks
+ *	(empty ones, the same save copied between cards) are therefore stored only once.
+ *
+ *	Block file layout: block data (MC_BLOCK_SIZE bytes) followed by a small header,
+ *	so that data stays aligned with SD sectors and can be moved with multi-block transfers.
+ *
+ *	Writes are ordered so that a power loss can only leak references (blocks kept
+ *	around for too long), never leave a manifest pointing to a missing block.
+ */
+
+#define BS_MANIFEST_MAGIC	0x4D434D50	// "PMCM"
+#define BS_MANIFEST_VERSION	1
+#define BS_BLOCK_MAGIC		0x4B424D50	// "PMBK"
+#define BS_BLOCK_NAME_LEN	(sizeof(BLOCK_STORE_DIR) + 16 + sizeof(".BLK"))
+
+typedef struct {
+	uint32_t magic;
+	uint32_t refs;
+} block_header_t;
+
+static uint8_t scratch_block[MC_BLOCK_SIZE] __attribute__((aligned(4)));	// word aligned for the library scanner
+
+static void get_block_file_name(block_hash_t hash, char* out_name) {
+	snprintf(out_name, BS_BLOCK_NAME_LEN, "%s/%08lX%08lX.BLK", BLOCK_STORE_DIR, (uint32_t) (hash >> 32), (uint32_t) hash);
+}
+
+bool block_store_is_manifest(uint8_t* file_name) {
+	if(!file_name)
+		return false;
+	uint8_t* ext = strrchr(file_name, '.');
+	return ext && !strcasecmp(ext, BS_MANIFEST_EXT);
+}
+
+/***
+ *	Two independent 32-bit hashes make collisions practically impossible,
+ *	contents are compared anyway before a block is shared.
+ */
+block_hash_t block_store_hash(const uint8_t* block_data) {
+	uint32_t crc = crc32(block_data, MC_BLOCK_SIZE);
+	uint32_t fnv = fnv1a_update(FNV1A_INIT, block_data, MC_BLOCK_SIZE);
+	return ((block_hash_t) crc << 32) | fnv;
+}
+
+/***
+ *	Block sized buffer usable by callers to prepare data for the block store.
+ *	Its content is only preserved until the next call to a block_store function.
+ */
+uint8_t* block_store_scratch_block() {
+	return scratch_block;
+}
+
+uint32_t block_store_read_manifest(uint8_t* file_name, block_manifest_t* out_manifest) {
+	if(!file_name || !out_manifest)
+		return BS_BAD_PARAM;
+	FIL fil;
+	UINT bytes_read;
+	if(FR_OK != f_open(&fil, file_name, FA_READ))
+		return BS_FILE_OPEN_ERR;
+	uint32_t status = BS_OK;
+	if(FR_OK != f_read(&fil, out_manifest, sizeof(block_manifest_t), &bytes_read) || bytes_read != sizeof(block_manifest_t))
+		status = BS_FILE_READ_ERR;
+	else if(out_manifest->magic != BS_MANIFEST_MAGIC || out_manifest->version != BS_MANIFEST_VERSION)
+		status = BS_BAD_MANIFEST;
+	f_close(&fil);
+	return status;
+}
+
+uint32_t block_store_write_manifest(uint8_t* file_name, block_manifest_t* manifest) {
+	if(!file_name || !manifest)
+		return BS_BAD_PARAM;
+	FIL fil;
+	UINT bytes_written;
+	manifest->magic = BS_MANIFEST_MAGIC;
+	manifest->version = BS_MANIFEST_VERSION;
+	if(FR_OK != f_open(&fil, file_name, FA_OPEN_ALWAYS | FA_WRITE))
+		return BS_FILE_OPEN_ERR;
+	uint32_t status = BS_OK;
+	if(FR_OK != f_write(&fil, manifest, sizeof(block_manifest_t), &bytes_written) || bytes_written != sizeof(block_manifest_t))
+		status = BS_FILE_WRITE_ERR;
+	if(FR_OK != f_close(&fil) && status == BS_OK)
+		status = BS_FILE_WRITE_ERR;
+	return status;
+}
+
+static uint32_t read_block_header(FIL* fil, block_header_t* out_header) {
+	UINT bytes_read;
+	if(FR_OK != f_lseek(fil, MC_BLOCK_SIZE) || FR_OK != f_read(fil, out_header, sizeof(block_header_t), &bytes_read) || bytes_read != sizeof(block_header_t))
+		return BS_FILE_READ_ERR;
+	if(out_header->magic != BS_BLOCK_MAGIC)
+		return BS_FILE_READ_ERR;
+	return BS_OK;
+}
+
+static uint32_t write_block_header(FIL* fil, block_header_t* header) {
+	UINT bytes_written;
+	if(FR_OK != f_lseek(fil, MC_BLOCK_SIZE) || FR_OK != f_write(fil, header, sizeof(block_header_t), &bytes_written) || bytes_written != sizeof(block_header_t))
+		return BS_FILE_WRITE_ERR;
+	return BS_OK;
+}
+
+static bool is_block_content_equal(FIL* fil, const uint8_t* block_data) {
+	uint8_t buffer[BLOCK_SIZE];
+	UINT bytes_read;
+	if(FR_OK != f_lseek(fil, 0))
+		return false;
+	for(uint32_t offset = 0; offset < MC_BLOCK_SIZE; offset += sizeof(buffer)) {
+		if(FR_OK != f_read(fil, buffer, sizeof(buffer), &bytes_read) || bytes_read != sizeof(buffer))
+			return false;
+		if(memcmp(buffer, &block_data[offset], sizeof(buffer)))
+			return false;
+	}
+	return true;
+}
+
+/***
+ *	Stores a block adding the given amount of references to it. If an identical
+ *	block is already stored only its reference count is updated.
+ */
+uint32_t block_store_put(const uint8_t* block_data, uint32_t refs, block_hash_t* out_hash) {
+	if(!block_data || !out_hash)
+		return BS_BAD_PARAM;
+	block_hash_t hash = block_store_hash(block_data);
+	char block_name[BS_BLOCK_NAME_LEN];
+	get_block_file_name(hash, block_name);
+	f_mkdir(BLOCK_STORE_DIR);	// fails harmlessly when already existing
+
+	FIL fil;
+	UINT bytes_written;
+	block_header_t header;
+	uint32_t status = BS_OK;
+	FRESULT f_res = f_open(&fil, block_name, FA_READ | FA_WRITE);
+	if(f_res == FR_OK) {
+		/* already stored, share it */
+		status = read_block_header(&fil, &header);
+		if(status == BS_OK && !is_block_content_equal(&fil, block_data))
+			status = BS_HASH_COLLISION;
+		if(status == BS_OK) {
+			header.refs += refs;
+			status = write_block_header(&fil, &header);
+		}
+	} else if(f_res == FR_NO_FILE) {
+		if(FR_OK != f_open(&fil, block_name, FA_CREATE_NEW | FA_WRITE))
+			return BS_FILE_OPEN_ERR;
+		if(FR_OK != f_write(&fil, block_data, MC_BLOCK_SIZE, &bytes_written) || bytes_written != MC_BLOCK_SIZE) {
+			status = BS_FILE_WRITE_ERR;
+		} else {
+			header.magic = BS_BLOCK_MAGIC;
+			header.refs = refs;
+			status = write_block_header(&fil, &header);
+		}
+	} else {
+		return BS_FILE_OPEN_ERR;
+	}
+	if(FR_OK != f_close(&fil) && status == BS_OK)
+		status = BS_FILE_WRITE_ERR;
+	if(status == BS_OK)
+		*out_hash = hash;
+	return status;
+}
+
+/***
+ *	Adds (or removes, when negative) references to a stored block.
+ *	The block is deleted once no manifest references it anymore.
+ */
+uint32_t block_store_ref(block_hash_t hash, int32_t amount) {
+	char block_name[BS_BLOCK_NAME_LEN];
+	get_block_file_name(hash, block_name);
+	FIL fil;
+	block_header_t header;
+	if(FR_OK != f_open(&fil, block_name, FA_READ | FA_WRITE))
+		return BS_FILE_OPEN_ERR;
+	uint32_t status = read_block_header(&fil, &header);
+	bool unused = false;
+	if(status == BS_OK) {
+		if(amount < 0 && header.refs <= (uint32_t) -amount) {
+			unused = true;
+		} else {
+			header.refs += amount;
+			status = write_block_header(&fil, &header);
+		}
+	}
+	if(FR_OK != f_close(&fil) && status == BS_OK)
+		status = BS_FILE_WRITE_ERR;
+	if(unused && FR_OK != f_unlink(block_name))
+		status = BS_FILE_WRITE_ERR;
+	return status;
+}
+
+/***
+ *	Opens a stored block for reading, its data starts at offset 0.
+ */
+uint32_t block_store_open_block(block_hash_t hash, FIL* out_fil) {
+	if(!out_fil)
+		return BS_BAD_PARAM;
+	char block_name[BS_BLOCK_NAME_LEN];
+	get_block_file_name(hash, block_name);
+	if(FR_OK != f_open(out_fil, block_name, FA_READ))
+		return BS_FILE_OPEN_ERR;
+	return BS_OK;
+}
+
+/***
+ *	Loads a stored block, verifying it still matches its hash.
+ */
+uint32_t block_store_load(block_hash_t hash, uint8_t* out_block) {
+	if(!out_block)
+		return BS_BAD_PARAM;
+	FIL fil;
+	UINT bytes_read;
+	uint32_t status = block_store_open_block(hash, &fil);
+	if(status != BS_OK)
+		return status;
+	if(FR_OK != f_read(&fil, out_block, MC_BLOCK_SIZE, &bytes_read) || bytes_read != MC_BLOCK_SIZE)
+		status = BS_FILE_READ_ERR;
+	f_close(&fil);
+	if(status == BS_OK && block_store_hash(out_block) != hash)
+		status = BS_FILE_READ_ERR;	// corrupted block
+	return status;
+}
+
+/***
+ *	Replaces one block of an image with data read from another file.
+ */
+uint32_t block_store_set_block(uint8_t* manifest_name, uint8_t block, FIL* src, FSIZE_t src_offset) {
+	if(!manifest_name || !src || block >= MC_BLOCK_COUNT)
+		return BS_BAD_PARAM;
+	UINT bytes_read;
+	if(FR_OK != f_lseek(src, src_offset) || FR_OK != f_read(src, scratch_block, MC_BLOCK_SIZE, &bytes_read) || bytes_read != MC_BLOCK_SIZE)
+		return BS_FILE_READ_ERR;
+	return block_store_write_block(manifest_name, block, scratch_block);
+}
+
+/***
+ *	Points a block of a manifest to the given contents, releasing the block it replaces.
+ */
+uint32_t block_store_write_block(uint8_t* manifest_name, uint8_t block, const uint8_t* block_data) {
+	if(!manifest_name || !block_data || block >= MC_BLOCK_COUNT)
+		return BS_BAD_PARAM;
+	block_manifest_t manifest;
+	uint32_t status = block_store_read_manifest(manifest_name, &manifest);
+	if(status != BS_OK)
+		return status;
+	block_hash_t old_hash = manifest.blocks[block];
+	status = block_store_put(block_data, 1, &manifest.blocks[block]);
+	if(status != BS_OK)
+		return status;
+	status = block_store_write_manifest(manifest_name, &manifest);
+	if(status != BS_OK) {
+		block_store_ref(manifest.blocks[block], -1);
+		return status;
+	}
+	return block_store_ref(old_hash, -1);
+}
+
+/***
+ *	Creates a new image whose directory block is given and all other blocks are empty.
+ */
+uint32_t block_store_create_image(uint8_t* manifest_name, const uint8_t* directory_block) {
+	if(!manifest_name || !directory_block)
+		return BS_BAD_PARAM;
+	block_manifest_t manifest;
+	uint32_t status = block_store_put(directory_block, 1, &manifest.blocks[0]);
+	if(status != BS_OK)
+		return status;
+	memset(scratch_block, 0, MC_BLOCK_SIZE);
+	status = block_store_put(scratch_block, MC_BLOCK_COUNT - 1, &manifest.blocks[1]);
+	if(status != BS_OK) {
+		block_store_ref(manifest.blocks[0], -1);
+		return status;
+	}
+	for(uint8_t i = 2; i < MC_BLOCK_COUNT; i++)
+		manifest.blocks[i] = manifest.blocks[1];
+	status = block_store_write_manifest(manifest_name, &manifest);
+	if(status != BS_OK) {
+		block_store_ref(manifest.blocks[0], -1);
+		block_store_ref(manifest.blocks[1], -(MC_BLOCK_COUNT - 1));
+	}
+	return status;
+}
+
+/**
+ * @brief Returns how many times the manifest uses block i, 0 when it was already used by an earlier block
+ */
+static int32_t first_use_count(const block_manifest_t* manifest, uint8_t i) {
+	int32_t amount = 0;
+	for(uint8_t j = 0; j < MC_BLOCK_COUNT; j++) {
+		if(manifest->blocks[j] == manifest->blocks[i]) {
+			if(j < i)
+				return 0;
+			++amount;
+		}
+	}
+	return amount;
+}
+
+/***
+ *	Creates a copy of an image, only the manifest is written while blocks are shared.
+ *	On failure the references already taken are dropped again.
+ */
+uint32_t block_store_clone(uint8_t* src_manifest_name, uint8_t* dst_manifest_name) {
+	block_manifest_t manifest;
+	uint32_t status = block_store_read_manifest(src_manifest_name, &manifest);
+	if(status != BS_OK)
+		return status;
+	/* one reference update per distinct block */
+	uint8_t done = 0;
+	for(; done < MC_BLOCK_COUNT && status == BS_OK; done++) {
+		int32_t amount = first_use_count(&manifest, done);
+		if(amount)
+			status = block_store_ref(manifest.blocks[done], amount);
+	}
+	if(status == BS_OK)
+		status = block_store_write_manifest(dst_manifest_name, &manifest);
+	else
+		--done;		// the failed update took nothing
+	if(status != BS_OK) {
+		for(uint8_t i = 0; i < done; i++) {
+			int32_t amount = first_use_count(&manifest, i);
+			if(amount)
+				block_store_ref(manifest.blocks[i], -amount);	// the source keeps its own references
+		}
+	}
+	return status;
+}
+
+/***
+ *	Writes a plain raw image (.MCR) out of a manifest, for use on other devices.
+ */
+uint32_t block_store_export(uint8_t* manifest_name, uint8_t* mcr_name) {
+	block_manifest_t manifest;
+	uint32_t status = block_store_read_manifest(manifest_name, &manifest);
+	if(status != BS_OK)
+		return status;
+	FIL fil;
+	UINT bytes_written;
+	if(FR_OK != f_open(&fil, mcr_name, FA_CREATE_ALWAYS | FA_WRITE))
+		return BS_FILE_OPEN_ERR;
+	for(uint8_t i = 0; i < MC_BLOCK_COUNT && status == BS_OK; i++) {
+		status = block_store_load(manifest.blocks[i], scratch_block);
+		if(status == BS_OK && (FR_OK != f_write(&fil, scratch_block, MC_BLOCK_SIZE, &bytes_written) || bytes_written != MC_BLOCK_SIZE))
+			status = BS_FILE_WRITE_ERR;
+	}
+	if(FR_OK != f_close(&fil) && status == BS_OK)
+		status = BS_FILE_WRITE_ERR;
+	return status;
+}
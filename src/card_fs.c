@@ -0,0 +1,281 @@
+#include "card_fs.h"
+#include <string.h>
+#include "title_id.h"
+#include "byte_order.h"
+
+/***
+ *	Model of the PS1 card filesystem: what each directory frame says about its block,
+ *	the saves (chains of blocks linked from a first block) and their titles.
+ *
+ *	The model of the image being served is built once at import, afterwards the
+ *	simulation core only bumps the generation of the frames it writes and the sync
+ *	core re-parses the directory when a generation changed. Frames are read from RAM
+ *	without locking: a frame written while being parsed gets a new generation once
+ *	complete, so it is parsed again at the next refresh.
+ *
+ *	Titles need a lookup on the SD card, they are resolved in the background one at
+ *	a time or on demand when displayed.
+ *
+ *	Compaction rewrites the card so that saves occupy contiguous blocks in directory
+ *	order, with repaired links: orphan continuation blocks are freed, chains ending on
+ *	a block that is not marked last are terminated there.
+ */
+
+static uint8_t frame_type(const uint8_t* frame) {
+	switch(frame[0]) {
+		case CF_FRAME_FIRST:
+			return CF_BLOCK_FIRST;
+		case CF_FRAME_MIDDLE:
+			return CF_BLOCK_MIDDLE;
+		case CF_FRAME_LAST:
+			return CF_BLOCK_LAST;
+		default:
+			return CF_BLOCK_FREE;
+	}
+}
+
+static char region_of(const char* name) {
+	if(name[0] != 'B')
+		return 0;
+	switch(name[1]) {
+		case 'I':
+			return 'J';
+		case 'A':
+			return 'U';
+		case 'E':
+			return 'E';
+		default:
+			return 0;
+	}
+}
+
+/***
+ *	Follows the links from the first block of a save, stopping at anything that does
+ *	not look like a continuation block or at a block already used by another save.
+ */
+static void parse_chain(card_fs_t* fs, card_fs_save_t* save) {
+	uint8_t block = save->first_block;
+	save->block_count = 0;
+	while(save->block_count < CF_SAVE_BLOCKS && !fs->owner[block]) {
+		const uint8_t* frame = &fs->frames[block * MC_SEC_SIZE];
+		fs->owner[block] = save->first_block;
+		save->blocks[save->block_count++] = block;
+		uint16_t next = frame[CF_FRAME_NEXT] | frame[CF_FRAME_NEXT + 1] << 8;
+		if(fs->block_type[block] == CF_BLOCK_LAST || next >= CF_SAVE_BLOCKS)
+			break;
+		block = next + 1;
+		if(fs->block_type[block] != CF_BLOCK_MIDDLE && fs->block_type[block] != CF_BLOCK_LAST)
+			break;
+	}
+}
+
+static void parse_directory(card_fs_t* fs) {
+	fs->used_blocks = 0;
+	memset(fs->owner, 0, sizeof(fs->owner));
+	for(uint8_t block = 1; block < MC_BLOCK_COUNT; block++) {
+		fs->block_type[block] = frame_type(&fs->frames[block * MC_SEC_SIZE]);
+		if(fs->block_type[block] != CF_BLOCK_FREE)
+			fs->used_blocks++;
+	}
+	for(uint8_t block = 1; block < MC_BLOCK_COUNT; block++) {
+		card_fs_save_t* save = &fs->saves[block - 1];
+		const char* name = &fs->frames[block * MC_SEC_SIZE + CF_FRAME_NAME];
+		if(fs->block_type[block] != CF_BLOCK_FIRST) {
+			save->first_block = 0;
+			continue;
+		}
+		/* titles are kept as long as the save does not change */
+		if(!save->first_block || strncmp(save->name, name, CF_NAME_LEN)) {
+			save->title_resolved = false;
+			save->title[0] = '\0';
+		}
+		save->first_block = block;
+		memcpy(save->name, name, CF_NAME_LEN);
+		save->name[CF_NAME_LEN] = '\0';
+		memcpy(save->product_code, &name[2], CF_PRODUCT_LEN);
+		save->product_code[CF_PRODUCT_LEN] = '\0';
+		save->region = region_of(name);
+		parse_chain(fs, save);
+	}
+}
+
+/**
+ * @brief Builds the model of a directory block, which must stay in place while the model is used
+ */
+void card_fs_build(card_fs_t* fs, const uint8_t* directory) {
+	fs->frames = directory;
+	memset(fs->saves, 0, sizeof(fs->saves));
+	for(uint8_t block = 0; block < MC_BLOCK_COUNT; block++)
+		fs->parsed_gen[block] = fs->frame_gen[block];
+	parse_directory(fs);
+}
+
+/**
+ * @brief Parses the directory again if the simulation core wrote any frame, returns true when it did
+ */
+bool card_fs_refresh(card_fs_t* fs) {
+	bool changed = false;
+	for(uint8_t block = 1; block < MC_BLOCK_COUNT; block++) {
+		uint8_t gen = fs->frame_gen[block];
+		if(gen != fs->parsed_gen[block]) {
+			fs->parsed_gen[block] = gen;
+			changed = true;
+		}
+	}
+	if(changed)
+		parse_directory(fs);
+	return changed;
+}
+
+static void resolve_title(card_fs_save_t* save) {
+	const char* title = title_id_find_name(save->product_code);
+	strncpy(save->title, title ? title : "", CF_TITLE_LEN);
+	save->title[CF_TITLE_LEN] = '\0';
+	save->title_resolved = true;
+}
+
+/**
+ * @brief Looks up the title of one save not resolved yet, returns false when there was none
+ */
+bool card_fs_resolve_next_title(card_fs_t* fs) {
+	for(uint32_t i = 0; i < CF_SAVE_BLOCKS; i++) {
+		if(fs->saves[i].first_block && !fs->saves[i].title_resolved) {
+			resolve_title(&fs->saves[i]);
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Returns the save using block, NULL for free or orphan blocks
+ */
+card_fs_save_t* card_fs_get_save(card_fs_t* fs, uint8_t block) {
+	if(block < 1 || block >= MC_BLOCK_COUNT || !fs->owner[block])
+		return NULL;
+	return &fs->saves[fs->owner[block] - 1];
+}
+
+/**
+ * @brief Returns the name of the game a save belongs to, its product code when unknown
+ */
+const char* card_fs_get_title(card_fs_save_t* save) {
+	if(!save->title_resolved)
+		resolve_title(save);
+	return save->title[0] ? save->title : save->product_code;
+}
+
+static void update_checksum(uint8_t* frame) {
+	uint8_t checksum = 0;
+	for(uint32_t i = 0; i < CF_FRAME_CHECKSUM; i++)
+		checksum ^= frame[i];
+	frame[CF_FRAME_CHECKSUM] = checksum;
+}
+
+/**
+ * @brief Fills a directory frame, name is only given for the first block of a save
+ */
+void card_fs_set_frame(uint8_t* frame, uint8_t state, uint32_t size, uint16_t next, const uint8_t* name) {
+	memset(frame, 0, MC_SEC_SIZE);
+	put32(frame, state);
+	put32(&frame[CF_FRAME_SIZE], size);
+	put16(&frame[CF_FRAME_NEXT], next);
+	if(name)
+		memcpy(&frame[CF_FRAME_NAME], name, CF_NAME_LEN);
+	update_checksum(frame);
+}
+
+/***
+ *	Moves blocks so that block p receives old block src[p] (0 = left as is). Moves whose
+ *	destination still holds a block to be moved wait, cycles are broken through temp_block.
+ */
+static void move_blocks(uint8_t* data, const uint8_t* src, uint8_t* temp_block) {
+	uint8_t loc[MC_BLOCK_COUNT];		// where the contents of each old block are, 0 = temp_block
+	bool pending[MC_BLOCK_COUNT];
+	uint32_t remaining = 0;
+	for(uint8_t b = 0; b < MC_BLOCK_COUNT; b++) {
+		loc[b] = b;
+		pending[b] = src[b] && src[b] != b;
+		remaining += pending[b];
+	}
+	while(remaining) {
+		bool progress = false;
+		for(uint8_t p = 1; p < MC_BLOCK_COUNT; p++) {
+			if(!pending[p])
+				continue;
+			bool needed = false;
+			for(uint8_t q = 1; q < MC_BLOCK_COUNT && !needed; q++)
+				needed = pending[q] && src[q] == p && loc[p] == p;
+			if(needed)
+				continue;
+			const uint8_t* from = loc[src[p]] ? &data[loc[src[p]] * MC_BLOCK_SIZE] : temp_block;
+			memcpy(&data[p * MC_BLOCK_SIZE], from, MC_BLOCK_SIZE);
+			loc[src[p]] = p;
+			pending[p] = false;
+			remaining--;
+			progress = true;
+		}
+		if(!progress) {
+			/* only cycles are left, park one block to open them */
+			for(uint8_t p = 1; p < MC_BLOCK_COUNT; p++) {
+				if(pending[p]) {
+					memcpy(temp_block, &data[p * MC_BLOCK_SIZE], MC_BLOCK_SIZE);
+					loc[p] = 0;
+					break;
+				}
+			}
+		}
+	}
+}
+
+/**
+ * @brief Rewrites saves contiguously in directory order and repairs their links
+ * Returns a mask of the rewritten blocks (bit 0 = directory frames), 0 when the card was already compact.
+ * Must not run while the card is being accessed, temp_block is a block sized buffer.
+ */
+uint16_t card_fs_compact(card_fs_t* fs, uint8_t* data, uint8_t* temp_block) {
+	uint8_t src[MC_BLOCK_COUNT] = {0};
+	uint16_t changed = 0;
+	card_fs_refresh(fs);
+
+	uint8_t pos = 1;
+	for(uint32_t i = 0; i < CF_SAVE_BLOCKS; i++) {
+		card_fs_save_t* save = &fs->saves[i];
+		if(!save->first_block)
+			continue;
+		for(uint32_t b = 0; b < save->block_count; b++, pos++) {
+			src[pos] = save->blocks[b];
+			if(src[pos] != pos)
+				changed |= 1 << pos;
+		}
+	}
+	move_blocks(data, src, temp_block);
+
+	/* frames follow their blocks, old ones are kept aside while the directory is rewritten */
+	uint8_t* old_frames = temp_block;
+	memcpy(old_frames, data, MC_BLOCK_COUNT * MC_SEC_SIZE);
+	pos = 1;
+	for(uint32_t i = 0; i < CF_SAVE_BLOCKS; i++) {
+		card_fs_save_t* save = &fs->saves[i];
+		if(!save->first_block)
+			continue;
+		for(uint32_t b = 0; b < save->block_count; b++, pos++) {
+			uint8_t* frame = &data[pos * MC_SEC_SIZE];
+			bool last = b == save->block_count - 1;
+			memcpy(frame, &old_frames[save->blocks[b] * MC_SEC_SIZE], MC_SEC_SIZE);
+			frame[0] = b == 0 ? CF_FRAME_FIRST : (last ? CF_FRAME_LAST : CF_FRAME_MIDDLE);
+			if(b == 0)
+				put32(&frame[CF_FRAME_SIZE], save->block_count * MC_BLOCK_SIZE);
+			put16(&frame[CF_FRAME_NEXT], last ? CF_NO_NEXT : pos);		// next block - 1
+			update_checksum(frame);
+		}
+	}
+	for(; pos < MC_BLOCK_COUNT; pos++) {
+		if(fs->block_type[pos] != CF_BLOCK_FREE || old_frames[pos * MC_SEC_SIZE] != CF_FRAME_FREE)
+			card_fs_set_frame(&data[pos * MC_SEC_SIZE], CF_FRAME_FREE, 0, CF_NO_NEXT, NULL);
+	}
+	if(memcmp(old_frames, data, MC_BLOCK_COUNT * MC_SEC_SIZE))
+		changed |= 1;
+	card_fs_build(fs, data);
+	return changed;
+}
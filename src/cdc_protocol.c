@@ -0,0 +1,506 @@
+#include "cdc_protocol.h"
+#include <string.h>
+#include "tusb.h"
+#include "pico/time.h"
+#include "ff.h"
+#include "checksum.h"
+#include "byte_order.h"
+#include "lz.h"
+#include "block_store.h"
+#include "image_format.h"
+#include "memcard_manager.h"
+#include "memcard_simulator.h"
+#include "sd_config.h"
+#include "disk_cache.h"
+#include "dexdrive.h"
+#include "library_scan.h"
+
+/***
+ *	Framed binary protocol on the CDC interface, used to move images faster than the
+ *	MSC mount-copy-eject cycle (see docs/picomc_cdc.py for the host side).
+ *
+ *	Whole images are moved as a series of pipelined requests of at most CDC_MAX_SECTORS
+ *	sectors, each compressed on its own so that neither side needs a whole image in RAM.
+ *	One request is handled per call, between two batches of the sync loop.
+ *
+ *	CP_OP_FRAMES lets PC emulators use the card being served as their own: a batch of frame
+ *	reads, writes and ID commands is answered from the same RAM image and flag byte as the
+ *	console sees, writes having the same side effects (see docs/bridge for the host shim).
+ *
+ *	Image operations need the memory card to be served with USB_CONCURRENT_MODE: the image
+ *	being served is read from RAM and written like the console does (RAM, then sync queue),
+ *	other images are accessed through FatFs. Without USB_CONCURRENT_MODE only stats are
+ *	available and everything else returns CP_ERR_BUSY.
+ */
+
+static uint8_t rx_frame[CP_HEADER_SIZE + CP_MAX_PAYLOAD + CP_CRC_SIZE];
+static uint32_t rx_len = 0;
+static uint8_t tx_frame[CP_HEADER_SIZE + CP_MAX_PAYLOAD + CP_CRC_SIZE];
+static uint8_t sector_data[CP_MAX_DATA];
+
+/**
+ * @brief Writes all bytes to the CDC interface, running the USB stack while its FIFO is full
+ * A host that keeps the port open without reading gets nothing once CDC_WRITE_TIMEOUT expires:
+ * the response is dropped along with the requests received meanwhile, returns false.
+ */
+bool cdc_protocol_write(const uint8_t* data, uint32_t len) {
+	absolute_time_t deadline = make_timeout_time_ms(CDC_WRITE_TIMEOUT);
+	while(len && tud_cdc_connected()) {
+		uint32_t written = tud_cdc_write(data, len);
+		data += written;
+		len -= written;
+		if(written)
+			deadline = make_timeout_time_ms(CDC_WRITE_TIMEOUT);
+		else if(time_reached(deadline)) {
+			tud_cdc_write_clear();
+			tud_cdc_read_flush();
+			rx_len = 0;
+			return false;
+		}
+		if(len) {
+			tud_cdc_write_flush();
+			tud_task();
+		}
+	}
+	tud_cdc_write_flush();
+	return !len;
+}
+
+static void send_response(uint8_t status, uint8_t flags, uint32_t payload_len) {
+	tx_frame[0] = CP_MAGIC0;
+	tx_frame[1] = CP_MAGIC1;
+	tx_frame[2] = rx_frame[2];		// op
+	tx_frame[3] = rx_frame[3];		// seq
+	tx_frame[4] = flags;
+	tx_frame[5] = status;
+	put16(&tx_frame[6], payload_len);
+	put32(&tx_frame[CP_HEADER_SIZE + payload_len], crc32(tx_frame, CP_HEADER_SIZE + payload_len));
+	cdc_protocol_write(tx_frame, CP_HEADER_SIZE + payload_len + CP_CRC_SIZE);
+}
+
+/**
+ * @brief Parses the image name at the start of a payload, returns its length in the payload (0 on error)
+ */
+static uint32_t parse_name(const uint8_t* payload, uint32_t payload_len, uint8_t* out_name) {
+	if(payload_len < 1 || payload[0] > MAX_MC_FILENAME_LEN || 1 + payload[0] > payload_len)
+		return 0;
+	memcpy(out_name, &payload[1], payload[0]);
+	out_name[payload[0]] = '\0';
+	return 1 + payload[0];
+}
+
+static uint32_t put_name(uint8_t* out, const uint8_t* name) {
+	uint32_t len = strlen(name);
+	out[0] = len;
+	memcpy(&out[1], name, len);
+	return 1 + len;
+}
+
+static uint32_t handle_stats() {
+	uint8_t* p = &tx_frame[CP_HEADER_SIZE];
+	memset(p, 0, 50);
+	put32(p, to_ms_since_boot(get_absolute_time()));
+	#ifdef USB_CONCURRENT_MODE
+	memcard_simulator_stats_t mc_stats;
+	disk_cache_stats_t cache_stats;
+	memcard_simulator_get_stats(&mc_stats);
+	disk_cache_get_stats(&cache_stats);
+	p[4] = 1;		// memory card served
+	put32(p + 5, memcard_manager_count());
+	put32(p + 9, mc_stats.elided_writes);
+	put32(p + 13, mc_stats.pending_syncs);
+	put32(p + 17, mc_stats.pending_reloads);
+	p[21] = mc_stats.pending_commit;
+	put32(p + 22, sd_get_profile()->baud_rate);
+	for(uint32_t i = 0; i < DC_CLASS_COUNT; i++) {
+		put32(p + 26 + i * 8, cache_stats.hits[i]);
+		put32(p + 30 + i * 8, cache_stats.misses[i]);
+	}
+	uint8_t active[MAX_MC_FILENAME_LEN + 1];
+	memcard_simulator_get_active(active);
+	return 50 + put_name(p + 50, active);
+	#else
+	return 50 + put_name(p + 50, "");
+	#endif
+}
+
+#ifdef USB_CONCURRENT_MODE
+static uint32_t handle_list(const uint8_t* payload, uint32_t payload_len, uint32_t* out_len) {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	uint8_t* p = &tx_frame[CP_HEADER_SIZE];
+	if(payload_len != 2)
+		return CP_ERR_BAD_PARAM;
+	uint32_t count = memcard_manager_count();
+	put16(p, count);
+	*out_len = 2;
+	for(uint32_t i = get16(payload); i < count && *out_len + 1 + MAX_MC_FILENAME_LEN <= CP_MAX_PAYLOAD; i++) {
+		if(MM_OK != memcard_manager_get(i, name))
+			break;
+		*out_len += put_name(p + *out_len, name);
+	}
+	return CP_OK;
+}
+
+/**
+ * @brief Reads sectors of an image which is not being served, manifests through the block store
+ */
+static uint32_t read_stored_image(uint8_t* file_name, sector_t first, uint32_t count, uint8_t* out_data) {
+	FIL fil;
+	UINT bytes_read;
+	uint32_t offset = first * MC_SEC_SIZE;
+	uint32_t len = count * MC_SEC_SIZE;
+	if(!block_store_is_manifest(file_name)) {
+		FSIZE_t data_offset;
+		if(IF_OK != image_format_open(&fil, file_name, FA_READ, &data_offset))
+			return CP_ERR_NO_IMAGE;
+		bool ok = FR_OK == f_lseek(&fil, data_offset + offset) &&
+			FR_OK == f_read(&fil, out_data, len, &bytes_read) && bytes_read == len;
+		f_close(&fil);
+		return ok ? CP_OK : CP_ERR_IO;
+	}
+	block_manifest_t manifest;
+	if(BS_OK != block_store_read_manifest(file_name, &manifest))
+		return CP_ERR_NO_IMAGE;
+	while(len) {
+		uint32_t chunk = MC_BLOCK_SIZE - offset % MC_BLOCK_SIZE;
+		if(chunk > len)
+			chunk = len;
+		if(BS_OK != block_store_open_block(manifest.blocks[offset / MC_BLOCK_SIZE], &fil))
+			return CP_ERR_IO;
+		bool ok = FR_OK == f_lseek(&fil, offset % MC_BLOCK_SIZE) && FR_OK == f_read(&fil, out_data, chunk, &bytes_read) && bytes_read == chunk;
+		f_close(&fil);
+		if(!ok)
+			return CP_ERR_IO;
+		out_data += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+	return CP_OK;
+}
+
+static uint32_t write_image_file(uint8_t* file_name, sector_t first, uint32_t count, const uint8_t* data) {
+	FIL fil;
+	UINT bytes_written;
+	FSIZE_t data_offset;
+	uint32_t len = count * MC_SEC_SIZE;
+	if(block_store_is_manifest(file_name))
+		return CP_ERR_UNSUPPORTED;
+	switch(image_format_open(&fil, file_name, FA_READ | FA_WRITE, &data_offset)) {
+		case IF_OK:
+			break;
+		case IF_READ_ONLY:
+			return CP_ERR_UNSUPPORTED;
+		default:
+			return CP_ERR_NO_IMAGE;
+	}
+	bool ok = FR_OK == f_lseek(&fil, data_offset + first * MC_SEC_SIZE) &&
+		FR_OK == f_write(&fil, data, len, &bytes_written) && bytes_written == len;
+	ok &= FR_OK == f_close(&fil);
+	library_scan_invalidate(file_name);		// timestamp is not updated
+	return ok ? CP_OK : CP_ERR_IO;
+}
+
+/**
+ * @brief Parses name, first sector and sector count shared by reads and writes, returns the parameters length (0 on error)
+ */
+static uint32_t parse_range(const uint8_t* payload, uint32_t payload_len, uint8_t* out_name, sector_t* out_first, uint32_t* out_count) {
+	uint32_t pos = parse_name(payload, payload_len, out_name);
+	if(!pos || pos + 4 > payload_len)
+		return 0;
+	*out_first = get16(&payload[pos]);
+	*out_count = get16(&payload[pos + 2]);
+	if(!*out_count || *out_count > CDC_MAX_SECTORS || *out_first + *out_count > MC_SEC_COUNT)
+		return 0;
+	return pos + 4;
+}
+
+static bool is_active(const uint8_t* file_name) {
+	uint8_t active[MAX_MC_FILENAME_LEN + 1];
+	memcard_simulator_get_active(active);
+	return !strcmp(file_name, active);
+}
+
+/**
+ * @brief Reads sectors of an image, the one being served (empty name) from RAM
+ */
+uint32_t cdc_image_read(uint8_t* file_name, sector_t first, uint32_t count, uint8_t* out_data) {
+	if(!file_name[0] || is_active(file_name))
+		return memcard_simulator_read_sectors(first, count, out_data) ? CP_OK : CP_ERR_BUSY;
+	return read_stored_image(file_name, first, count, out_data);
+}
+
+/**
+ * @brief Writes sectors of an image, the one being served (empty name) through RAM and the sync queue like the console does
+ */
+uint32_t cdc_image_write(uint8_t* file_name, sector_t first, uint32_t count, const uint8_t* data) {
+	if(!file_name[0] || is_active(file_name))
+		return memcard_simulator_write_sectors(first, count, data) ? CP_OK : CP_ERR_BUSY;
+	return write_image_file(file_name, first, count, data);
+}
+
+static uint32_t handle_read(const uint8_t* payload, uint32_t payload_len, uint8_t flags, uint8_t* out_flags, uint32_t* out_len) {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	sector_t first;
+	uint32_t count;
+	uint32_t status = CP_OK;
+	if(parse_range(payload, payload_len, name, &first, &count) != payload_len)
+		return CP_ERR_BAD_PARAM;
+	status = cdc_image_read(name, first, count, sector_data);
+	if(status != CP_OK)
+		return status;
+
+	uint32_t len = count * MC_SEC_SIZE;
+	uint8_t* p = &tx_frame[CP_HEADER_SIZE];
+	*out_len = 0;
+	if(flags & CP_FLAG_COMPRESS)
+		*out_len = lz_compress(sector_data, len, p, len - 1);	// only when smaller
+	if(*out_len) {
+		*out_flags |= CP_FLAG_COMPRESSED;
+	} else {
+		memcpy(p, sector_data, len);
+		*out_len = len;
+	}
+	return CP_OK;
+}
+
+static uint32_t handle_write(const uint8_t* payload, uint32_t payload_len, uint8_t flags) {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	sector_t first;
+	uint32_t count;
+	uint32_t pos = parse_range(payload, payload_len, name, &first, &count);
+	if(!pos)
+		return CP_ERR_BAD_PARAM;
+	uint32_t len = count * MC_SEC_SIZE;
+	if(flags & CP_FLAG_COMPRESSED) {
+		if(lz_decompress(&payload[pos], payload_len - pos, sector_data, len) != len)
+			return CP_ERR_BAD_PARAM;
+	} else {
+		if(payload_len - pos != len)
+			return CP_ERR_BAD_PARAM;
+		memcpy(sector_data, &payload[pos], len);
+	}
+	return cdc_image_write(name, first, count, sector_data);
+}
+
+static uint32_t handle_switch(const uint8_t* payload, uint32_t payload_len) {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	if(parse_name(payload, payload_len, name) != payload_len || !memcard_manager_exist(name))
+		return CP_ERR_NO_IMAGE;
+	return memcard_simulator_switch(name) == MC_OK ? CP_OK : CP_ERR_IO;
+}
+
+static uint32_t handle_create(uint32_t* out_len) {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	if(MM_OK != memcard_manager_create(name))
+		return CP_ERR_IO;
+	*out_len = put_name(&tx_frame[CP_HEADER_SIZE], name);
+	return CP_OK;
+}
+
+/**
+ * @brief Returns the length of the frame operation at the start of a batch and of its result (0 when malformed)
+ */
+static uint32_t frame_op_len(const uint8_t* op, uint32_t len, uint32_t* out_result_len) {
+	switch(op[0]) {
+		case CP_FRAME_READ:
+			*out_result_len = 2 + MC_SEC_SIZE;
+			return len >= 3 ? 3 : 0;
+		case CP_FRAME_WRITE:
+			*out_result_len = 2;
+			return len >= 3 + MC_SEC_SIZE ? 3 + MC_SEC_SIZE : 0;
+		case CP_FRAME_ID:
+			*out_result_len = 2 + MC_ID_SIZE;
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+static uint32_t handle_frames(const uint8_t* payload, uint32_t payload_len, uint32_t* out_len) {
+	uint8_t* p = &tx_frame[CP_HEADER_SIZE];
+	uint32_t pos = 0;
+	uint32_t result_len;
+	*out_len = 0;
+	/* validate the whole batch first, nothing is written when it is rejected */
+	while(pos < payload_len) {
+		uint32_t op_len = frame_op_len(&payload[pos], payload_len - pos, &result_len);
+		if(!op_len || *out_len + result_len > CP_MAX_PAYLOAD)
+			return CP_ERR_BAD_PARAM;
+		pos += op_len;
+		*out_len += result_len;
+	}
+	for(pos = 0; pos < payload_len; pos += frame_op_len(&payload[pos], payload_len - pos, &result_len), p += result_len) {
+		sector_t frame = payload[pos] == CP_FRAME_ID ? 0 : get16(&payload[pos + 1]);
+		p[0] = MC_GOOD;
+		if(payload[pos] == CP_FRAME_READ) {
+			if(frame >= MC_SEC_COUNT)
+				p[0] = MC_BAD_SEC;
+			else if(!memcard_simulator_read_sectors(frame, 1, &p[2]))
+				p[0] = MC_BAD_CHK;
+		} else if(payload[pos] == CP_FRAME_WRITE) {
+			if(frame >= MC_SEC_COUNT)
+				p[0] = MC_BAD_SEC;
+			else if(!memcard_simulator_write_frame(frame, &payload[pos + 3]))
+				p[0] = MC_BAD_CHK;
+		} else {
+			memcard_simulator_get_id(&p[2]);
+		}
+		p[1] = memcard_simulator_get_flag();
+	}
+	return CP_OK;
+}
+
+static uint32_t handle_compact(uint32_t* out_len) {
+	uint32_t blocks;
+	if(MC_OK != memcard_simulator_compact(&blocks))
+		return CP_ERR_IO;
+	tx_frame[CP_HEADER_SIZE] = blocks;
+	*out_len = 1;
+	return CP_OK;
+}
+
+static uint32_t handle_scan(uint32_t* out_len) {
+	library_scan_stats_t stats;
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	uint8_t flags;
+	uint8_t* p = &tx_frame[CP_HEADER_SIZE];
+	library_scan_get_stats(&stats);
+	put32(p, stats.passes);
+	put32(p + 4, stats.position);
+	put32(p + 8, memcard_manager_count());
+	put32(p + 12, stats.scanned);
+	put32(p + 16, stats.skipped);
+	put32(p + 20, stats.bad);
+	*out_len = 24;
+	for(uint32_t i = 0; library_scan_get_bad(i, name, &flags); i++) {
+		p[*out_len] = flags;
+		*out_len += 1 + put_name(p + *out_len + 1, name);
+	}
+	return CP_OK;
+}
+
+static uint32_t handle_dex_image(const uint8_t* payload, uint32_t payload_len) {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	if(parse_name(payload, payload_len, name) != payload_len || (name[0] && !memcard_manager_exist(name)))
+		return CP_ERR_NO_IMAGE;
+	dexdrive_set_image(name);
+	return CP_OK;
+}
+#else
+uint32_t cdc_image_read(uint8_t* file_name, sector_t first, uint32_t count, uint8_t* out_data) {
+	(void) file_name; (void) first; (void) count; (void) out_data;
+	return CP_ERR_BUSY;		// SD card belongs to the MSC host
+}
+
+uint32_t cdc_image_write(uint8_t* file_name, sector_t first, uint32_t count, const uint8_t* data) {
+	(void) file_name; (void) first; (void) count; (void) data;
+	return CP_ERR_BUSY;
+}
+#endif
+
+static void handle_frame() {
+	uint8_t op = rx_frame[2];
+	uint8_t flags = rx_frame[4];
+	uint32_t payload_len = get16(&rx_frame[6]);
+	const uint8_t* payload = &rx_frame[CP_HEADER_SIZE];
+	uint8_t out_flags = 0;
+	uint32_t out_len = 0;
+	uint32_t status = CP_OK;
+
+	if(crc32(rx_frame, CP_HEADER_SIZE + payload_len) != get32(&payload[payload_len])) {
+		send_response(CP_ERR_FRAME, 0, 0);
+		return;
+	}
+	switch(op) {
+		case CP_OP_STATS:
+			out_len = handle_stats();
+			break;
+		#ifdef USB_CONCURRENT_MODE
+		case CP_OP_LIST:
+			status = handle_list(payload, payload_len, &out_len);
+			break;
+		case CP_OP_READ:
+			status = handle_read(payload, payload_len, flags, &out_flags, &out_len);
+			break;
+		case CP_OP_WRITE:
+			status = handle_write(payload, payload_len, flags);
+			break;
+		case CP_OP_SWITCH:
+			status = handle_switch(payload, payload_len);
+			break;
+		case CP_OP_CREATE:
+			status = handle_create(&out_len);
+			break;
+		case CP_OP_DEX_IMAGE:
+			status = handle_dex_image(payload, payload_len);
+			break;
+		case CP_OP_FRAMES:
+			status = handle_frames(payload, payload_len, &out_len);
+			break;
+		case CP_OP_COMPACT:
+			status = handle_compact(&out_len);
+			break;
+		case CP_OP_SCAN:
+			status = handle_scan(&out_len);
+			break;
+		#else
+		case CP_OP_LIST:
+		case CP_OP_READ:
+		case CP_OP_WRITE:
+		case CP_OP_SWITCH:
+		case CP_OP_CREATE:
+		case CP_OP_DEX_IMAGE:
+		case CP_OP_FRAMES:
+		case CP_OP_COMPACT:
+		case CP_OP_SCAN:
+			status = CP_ERR_BUSY;	// SD card belongs to the MSC host
+			break;
+		#endif
+		default:
+			status = CP_ERR_UNKNOWN_OP;
+	}
+	if(status != CP_OK) {
+		out_len = 0;
+		out_flags = 0;
+	}
+	send_response(status, out_flags, out_len);
+}
+
+/**
+ * @brief Receives and handles at most one request, call from the USB loop
+ * Bytes outside of frames go to the DexDrive emulation, which keeps them while in the middle of a command.
+ */
+void cdc_protocol_task() {
+	while(tud_cdc_available()) {
+		if(rx_len == 0) {
+			uint8_t byte;
+			bool dex_busy = dexdrive_is_busy();
+			tud_cdc_read(&byte, 1);
+			if(dexdrive_feed(byte))
+				return;
+			if(!dex_busy && byte == CP_MAGIC0)
+				rx_frame[rx_len++] = byte;
+			continue;
+		}
+		uint32_t frame_len = CP_HEADER_SIZE;
+		if(rx_len >= CP_HEADER_SIZE)
+			frame_len += get16(&rx_frame[6]) + CP_CRC_SIZE;
+		rx_len += tud_cdc_read(&rx_frame[rx_len], frame_len - rx_len);
+
+		if(rx_len >= 2 && rx_frame[1] != CP_MAGIC1) {
+			rx_len = 0;		// not a frame
+			continue;
+		}
+		if(rx_len == CP_HEADER_SIZE && get16(&rx_frame[6]) > CP_MAX_PAYLOAD) {
+			put16(&rx_frame[6], 0);
+			send_response(CP_ERR_FRAME, 0, 0);
+			rx_len = 0;
+			continue;
+		}
+		if(rx_len >= CP_HEADER_SIZE && rx_len == CP_HEADER_SIZE + get16(&rx_frame[6]) + CP_CRC_SIZE) {
+			handle_frame();
+			rx_len = 0;
+			return;
+		}
+	}
+}
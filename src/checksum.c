@@ -0,0 +1,30 @@
+#include "checksum.h"
+
+/* CRC-32 (IEEE 802.3) nibble table, small enough to not waste flash */
+static const uint32_t crc32_nibble_table[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+/***
+ *	Running CRC-32, start from CRC32_INIT and invert the result when done (see crc32 macro).
+ */
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, uint32_t length) {
+	for(uint32_t i = 0; i < length; i++) {
+		crc ^= data[i];
+		crc = crc32_nibble_table[crc & 0x0F] ^ (crc >> 4);
+		crc = crc32_nibble_table[crc & 0x0F] ^ (crc >> 4);
+	}
+	return crc;
+}
+
+/***
+ *	Running 32-bit FNV-1a hash, start from FNV1A_INIT.
+ */
+uint32_t fnv1a_update(uint32_t hash, const uint8_t* data, uint32_t length) {
+	for(uint32_t i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 0x01000193;
+	}
+	return hash;
+}
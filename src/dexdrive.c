@@ -0,0 +1,158 @@
+#include "dexdrive.h"
+#include <string.h>
+#include "config.h"
+#include "memory_card.h"
+#include "cdc_protocol.h"
+
+/***
+ *	Emulation of a PS1 DexDrive on the CDC interface, so that PC save managers (e.g. MemcardRex)
+ *	can read and write memory card images without mounting the SD card.
+ *
+ *	Commands are "IAI" followed by the command byte and its arguments, replies start with "IAI"
+ *	and a response byte. Frame numbers are sent most significant byte first, writes repeat them
+ *	bit-reversed and every frame carries the XOR of its address and data bytes.
+ *	Frames come from the image selected with CP_OP_DEX_IMAGE, the one being served by default.
+ */
+
+#define DEX_FIRMWARE	0x1B		// firmware version byte sent after "PSX"
+
+/* Commands */
+#define DEX_INIT		0x00
+#define DEX_STATUS		0x01
+#define DEX_READ		0x02
+#define DEX_SEEK		0x03
+#define DEX_WRITE		0x04
+#define DEX_PAGE		0x05
+#define DEX_LIGHT		0x07
+#define DEX_MAGIC		0x27
+
+/* Responses */
+#define DEX_ERROR		0x21
+#define DEX_CARD		0x23
+#define DEX_WRITE_OK	0x28
+#define DEX_ID			0x40
+#define DEX_DATA		0x41
+
+static const uint8_t prefix[] = {'I', 'A', 'I'};
+static uint8_t prefix_len = 0;		// bytes of the prefix received, +1 once the command byte is known
+static uint8_t command;
+static uint8_t args[4 + MC_SEC_SIZE + 1];
+static uint32_t args_len = 0;
+static uint32_t args_needed = 0;
+static uint8_t image_name[MAX_MC_FILENAME_LEN + 1] = "";	// empty = image being served
+
+static uint8_t reverse_bits(uint8_t b) {
+	b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+	b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+	return (b & 0xAA) >> 1 | (b & 0x55) << 1;
+}
+
+static uint8_t xor_bytes(const uint8_t* data, uint32_t len) {
+	uint8_t x = 0;
+	for(uint32_t i = 0; i < len; i++)
+		x ^= data[i];
+	return x;
+}
+
+static void reply(uint8_t response, const uint8_t* data, uint32_t len) {
+	uint8_t head[4] = {'I', 'A', 'I', response};
+	if(cdc_protocol_write(head, sizeof(head)) && len)
+		cdc_protocol_write(data, len);
+}
+
+static void read_frame() {
+	uint8_t frame[MC_SEC_SIZE + 1];
+	uint16_t number = (args[0] << 8) | args[1];
+	if(number >= MC_SEC_COUNT || CP_OK != cdc_image_read(image_name, number, 1, frame)) {
+		reply(DEX_ERROR, NULL, 0);
+		return;
+	}
+	frame[MC_SEC_SIZE] = args[0] ^ args[1] ^ xor_bytes(frame, MC_SEC_SIZE);
+	reply(DEX_DATA, frame, sizeof(frame));
+}
+
+static void write_frame() {
+	uint16_t number = (args[0] << 8) | args[1];
+	bool valid = number < MC_SEC_COUNT && args[2] == reverse_bits(args[0]) && args[3] == reverse_bits(args[1]) &&
+		xor_bytes(args, 4 + MC_SEC_SIZE) == args[4 + MC_SEC_SIZE];
+	if(!valid || CP_OK != cdc_image_write(image_name, number, 1, &args[4])) {
+		reply(DEX_ERROR, NULL, 0);
+		return;
+	}
+	reply(DEX_WRITE_OK, NULL, 0);
+}
+
+static void execute() {
+	static const uint8_t id[] = {0x00, 'P', 'S', 'X', DEX_FIRMWARE};
+	switch(command) {
+		case DEX_INIT:
+			reply(DEX_ID, id, sizeof(id));
+			break;
+		case DEX_STATUS:
+			reply(DEX_CARD, NULL, 0);
+			break;
+		case DEX_READ:
+			read_frame();
+			break;
+		case DEX_WRITE:
+			write_frame();
+			break;
+		case DEX_SEEK:
+			reply(DEX_ERROR, NULL, 0);		// N64 only
+			break;
+		default:
+			break;	// light, paging and handshake are not answered
+	}
+}
+
+static uint32_t args_for(uint8_t cmd) {
+	switch(cmd) {
+		case DEX_READ:
+		case DEX_SEEK:
+			return 2;
+		case DEX_WRITE:
+			return sizeof(args);
+		case DEX_PAGE:
+		case DEX_LIGHT:
+			return 1;
+		default:
+			return 0;	// INIT data is skipped as garbage
+	}
+}
+
+/**
+ * @brief Processes one byte received outside of protocol frames, returns true once a command has been executed
+ */
+bool dexdrive_feed(uint8_t byte) {
+	if(prefix_len < sizeof(prefix)) {
+		if(byte == prefix[prefix_len])
+			prefix_len++;
+		else
+			prefix_len = byte == prefix[0];
+		return false;
+	}
+	if(prefix_len == sizeof(prefix)) {
+		command = byte;
+		args_len = 0;
+		args_needed = args_for(byte);
+		prefix_len++;
+	} else {
+		args[args_len++] = byte;
+	}
+	if(args_len < args_needed)
+		return false;
+	prefix_len = 0;
+	execute();
+	return true;
+}
+
+/**
+ * @brief Returns whether the bytes received so far belong to an incomplete command
+ */
+bool dexdrive_is_busy() {
+	return prefix_len > sizeof(prefix);
+}
+
+void dexdrive_set_image(const uint8_t* file_name) {
+	strcpy(image_name, file_name);
+}
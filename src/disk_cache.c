@@ -0,0 +1,158 @@
+#include "disk_cache.h"
+#include <string.h>
+#include "diskio.h"
+#include "config.h"
+#include "sd_config.h"
+
+/***
+ *	Write-through, set-associative sector cache between FatFs and the SD driver.
+ *
+ *	FatFs disk_read()/disk_write() are wrapped at link time (-Wl,--wrap), the
+ *	original functions of the SD library are reached through __real_disk_*.
+ *	Only single sector transfers are cached: FatFs uses those for its metadata
+ *	window (FAT and directory sectors) and for partial sector file accesses
+ *	(e.g. f_gets), while bulk transfers of whole images go straight to the card.
+ *
+ *	Lines are replaced in LRU order, FAT and directory sectors get a head start
+ *	over data sectors so that browsing images does not evict them.
+ *
+ *	Being write-through the card is always up to date, sectors written bypassing
+ *	FatFs (e.g. USB mass storage) only require the matching lines to be invalidated.
+ */
+
+#define DC_LINES		(DISK_CACHE_SETS * DISK_CACHE_WAYS)
+#define DC_CACHED_DRIVE	0		// only the first SD card is cached
+
+typedef struct {
+	LBA_t sector;
+	uint32_t last_use;	// value of use_tick at last access
+	uint8_t class;
+	bool valid;
+} disk_cache_line_t;
+
+DRESULT __real_disk_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count);
+DRESULT __real_disk_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count);
+
+static const uint32_t class_bonus[DC_CLASS_COUNT] = {
+	[DC_CLASS_DATA] = 0,
+	[DC_CLASS_DIR] = DC_LINES * 2,	// accesses a line survives without being used
+	[DC_CLASS_FAT] = DC_LINES * 4,
+};
+
+static uint8_t line_data[DC_LINES][BLOCK_SIZE];
+static disk_cache_line_t lines[DC_LINES];
+static uint32_t use_tick = 0;
+static disk_cache_stats_t stats;
+
+static uint8_t classify_sector(BYTE pdrv, const BYTE* buff, LBA_t sector) {
+	FATFS* fs = &sd_get_by_num(pdrv)->fatfs;
+	if(buff != fs->win)
+		return DC_CLASS_DATA;	// not going through the metadata window
+	if(sector >= fs->fatbase && sector < fs->fatbase + (LBA_t) fs->fsize * fs->n_fats)
+		return DC_CLASS_FAT;
+	return DC_CLASS_DIR;
+}
+
+static disk_cache_line_t* find_line(LBA_t sector, uint32_t* out_index) {
+	uint32_t set = (sector % DISK_CACHE_SETS) * DISK_CACHE_WAYS;
+	for(uint32_t i = set; i < set + DISK_CACHE_WAYS; i++) {
+		if(lines[i].valid && lines[i].sector == sector) {
+			*out_index = i;
+			return &lines[i];
+		}
+	}
+	return NULL;
+}
+
+static disk_cache_line_t* alloc_line(LBA_t sector, uint8_t class, uint32_t* out_index) {
+	uint32_t set = (sector % DISK_CACHE_SETS) * DISK_CACHE_WAYS;
+	uint32_t victim = set;
+	uint32_t victim_remaining = UINT32_MAX;
+	uint32_t victim_age = 0;
+	for(uint32_t i = set; i < set + DISK_CACHE_WAYS; i++) {
+		if(!lines[i].valid) {
+			victim = i;
+			break;
+		}
+		/* evict the line with the shortest remaining lifetime, the oldest on ties */
+		uint32_t age = use_tick - lines[i].last_use;
+		uint32_t bonus = class_bonus[lines[i].class];
+		uint32_t remaining = age >= bonus ? 0 : bonus - age;
+		if(remaining < victim_remaining || (remaining == victim_remaining && age > victim_age)) {
+			victim = i;
+			victim_remaining = remaining;
+			victim_age = age;
+		}
+	}
+	lines[victim].sector = sector;
+	lines[victim].class = class;
+	lines[victim].valid = true;
+	*out_index = victim;
+	return &lines[victim];
+}
+
+DRESULT __wrap_disk_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count) {
+	if(pdrv != DC_CACHED_DRIVE)
+		return __real_disk_read(pdrv, buff, sector, count);
+	if(count != 1) {
+		++stats.bypassed;
+		return __real_disk_read(pdrv, buff, sector, count);
+	}
+	uint8_t class = classify_sector(pdrv, buff, sector);
+	uint32_t index;
+	disk_cache_line_t* line = find_line(sector, &index);
+	if(line) {
+		++stats.hits[class];
+		line->last_use = ++use_tick;
+		if(class > line->class)
+			line->class = class;
+		memcpy(buff, line_data[index], BLOCK_SIZE);
+		return RES_OK;
+	}
+	++stats.misses[class];
+	DRESULT res = __real_disk_read(pdrv, buff, sector, count);
+	if(res == RES_OK) {
+		line = alloc_line(sector, class, &index);
+		line->last_use = ++use_tick;
+		memcpy(line_data[index], buff, BLOCK_SIZE);
+	}
+	return res;
+}
+
+DRESULT __wrap_disk_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count) {
+	if(pdrv != DC_CACHED_DRIVE)
+		return __real_disk_write(pdrv, buff, sector, count);
+	DRESULT res = __real_disk_write(pdrv, buff, sector, count);
+	for(UINT i = 0; i < count; i++) {
+		uint32_t index;
+		disk_cache_line_t* line = find_line(sector + i, &index);
+		if(!line && count == 1 && res == RES_OK && buff == sd_get_by_num(pdrv)->fatfs.win)
+			line = alloc_line(sector, classify_sector(pdrv, buff, sector), &index);	// metadata is likely read again soon
+		if(!line)
+			continue;
+		if(res == RES_OK) {
+			memcpy(line_data[index], &buff[i * BLOCK_SIZE], BLOCK_SIZE);
+			line->last_use = ++use_tick;
+		} else {
+			line->valid = false;	// content on the card is unknown
+		}
+	}
+	return res;
+}
+
+void disk_cache_get_stats(disk_cache_stats_t* out_stats) {
+	if(out_stats)
+		*out_stats = stats;
+}
+
+void disk_cache_invalidate() {
+	for(uint32_t i = 0; i < DC_LINES; i++)
+		lines[i].valid = false;
+}
+
+void disk_cache_invalidate_range(LBA_t sector, uint32_t count) {
+	for(uint32_t i = 0; i < DC_LINES; i++) {
+		if(lines[i].valid && lines[i].sector >= sector && lines[i].sector < sector + count)
+			lines[i].valid = false;
+	}
+}
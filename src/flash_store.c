@@ -0,0 +1,517 @@
+#include "flash_store.h"
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "checksum.h"
+#include "memcard_manager.h"
+
+/***
+ *	Image kept in onboard flash, used when no SD card is available.
+ *
+ *	The end of the flash is a log of memory card sectors. Each flash sector (unit) holds
+ *	a tag page followed by FL_SLOTS sector slots. The tag page starts with a header
+ *	(erase count and sequence number of the unit) and lists which memory card sector
+ *	each slot holds, with a CRC over the sector number and data.
+ *
+ *	Sectors are never rewritten in place: a new version goes into the next free slot of
+ *	the head unit, data pages first and then the tag page, which is programmed again as
+ *	a whole since programming only clears bits. The latest version of a sector is the
+ *	one in the unit with the highest sequence number, and within it the highest slot.
+ *	A slot whose tag does not match its CRC was torn by a power loss and is ignored, so
+ *	the previous version survives.
+ *
+ *	Units only holding outdated versions are erased and reused. Free units are taken
+ *	lowest erase count first, and units holding data that never changes are moved once
+ *	the erase counts spread too much, so that wear is spread over the whole store.
+ *
+ *	Code runs from flash, which cannot be read while it is programmed or erased. The
+ *	sync core therefore hands each operation to the simulation core, which runs it
+ *	between two memory card transactions while the sync core waits in RAM.
+ */
+
+#define FL_UNIT_SIZE		FLASH_SECTOR_SIZE		// erase granularity
+#define FL_UNITS			(FLASH_STORE_SIZE / FL_UNIT_SIZE)
+#define FL_SLOTS_PER_PAGE	(FLASH_PAGE_SIZE / MC_SEC_SIZE)
+#define FL_SLOTS			((FL_UNIT_SIZE - FLASH_PAGE_SIZE) / MC_SEC_SIZE)	// first page holds the tags
+#define FL_OFFSET			(PICO_FLASH_SIZE_BYTES - FLASH_STORE_SIZE)
+#define FL_MIN_UNITS		((MC_SEC_COUNT + FL_SLOTS - 1) / FL_SLOTS + FLASH_STORE_RESERVE + 2)
+#define FL_MAGIC			0x53464D50	// "PMFS"
+#define FL_NO_SEQ			0xFFFFFFFF
+#define FL_NO_SLOT			0xFFFF
+#define FL_MAX_ERASE		0xFFFF
+
+/* Unit states */
+#define FL_UNIT_GARBAGE		0		// to be erased before use
+#define FL_UNIT_FREE		1		// erased, header written
+#define FL_UNIT_DATA		2		// holds sectors, some possibly outdated
+
+/* Flash operations run by the simulation core */
+#define FL_JOB_NONE			0
+#define FL_JOB_PROGRAM		1
+#define FL_JOB_ERASE		2
+
+typedef struct {
+	uint32_t magic;
+	uint16_t erase_count;
+	uint16_t erase_count_inv;
+	uint32_t seq;				// FL_NO_SEQ until the unit receives sectors
+	uint32_t seq_inv;
+} unit_header_t;
+
+typedef struct {
+	uint16_t sector;
+	uint16_t reserved;
+	uint32_t crc;				// of the sector number and data
+} slot_tag_t;
+
+typedef struct {
+	unit_header_t header;
+	slot_tag_t tags[FL_SLOTS];
+} tag_page_t;
+
+typedef struct {
+	uint32_t seq;
+	uint16_t erase_count;
+	uint8_t state;
+	uint8_t live;				// slots holding the latest version of a sector
+} unit_t;
+
+typedef struct {
+	volatile uint8_t op;
+	volatile bool running;		// taken by the simulation core, can no longer be cancelled
+	uint32_t offset;
+	const uint8_t* data;
+	uint32_t len;
+	uint32_t min_quiet_us;
+} flash_job_t;
+
+extern char __flash_binary_end;
+
+static unit_t units[FL_UNITS];
+static uint16_t sector_slot[MC_SEC_COUNT];	// unit * FL_SLOTS + slot of the latest version of each sector
+static uint32_t next_seq = 0;
+static int32_t head = -1;				// unit receiving new sectors, -1 = none
+static uint32_t head_next_slot = 0;
+static tag_page_t head_tags;			// RAM copy of the tag page of the head unit
+static uint8_t page_buffer[FLASH_PAGE_SIZE];
+
+/* sectors written by the console, programmed together */
+static uint16_t batch_sector[FLASH_STORE_BATCH];
+static uint8_t batch_data[FLASH_STORE_BATCH][MC_SEC_SIZE];
+static uint32_t batch_count = 0;
+
+/* live sectors of a unit being moved, copied to RAM as flash is not readable while programmed */
+static uint16_t reloc_sector[FL_SLOTS];
+static uint8_t reloc_data[FL_SLOTS][MC_SEC_SIZE];
+
+static flash_job_t job;
+static spin_lock_t* job_lock;
+
+static inline const uint8_t* flash_ptr(uint32_t offset) {
+	return (const uint8_t*) (XIP_BASE + FL_OFFSET + offset);
+}
+
+static inline uint32_t unit_offset(uint32_t unit) {
+	return unit * FL_UNIT_SIZE;
+}
+
+static inline uint32_t slot_offset(uint32_t unit, uint32_t slot) {
+	return unit_offset(unit) + FLASH_PAGE_SIZE + slot * MC_SEC_SIZE;
+}
+
+static uint32_t tag_crc(uint16_t sector, const uint8_t* data) {
+	uint8_t sector_bytes[2] = {sector & 0xFF, sector >> 8};
+	return ~crc32_update(crc32_update(CRC32_INIT, sector_bytes, 2), data, MC_SEC_SIZE);
+}
+
+static bool is_blank(uint32_t offset, uint32_t len) {
+	const uint32_t* words = (const uint32_t*) flash_ptr(offset);
+	for(uint32_t i = 0; i < len / 4; i++) {
+		if(words[i] != 0xFFFFFFFF)
+			return false;
+	}
+	return true;
+}
+
+/***
+ *	Hands a flash operation to the simulation core and waits for it. With a timeout the
+ *	operation is cancelled, and FL_BUSY returned, if the console keeps the card busy.
+ */
+static uint32_t run_job(uint8_t op, uint32_t offset, const uint8_t* data, uint32_t len, uint32_t min_quiet_us, uint32_t timeout_us) {
+	job.offset = FL_OFFSET + offset;
+	job.data = data;
+	job.len = len;
+	job.min_quiet_us = min_quiet_us;
+	job.running = false;
+	__dmb();
+	job.op = op;
+
+	absolute_time_t start = get_absolute_time();
+	while(job.op != FL_JOB_NONE) {
+		if(timeout_us && absolute_time_diff_us(start, get_absolute_time()) > timeout_us) {
+			uint32_t save = spin_lock_blocking(job_lock);
+			bool cancelled = !job.running;
+			if(cancelled)
+				job.op = FL_JOB_NONE;
+			spin_unlock(job_lock, save);
+			if(cancelled)
+				return FL_BUSY;
+		}
+		tight_loop_contents();
+	}
+
+	if(op == FL_JOB_ERASE)
+		return is_blank(offset, len) ? FL_OK : FL_WRITE_ERR;
+	/* bits left at 1 in data keep what was programmed before */
+	const uint8_t* programmed = flash_ptr(offset);
+	for(uint32_t i = 0; i < len; i++) {
+		if(programmed[i] & ~data[i])
+			return FL_WRITE_ERR;
+	}
+	return FL_OK;
+}
+
+static inline uint32_t program_page(uint32_t offset, const void* data) {
+	return run_job(FL_JOB_PROGRAM, offset, data, FLASH_PAGE_SIZE, FLASH_STORE_PROGRAM_QUIET, 0);
+}
+
+/**
+ * @brief Runs the operation requested by the sync core (simulation core, between two transactions)
+ * @param quiet_us time since the last memory card access
+ */
+void flash_store_run_job(uint32_t quiet_us) {
+	if(job.op == FL_JOB_NONE || quiet_us < job.min_quiet_us)
+		return;
+	uint32_t save = spin_lock_blocking(job_lock);
+	uint8_t op = job.op;	// may have been cancelled meanwhile
+	job.running = op != FL_JOB_NONE;
+	spin_unlock(job_lock, save);
+	if(op == FL_JOB_NONE)
+		return;
+
+	multicore_lockout_start_blocking();		// sync core parked in RAM while flash is not readable
+	save = save_and_disable_interrupts();
+	if(op == FL_JOB_ERASE)
+		flash_range_erase(job.offset, job.len);
+	else
+		flash_range_program(job.offset, job.data, job.len);
+	restore_interrupts(save);
+	multicore_lockout_end_blocking();
+	__dmb();
+	job.op = FL_JOB_NONE;
+}
+
+static void set_location(uint16_t sector, uint16_t location) {
+	uint16_t old = sector_slot[sector];
+	if(old != FL_NO_SLOT)
+		units[old / FL_SLOTS].live--;
+	sector_slot[sector] = location;
+	units[location / FL_SLOTS].live++;
+}
+
+static bool is_garbage(uint32_t unit) {
+	return unit != head && (units[unit].state == FL_UNIT_GARBAGE || (units[unit].state == FL_UNIT_DATA && !units[unit].live));
+}
+
+/***
+ *	Erases a unit and writes its header, the unit is left as garbage on failure.
+ */
+static uint32_t erase_unit(uint32_t unit, uint32_t min_quiet_us, uint32_t timeout_us) {
+	uint32_t erase_count = units[unit].erase_count < FL_MAX_ERASE ? units[unit].erase_count + 1 : FL_MAX_ERASE;
+	uint32_t status = run_job(FL_JOB_ERASE, unit_offset(unit), NULL, FL_UNIT_SIZE, min_quiet_us, timeout_us);
+	if(status != FL_OK)
+		return status;
+	units[unit].state = FL_UNIT_GARBAGE;
+	units[unit].erase_count = erase_count;
+	units[unit].seq = FL_NO_SEQ;
+
+	unit_header_t* header = (unit_header_t*) page_buffer;
+	memset(page_buffer, 0xFF, FLASH_PAGE_SIZE);
+	header->magic = FL_MAGIC;
+	header->erase_count = erase_count;
+	header->erase_count_inv = ~erase_count;
+	status = program_page(unit_offset(unit), page_buffer);
+	if(status == FL_OK)
+		units[unit].state = FL_UNIT_FREE;
+	return status;
+}
+
+/***
+ *	Returns the free unit with the lowest erase count, the last free unit is only handed
+ *	out to garbage collection so that it can always move live sectors somewhere.
+ */
+static int32_t pick_free_unit(bool for_gc) {
+	int32_t best = -1;
+	uint32_t free_units = 0;
+	for(uint32_t i = 0; i < FL_UNITS; i++) {
+		if(units[i].state != FL_UNIT_FREE)
+			continue;
+		free_units++;
+		if(best < 0 || units[i].erase_count < units[best].erase_count)
+			best = i;
+	}
+	if(!for_gc && free_units < 2)
+		return -1;
+	return best;
+}
+
+static uint32_t open_unit(uint32_t unit) {
+	memset(&head_tags, 0xFF, sizeof(head_tags));
+	head_tags.header.magic = FL_MAGIC;
+	head_tags.header.erase_count = units[unit].erase_count;
+	head_tags.header.erase_count_inv = ~units[unit].erase_count;
+	head_tags.header.seq = next_seq;
+	head_tags.header.seq_inv = ~next_seq;
+	uint32_t status = program_page(unit_offset(unit), &head_tags);
+	if(status != FL_OK) {
+		units[unit].state = FL_UNIT_GARBAGE;
+		return status;
+	}
+	units[unit].state = FL_UNIT_DATA;
+	units[unit].seq = next_seq++;
+	units[unit].live = 0;
+	head = unit;
+	head_next_slot = 0;
+	return FL_OK;
+}
+
+static uint32_t collect(uint32_t min_quiet_us, uint32_t timeout_us);
+
+/***
+ *	Makes sure the head unit has a free slot, collecting garbage when free units run out.
+ */
+static uint32_t open_head(bool for_gc) {
+	while(head < 0 || head_next_slot >= FL_SLOTS) {
+		int32_t unit = pick_free_unit(for_gc);
+		if(unit >= 0)
+			return open_unit(unit);
+		if(for_gc)
+			return FL_NO_SPACE;
+		/* reserve exhausted while saving, stalls the console for the time of an erase */
+		uint32_t status = collect(FLASH_STORE_PROGRAM_QUIET, 0);
+		if(status != FL_OK)
+			return status;
+	}
+	return FL_OK;
+}
+
+/***
+ *	Appends sectors to the log. Data pages are programmed before the tag page, a sector
+ *	only replaces its previous version once its tag is in flash.
+ */
+static uint32_t write_sectors(const uint16_t* sectors, uint8_t (*data)[MC_SEC_SIZE], uint32_t count, bool for_gc) {
+	uint32_t done = 0;
+	while(done < count) {
+		uint32_t status = open_head(for_gc);
+		if(status != FL_OK)
+			return status;
+		uint32_t first = head_next_slot;
+		uint32_t n = count - done < FL_SLOTS - first ? count - done : FL_SLOTS - first;
+		for(uint32_t slot = first; slot < first + n; slot++) {
+			uint32_t i = done + slot - first;
+			if(slot == first || slot % FL_SLOTS_PER_PAGE == 0)
+				memset(page_buffer, 0xFF, FLASH_PAGE_SIZE);	// slots already programmed are left as they are
+			memcpy(&page_buffer[(slot % FL_SLOTS_PER_PAGE) * MC_SEC_SIZE], data[i], MC_SEC_SIZE);
+			head_tags.tags[slot].sector = sectors[i];
+			head_tags.tags[slot].crc = tag_crc(sectors[i], data[i]);
+			if(slot == first + n - 1 || slot % FL_SLOTS_PER_PAGE == FL_SLOTS_PER_PAGE - 1) {
+				status = program_page(slot_offset(head, slot - slot % FL_SLOTS_PER_PAGE), page_buffer);
+				if(status != FL_OK)
+					break;
+			}
+		}
+		if(status == FL_OK)
+			status = program_page(unit_offset(head), &head_tags);
+		if(status != FL_OK) {
+			head_next_slot = FL_SLOTS;	// slots may be half programmed, leave the unit
+			return status;
+		}
+		for(uint32_t slot = first; slot < first + n; slot++)
+			set_location(sectors[done + slot - first], head * FL_SLOTS + slot);
+		head_next_slot += n;
+		done += n;
+	}
+	return FL_OK;
+}
+
+/***
+ *	Moves the live sectors of a unit to the head unit, then erases it.
+ */
+static uint32_t relocate_unit(uint32_t unit, uint32_t min_quiet_us, uint32_t timeout_us) {
+	const tag_page_t* tags = (const tag_page_t*) flash_ptr(unit_offset(unit));
+	uint32_t count = 0;
+	for(uint32_t slot = 0; slot < FL_SLOTS; slot++) {
+		uint16_t sector = tags->tags[slot].sector;
+		if(sector < MC_SEC_COUNT && sector_slot[sector] == unit * FL_SLOTS + slot) {
+			reloc_sector[count] = sector;
+			memcpy(reloc_data[count++], flash_ptr(slot_offset(unit, slot)), MC_SEC_SIZE);
+		}
+	}
+	uint32_t status = write_sectors(reloc_sector, reloc_data, count, true);
+	if(status != FL_OK)
+		return status;
+	return erase_unit(unit, min_quiet_us, timeout_us);
+}
+
+/***
+ *	Frees one unit: erases one holding only outdated sectors, otherwise moves the
+ *	live sectors of the unit having the fewest.
+ */
+static uint32_t collect(uint32_t min_quiet_us, uint32_t timeout_us) {
+	int32_t victim = -1;
+	for(uint32_t i = 0; i < FL_UNITS; i++) {
+		if(is_garbage(i))
+			return erase_unit(i, min_quiet_us, timeout_us);
+		if(i != head && units[i].state == FL_UNIT_DATA && (victim < 0 || units[i].live < units[victim].live))
+			victim = i;
+	}
+	if(victim < 0 || units[victim].live == FL_SLOTS)
+		return FL_NO_SPACE;
+	return relocate_unit(victim, min_quiet_us, timeout_us);
+}
+
+static int compare_seq(const void* a, const void* b) {
+	uint32_t seq_a = units[*(const uint16_t*) a].seq;
+	uint32_t seq_b = units[*(const uint16_t*) b].seq;
+	return seq_a < seq_b ? -1 : seq_a > seq_b;
+}
+
+/***
+ *	Rebuilds the location of every sector from the tags found in flash. Writing always
+ *	resumes in a fresh unit, the slots after the last tag of a unit may be torn.
+ */
+uint32_t flash_store_init() {
+	if(FL_OFFSET < (uint32_t) &__flash_binary_end - XIP_BASE || FL_UNITS < FL_MIN_UNITS)
+		return FL_NO_SPACE;
+	if(!job_lock)
+		job_lock = spin_lock_init(spin_lock_claim_unused(true));
+
+	uint16_t order[FL_UNITS];
+	uint32_t data_units = 0;
+	uint32_t max_erase = 0;
+	bool unknown_erase = false;
+	for(uint32_t i = 0; i < FL_UNITS; i++) {
+		const unit_header_t* header = (const unit_header_t*) flash_ptr(unit_offset(i));
+		units[i].seq = FL_NO_SEQ;
+		units[i].live = 0;
+		units[i].erase_count = 0;
+		if(header->magic != FL_MAGIC || (uint16_t) ~header->erase_count != header->erase_count_inv) {
+			units[i].state = FL_UNIT_GARBAGE;	// never used, or erase torn
+			unknown_erase = true;
+			continue;
+		}
+		units[i].erase_count = header->erase_count;
+		if(header->erase_count > max_erase)
+			max_erase = header->erase_count;
+		if(header->seq == FL_NO_SEQ && header->seq_inv == FL_NO_SEQ && is_blank(unit_offset(i) + sizeof(unit_header_t), FL_UNIT_SIZE - sizeof(unit_header_t))) {
+			units[i].state = FL_UNIT_FREE;
+		} else if(~header->seq == header->seq_inv) {
+			units[i].state = FL_UNIT_DATA;
+			units[i].seq = header->seq;
+			if(header->seq >= next_seq)
+				next_seq = header->seq + 1;
+			order[data_units++] = i;
+		} else {
+			units[i].state = FL_UNIT_GARBAGE;
+		}
+	}
+	/* erase counts lost with a torn header are assumed to be the highest */
+	for(uint32_t i = 0; unknown_erase && i < FL_UNITS; i++) {
+		if(units[i].state == FL_UNIT_GARBAGE && !units[i].erase_count)
+			units[i].erase_count = max_erase;
+	}
+
+	memset(sector_slot, 0xFF, sizeof(sector_slot));
+	qsort(order, data_units, sizeof(order[0]), compare_seq);
+	for(uint32_t i = 0; i < data_units; i++) {
+		const tag_page_t* tags = (const tag_page_t*) flash_ptr(unit_offset(order[i]));
+		for(uint32_t slot = 0; slot < FL_SLOTS; slot++) {
+			const slot_tag_t* tag = &tags->tags[slot];
+			if(tag->sector < MC_SEC_COUNT && tag->crc == tag_crc(tag->sector, flash_ptr(slot_offset(order[i], slot))))
+				set_location(tag->sector, order[i] * FL_SLOTS + slot);
+		}
+	}
+	head = -1;
+	batch_count = 0;
+	return FL_OK;
+}
+
+/**
+ * @brief Copies the image into RAM, sectors never written come from a freshly formatted card
+ */
+void flash_store_load(uint8_t* out_data) {
+	for(sector_t i = 0; i < MC_SEC_COUNT; i++) {
+		uint16_t location = sector_slot[i];
+		const uint8_t* src;
+		if(location != FL_NO_SLOT)
+			src = flash_ptr(slot_offset(location / FL_SLOTS, location % FL_SLOTS));
+		else
+			src = &memcard_manager_get_template_block(i / MC_SEC_PER_BLOCK)[(i % MC_SEC_PER_BLOCK) * MC_SEC_SIZE];
+		memcpy(&out_data[i * MC_SEC_SIZE], src, MC_SEC_SIZE);
+	}
+}
+
+/**
+ * @brief Stages a sector in RAM, written again before being flushed it only takes one slot
+ */
+uint32_t flash_store_write(sector_t sector, const uint8_t* data) {
+	for(uint32_t i = 0; i < batch_count; i++) {
+		if(batch_sector[i] == sector) {
+			memcpy(batch_data[i], data, MC_SEC_SIZE);
+			return FL_OK;
+		}
+	}
+	if(batch_count == FLASH_STORE_BATCH) {
+		uint32_t status = flash_store_flush();
+		if(status != FL_OK)
+			return status;
+	}
+	batch_sector[batch_count] = sector;
+	memcpy(batch_data[batch_count++], data, MC_SEC_SIZE);
+	return FL_OK;
+}
+
+/**
+ * @brief Programs the staged sectors into flash, they are kept staged on failure
+ */
+uint32_t flash_store_flush() {
+	if(!batch_count)
+		return FL_OK;
+	uint32_t status = write_sectors(batch_sector, batch_data, batch_count, false);
+	if(status == FL_OK)
+		batch_count = 0;
+	return status;
+}
+
+bool flash_store_has_pending() {
+	return batch_count > 0;
+}
+
+/***
+ *	One step of background maintenance, run while the console leaves the card alone:
+ *	erases outdated units, refills the reserve of free units and moves data that never
+ *	changes out of little worn units. Returns FL_BUSY when the card did not stay quiet.
+ */
+uint32_t flash_store_maintain() {
+	uint32_t free_units = 0;
+	uint32_t max_erase = 0;
+	int32_t coldest = -1;
+	for(uint32_t i = 0; i < FL_UNITS; i++) {
+		if(units[i].erase_count > max_erase)
+			max_erase = units[i].erase_count;
+		if(is_garbage(i))
+			return erase_unit(i, FLASH_STORE_ERASE_QUIET, FLASH_STORE_ERASE_QUIET);
+		if(units[i].state == FL_UNIT_FREE)
+			free_units++;
+		else if(i != head && units[i].state == FL_UNIT_DATA && (coldest < 0 || units[i].erase_count < units[coldest].erase_count))
+			coldest = i;
+	}
+	if(free_units < FLASH_STORE_RESERVE)
+		return collect(FLASH_STORE_ERASE_QUIET, FLASH_STORE_ERASE_QUIET);
+	if(coldest >= 0 && max_erase - units[coldest].erase_count > FLASH_STORE_WEAR_DELTA)
+		return relocate_unit(coldest, FLASH_STORE_ERASE_QUIET, FLASH_STORE_ERASE_QUIET);
+	return FL_OK;
+}
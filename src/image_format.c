@@ -0,0 +1,104 @@
+#include "image_format.h"
+#include <string.h>
+#include "memory_card.h"
+
+/***
+ *	Images dumped by other tools and emulators are loaded as they are: their container
+ *	is recognized by its size and header, and the raw card data found after the header
+ *	is read and written in place, so the file keeps its native format.
+ *
+ *	Headers are never modified. .VMP files are signed over their card data, a file
+ *	written back would carry a stale signature and be rejected by the PSP or PS3: they
+ *	are only ever opened for reading, changes made while one is served stay in RAM.
+ */
+
+typedef struct {
+	uint8_t format;
+	uint32_t header_size;		// raw card data starts right after the header
+	const char* magic;
+	uint32_t magic_len;
+	bool writable;
+} container_t;
+
+static const container_t containers[] = {
+	{IF_FORMAT_RAW, 0, "", 0, true},
+	{IF_FORMAT_GME, 0xF40, "123-456-STD", 11, true},
+	{IF_FORMAT_VGS, 0x40, "VgsM", 4, true},
+	{IF_FORMAT_VMP, 0x80, "\0PMV", 4, false},
+};
+
+static const char* image_exts[] = {".MCR", ".PSM", ".GME", ".VGS", ".MEM", ".VMP"};
+
+#define CONTAINER_COUNT	(sizeof(containers) / sizeof(containers[0]))
+#define IMAGE_EXT_COUNT	(sizeof(image_exts) / sizeof(image_exts[0]))
+#define MAX_MAGIC_LEN	11
+
+/**
+ * @brief Returns true when the extension is one of an image container in any case (manifests excluded)
+ */
+bool image_format_is_image_name(const uint8_t* file_name) {
+	const char* ext = strrchr(file_name, '.');
+	if(!ext)
+		return false;
+	for(uint32_t i = 0; i < IMAGE_EXT_COUNT; i++) {
+		if(!strcasecmp(ext, image_exts[i]))
+			return true;
+	}
+	return false;
+}
+
+bool image_format_is_size_valid(FSIZE_t size) {
+	for(uint32_t i = 0; i < CONTAINER_COUNT; i++) {
+		if(size == containers[i].header_size + MC_SIZE)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Returns whether the container whose card data starts at data_offset can be written back (header sizes are all different)
+ */
+bool image_format_is_writable(FSIZE_t data_offset) {
+	for(uint32_t i = 0; i < CONTAINER_COUNT; i++) {
+		if(containers[i].header_size == data_offset)
+			return containers[i].writable;
+	}
+	return false;
+}
+
+static const container_t* detect(FIL* fil) {
+	uint8_t magic[MAX_MAGIC_LEN];
+	UINT bytes_read;
+	for(uint32_t i = 0; i < CONTAINER_COUNT; i++) {
+		const container_t* c = &containers[i];
+		if(f_size(fil) != c->header_size + MC_SIZE)
+			continue;
+		if(!c->magic_len)
+			return c;
+		if(FR_OK == f_lseek(fil, 0) && FR_OK == f_read(fil, magic, c->magic_len, &bytes_read) &&
+			bytes_read == c->magic_len && !memcmp(magic, c->magic, c->magic_len))
+			return c;
+	}
+	return NULL;
+}
+
+/***
+ *	Opens an image file of any supported container, positioned at the start of the raw
+ *	card data whose offset in the file is returned through out_offset.
+ */
+uint32_t image_format_open(FIL* fil, const uint8_t* file_name, BYTE mode, FSIZE_t* out_offset) {
+	if(FR_OK != f_open(fil, file_name, mode))
+		return IF_FILE_OPEN_ERR;
+	const container_t* c = detect(fil);
+	if(!c || FR_OK != f_lseek(fil, c->header_size)) {
+		f_close(fil);
+		return IF_BAD_FORMAT;
+	}
+	if((mode & FA_WRITE) && !c->writable) {
+		f_close(fil);
+		return IF_READ_ONLY;
+	}
+	*out_offset = c->header_size;
+	return IF_OK;
+}
+
@@ -96,6 +96,7 @@ void lcd_toggle_enable(uint8_t val) {
 }
 
 // The display is sent a byte as two separate nibble transfers
+// Blocking, only used to initialize the panel before the refresh timer runs
 void lcd_send_byte(uint8_t val, int mode) {
     uint8_t high = mode | (val & 0xF0) | LCD_BACKLIGHT;
     uint8_t low = mode | ((val << 4) & 0xF0) | LCD_BACKLIGHT;
@@ -106,24 +107,139 @@ void lcd_send_byte(uint8_t val, int mode) {
     lcd_toggle_enable(low);
 }
 
+/* Frame buffer based driver
+ *
+ * Callers only write into frame_buffer, a repeating timer compares it with
+ * shown (what the panel currently displays) and sends one changed cell per
+ * tick by queueing the nibble/enable sequence straight into the I2C TX FIFO.
+ * The I2C byte time (~25us at 400kHz) provides the HD44780 enable pulse width
+ * and the execution delay between nibbles, so nothing ever sleeps on core0.
+ */
+#define LCD_ADDR_UNKNOWN    0xFF
+#define LCD_CELL_BYTES      12      // DDRAM address command + character, 3 bytes per nibble
+
+typedef struct {
+    char text[LCD_SCROLL_MAX_LEN + 1];
+    uint32_t len;                   // 0 when the line is not scrolling
+    uint32_t offset;
+    uint32_t next_step_us;
+} lcd_scroll_t;
+
+static char frame_buffer[MAX_LINES][MAX_CHARS];
+static char shown[MAX_LINES][MAX_CHARS];
+static volatile lcd_scroll_t scroll[MAX_LINES];
+static int cursor_line = 0;
+static int cursor_pos = 0;
+static uint8_t lcd_addr = LCD_ADDR_UNKNOWN;    // DDRAM address counter of the panel
+static uint32_t next_cell = 0;
+static repeating_timer_t refresh_timer;
+
+static inline uint8_t cell_addr(uint32_t line, uint32_t pos) {
+    return (line == 0 ? 0x00 : 0x40) + pos;
+}
+
+static inline void fifo_push_nibble(i2c_hw_t *hw, uint8_t nibble, bool last) {
+    hw->data_cmd = nibble;
+    hw->data_cmd = nibble | LCD_ENABLE_BIT;
+    hw->data_cmd = nibble | (last ? I2C_IC_DATA_CMD_STOP_BITS : 0);
+}
+
+static void fifo_push_byte(i2c_hw_t *hw, uint8_t val, int mode, bool last) {
+    fifo_push_nibble(hw, mode | (val & 0xF0) | LCD_BACKLIGHT, false);
+    fifo_push_nibble(hw, mode | ((val << 4) & 0xF0) | LCD_BACKLIGHT, last);
+}
+
+static void scroll_step(uint32_t line) {
+    volatile lcd_scroll_t *s = &scroll[line];
+    uint32_t period = s->len + LCD_SCROLL_GAP;
+    if(s->len == 0 || (int32_t)(time_us_32() - s->next_step_us) < 0)
+        return;
+    for(uint32_t i = 0; i < MAX_CHARS; i++) {
+        uint32_t c = (s->offset + i) % period;
+        frame_buffer[line][i] = c < s->len ? s->text[c] : ' ';
+    }
+    /* pause a little longer each time the start of the text is shown */
+    s->next_step_us = time_us_32() + (s->offset == 0 ? LCD_SCROLL_PAUSE_MS : LCD_SCROLL_INTERVAL_MS) * 1000;
+    s->offset = (s->offset + 1) % period;
+}
+
+static bool lcd_refresh(repeating_timer_t *rt) {
+    i2c_hw_t *hw = i2c_get_hw(I2C_INDEX);
+    (void) rt;
+
+    if(hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS) {
+        /* panel did not acknowledge, FIFO was flushed: redraw everything */
+        (void) hw->clr_tx_abrt;
+        memset(shown, 0, sizeof(shown));
+        lcd_addr = LCD_ADDR_UNKNOWN;
+    }
+    for(uint32_t line = 0; line < MAX_LINES; line++)
+        scroll_step(line);
+    if(i2c_get_write_available(I2C_INDEX) < LCD_CELL_BYTES)
+        return true;    // previous cell still being sent
+
+    for(uint32_t i = 0; i < MAX_LINES * MAX_CHARS; i++) {
+        uint32_t cell = (next_cell + i) % (MAX_LINES * MAX_CHARS);
+        uint32_t line = cell / MAX_CHARS, pos = cell % MAX_CHARS;
+        char c = frame_buffer[line][pos];
+        if(c == shown[line][pos])
+            continue;
+        uint8_t a = cell_addr(line, pos);
+        if(a != lcd_addr)
+            fifo_push_byte(hw, LCD_SETDDRAMADDR | a, LCD_COMMAND, false);
+        fifo_push_byte(hw, c, LCD_CHARACTER, true);
+        shown[line][pos] = c;
+        lcd_addr = a + 1;
+        next_cell = cell + 1;
+        break;
+    }
+    return true;
+}
+
+static void stop_scroll(int line) {
+    scroll[line].len = 0;
+}
+
 void lcd_clear(void) {
-    lcd_send_byte(LCD_CLEARDISPLAY, LCD_COMMAND);
+    for(int line = 0; line < MAX_LINES; line++)
+        stop_scroll(line);
+    memset(frame_buffer, ' ', sizeof(frame_buffer));
+    cursor_line = 0;
+    cursor_pos = 0;
 }
 
 // go to location on LCD
 void lcd_set_cursor(int line, int position) {
-    int val = (line == 0) ? 0x80 + position : 0xC0 + position;
-    lcd_send_byte(val, LCD_COMMAND);
+    cursor_line = (line == 0) ? 0 : 1;
+    cursor_pos = position;
 }
 
-static void inline lcd_char(char val) {
-    lcd_send_byte(val, LCD_CHARACTER);
+void lcd_string(const char *s) {
+    stop_scroll(cursor_line);
+    while (*s && cursor_pos < MAX_CHARS) {
+        frame_buffer[cursor_line][cursor_pos++] = *s++;
+    }
 }
 
-void lcd_string(const char *s) {
-    while (*s) {
-        lcd_char(*s++);
+void lcd_scroll_string(int line, const char *s) {
+    volatile lcd_scroll_t *sc = &scroll[line == 0 ? 0 : 1];
+    uint32_t len = strnlen(s, LCD_SCROLL_MAX_LEN);
+
+    line = (line == 0) ? 0 : 1;
+    if(len <= MAX_CHARS) {
+        stop_scroll(line);
+        memset(frame_buffer[line], ' ', MAX_CHARS);
+        memcpy(frame_buffer[line], s, len);
+        return;
     }
+    if(sc->len == len && memcmp((const char*)sc->text, s, len) == 0)
+        return;     // already scrolling this text
+    sc->len = 0;    // keep the timer away while the text is replaced
+    memcpy((char*)sc->text, s, len);
+    sc->text[len] = '\0';
+    sc->offset = 0;
+    sc->next_step_us = time_us_32();
+    sc->len = len;
 }
 
 void lcd_init() {
@@ -136,7 +252,8 @@ void lcd_init() {
     lcd_send_byte(LCD_FUNCTIONSET | LCD_2LINE, LCD_COMMAND);
     lcd_send_byte(LCD_DISPLAYCONTROL | LCD_DISPLAYON, LCD_COMMAND);
 
-    lcd_clear();
+    lcd_send_byte(LCD_CLEARDISPLAY, LCD_COMMAND);
+    sleep_ms(2);    // clear display is the one slow (1.52ms) instruction
 }
 
 int lcd_init_main() {
@@ -150,5 +267,12 @@ int lcd_init_main() {
     bi_decl(bi_2pins_with_func(I2C_SDA_PIN, I2C_SCL_PIN, GPIO_FUNC_I2C));
 
     lcd_init();
+    memset(shown, ' ', sizeof(shown));  // panel was just cleared
+    lcd_addr = 0;
+
+    /* from now on the panel is only driven by the refresh timer (target address was set by the blocking writes above) */
+    lcd_clear();
     lcd_string("Initializing...");
+    add_repeating_timer_us(-LCD_REFRESH_INTERVAL_US, lcd_refresh, NULL, &refresh_timer);
+    return 0;
 }
@@ -2,6 +2,7 @@
 #include "config.h"
 #include "hardware/gpio.h"
 #include "hardware/pio.h"
+#include "pico/util/queue.h"
 #ifdef RP2040ZERO
 #include "ws2812.pio.h"
 #endif
@@ -10,12 +11,75 @@
 #define PICO_LED_PIN 25
 #endif
 
+#define LED_OFF			0x000000
+#define LED_RED			0xFF0000
+#define LED_GREEN		0x00FF00
+#define LED_BLUE		0x0000FF
+#define LED_YELLOW		0xFFC800
+#define LED_ORANGE		0xFF6000
+#define LED_LIGHT_BLUE	0x34ABEB
+#define LED_ON			LED_GREEN	// single color LED of the Pico, any color turns it on
+
+typedef struct {
+	uint32_t rgb;
+	uint32_t duration;	// in ms
+} led_step_t;
+
+typedef struct {
+	uint32_t lead;		// time (in ms) the LED is off before the steps
+	const led_step_t* steps;
+	uint32_t step_count;
+	uint32_t repeat;	// times the steps are played, overridden by the event count when not 0
+} led_pattern_t;
+
+typedef struct {
+	uint8_t pattern;
+	uint8_t count;
+} led_event_t;
+
+enum LED_PATTERN {
+	LED_PATTERN_NONE,
+	LED_PATTERN_ERROR,
+	LED_PATTERN_MC_CHANGE,
+	LED_PATTERN_END_MC_LIST,
+	LED_PATTERN_NEW_MC,
+	LED_PATTERN_COUNT
+};
+
+#define STEPS(...)	(const led_step_t[]){ __VA_ARGS__ }, sizeof((const led_step_t[]){ __VA_ARGS__ }) / sizeof(led_step_t)
+
+static const led_pattern_t patterns[LED_PATTERN_COUNT] = {
+	[LED_PATTERN_ERROR] = { 500, STEPS({LED_RED, 500}, {LED_OFF, 500}), 1 },
+	#ifdef PICO
+	[LED_PATTERN_MC_CHANGE] = { 0, STEPS({LED_OFF, 100}, {LED_ON, 100}, {LED_OFF, 100}), 1 },
+	[LED_PATTERN_END_MC_LIST] = { 0, STEPS({LED_OFF, 100}, {LED_ON, 100}, {LED_OFF, 100}), 3 },
+	[LED_PATTERN_NEW_MC] = { 0, STEPS({LED_OFF, 50}, {LED_ON, 50}, {LED_OFF, 50}), 10 },
+	#else
+	[LED_PATTERN_MC_CHANGE] = { 0, STEPS({LED_BLUE, 100}), 1 },
+	[LED_PATTERN_END_MC_LIST] = { 0, STEPS({LED_ORANGE, 500}), 1 },
+	[LED_PATTERN_NEW_MC] = { 0, STEPS({LED_LIGHT_BLUE, 1000}), 1 },
+	#endif
+};
+
+static queue_t led_event_queue;
+static repeating_timer_t led_timer;
+static volatile int8_t sync_state = -1;	// -1 before the first status, then out_of_sync
+static volatile led_event_t last_event;		// most recent event posted, for deduplication
+static volatile bool playing = false;
+
+/* pattern currently played, only touched by the timer */
+static const led_pattern_t* pattern = NULL;
+static uint32_t repeat_left;
+static int32_t step;						// -1 while in lead time
+static uint32_t step_left;					// ms left in current step
+static uint32_t shown_rgb = ~0u;
+
 static uint smWs2813;
 static uint offsetWs2813;
 
 #ifdef RP2040ZERO
 void ws2812_put_pixel(uint32_t pixel_grb) {
-	sleep_ms(1);	// delay to ensure LED latch will hold data
+	/* only called from the LED timer, ticks are far apart enough for the LED latch to hold data */
 	pio_sm_put(pio1, smWs2813, pixel_grb << 8u);
 }
 void ws2812_put_rgb(uint8_t red, uint8_t green, uint8_t blue) {
@@ -24,102 +88,116 @@ void ws2812_put_rgb(uint8_t red, uint8_t green, uint8_t blue) {
 }
 #endif
 
-void led_init() {
-	#ifdef RP2040ZERO
-	offsetWs2813 = pio_add_program(pio1, &ws2812_program);
-	smWs2813 = pio_claim_unused_sm(pio1, true);
-	ws2812_program_init(pio1, smWs2813, offsetWs2813, 16, 800000, true);
-	#endif
-}
-
-void led_output_sync_status(bool out_of_sync) {
+/**
+ * @brief Outputs color on the LED, unless it is already shown
+ */
+static void led_show(uint32_t rgb) {
+	if(rgb == shown_rgb)
+		return;
+	shown_rgb = rgb;
 	#ifdef PICO
-	gpio_put(PICO_LED_PIN, !out_of_sync);
+	gpio_put(PICO_LED_PIN, rgb != LED_OFF);
 	#endif
 	#ifdef RP2040ZERO
-	if(out_of_sync)
-		ws2812_put_rgb(255, 200, 0);
-	else
-		ws2812_put_rgb(0, 255, 0);
+	ws2812_put_rgb(rgb >> 16, rgb >> 8, rgb);
 	#endif
 }
 
-void led_blink_error(int amount) {
-	/* ensure led is off */
+static uint32_t base_color() {
+	if(sync_state < 0)
+		return LED_OFF;
 	#ifdef PICO
-	gpio_put(PICO_LED_PIN, false);
+	return sync_state ? LED_OFF : LED_ON;
+	#else
+	return sync_state ? LED_YELLOW : LED_GREEN;
 	#endif
-	#ifdef RP2040ZERO
-	ws2812_put_rgb(0, 0, 0);
-	#endif
-	sleep_ms(500);
-	/* start blinking */
-	for(int i = 0; i < amount; ++i) {
-		#ifdef PICO
-		gpio_put(PICO_LED_PIN, true);
-		#endif
-		#ifdef RP2040ZERO
-		ws2812_put_rgb(255, 0, 0);
-		#endif
-		sleep_ms(500);
-		#ifdef PICO
-		gpio_put(PICO_LED_PIN, false);
-		#endif
-		#ifdef RP2040ZERO
-		ws2812_put_rgb(0, 0, 0);
-		#endif
-		sleep_ms(500);
+}
+
+/**
+ * @brief Advances the pattern being played, starting the next queued one when done
+ */
+static bool led_tick(repeating_timer_t *rt) {
+	(void) rt;
+	if(pattern && step_left > LED_TICK_MS) {
+		step_left -= LED_TICK_MS;
+		return true;
+	}
+	if(pattern) {
+		/* move to next step */
+		if(++step == (int32_t)pattern->step_count) {
+			step = 0;
+			if(--repeat_left == 0)
+				pattern = NULL;
+		}
+	}
+	if(!pattern) {
+		led_event_t event;
+		if(queue_try_remove(&led_event_queue, &event)) {
+			pattern = &patterns[event.pattern];
+			repeat_left = event.count ? event.count : pattern->repeat;
+			step = pattern->lead ? -1 : 0;
+		} else {
+			playing = false;
+			led_show(base_color());
+			return true;
+		}
+	}
+	if(step < 0) {
+		led_show(LED_OFF);
+		step_left = pattern->lead;
+	} else {
+		led_show(pattern->steps[step].rgb);
+		step_left = pattern->steps[step].duration;
 	}
+	return true;
 }
 
-void led_output_mc_change() {
+/**
+ * @brief Queues a pattern, dropped if the same one is already waiting or being played
+ */
+static void led_post(uint8_t pattern_id, uint8_t count) {
+	led_event_t event = { pattern_id, count };
+	if(playing && last_event.pattern == pattern_id && last_event.count == count)
+		return;
+	if(queue_try_add(&led_event_queue, &event)) {
+		last_event.pattern = pattern_id;
+		last_event.count = count;
+		playing = true;
+	}
+}
+
+void led_init() {
 	#ifdef PICO
-	gpio_put(PICO_LED_PIN, false);
-	sleep_ms(100);
-	gpio_put(PICO_LED_PIN, true);
-	sleep_ms(100);
-	gpio_put(PICO_LED_PIN, false);
-	sleep_ms(100);
+	gpio_init(PICO_LED_PIN);
+	gpio_set_dir(PICO_LED_PIN, GPIO_OUT);
 	#endif
 	#ifdef RP2040ZERO
-	ws2812_put_rgb(0, 0, 255);
-	sleep_ms(100);
-	ws2812_put_rgb(0, 0, 0);
+	offsetWs2813 = pio_add_program(pio1, &ws2812_program);
+	smWs2813 = pio_claim_unused_sm(pio1, true);
+	ws2812_program_init(pio1, smWs2813, offsetWs2813, 16, 800000, true);
 	#endif
+	queue_init(&led_event_queue, sizeof(led_event_t), LED_EVENT_QUEUE_LEN);
+	led_show(LED_OFF);
+	/* patterns are played from core0 timer, events can be posted from both cores */
+	add_repeating_timer_ms(-LED_TICK_MS, led_tick, NULL, &led_timer);
+}
+
+void led_output_sync_status(bool out_of_sync) {
+	sync_state = out_of_sync;	// shown by the timer once no pattern is playing
+}
+
+void led_blink_error(int amount) {
+	led_post(LED_PATTERN_ERROR, amount > 0 && amount < 256 ? amount : 1);
+}
+
+void led_output_mc_change() {
+	led_post(LED_PATTERN_MC_CHANGE, 0);
 }
 
 void led_output_end_mc_list() {
-	#ifdef PICO
-	for(int i = 0; i < 3; ++i) {
-		gpio_put(PICO_LED_PIN, false);
-		sleep_ms(100);
-		gpio_put(PICO_LED_PIN, true);
-		sleep_ms(100);
-		gpio_put(PICO_LED_PIN, false);
-		sleep_ms(100);
-	}
-	#endif
-	#ifdef RP2040ZERO
-	ws2812_put_rgb(255, 96, 0);	// orange
-	sleep_ms(500);
-	ws2812_put_rgb(0, 0, 0);
-	#endif
+	led_post(LED_PATTERN_END_MC_LIST, 0);
 }
 
 void led_output_new_mc() {
-	#ifdef PICO
-	for(int i = 0; i < 10; ++i) {
-		gpio_put(PICO_LED_PIN, false);
-		sleep_ms(50);
-		gpio_put(PICO_LED_PIN, true);
-		sleep_ms(50);
-		gpio_put(PICO_LED_PIN, false);
-		sleep_ms(50);
-	}
-	#endif
-	#ifdef RP2040ZERO
-	ws2812_put_rgb(52, 171, 235);	// light blue
-	sleep_ms(1000);
-	ws2812_put_rgb(0, 0, 0);
-	#endif
-}
\ No newline at end of file
+	led_post(LED_PATTERN_NEW_MC, 0);
+}
@@ -0,0 +1,374 @@
+#include "library_scan.h"
+#include <string.h>
+#include "pico/stdlib.h"
+#include "ff.h"
+#include "memory_card.h"
+#include "memcard_manager.h"
+#include "block_store.h"
+#include "image_format.h"
+#include "card_fs.h"
+#include "byte_order.h"
+
+/***
+ *	Background integrity scan of every image of the library.
+ *
+ *	Each step checks one image: the header, directory and broken sector list frames
+ *	are read with a single multi-block transfer and their XOR checksums verified a
+ *	word at a time, then the chain of every save is followed through the card_fs model
+ *	and the first block of each save is checked for its header.
+ *
+ *	Results are kept in LIBRARY_SCAN_FILE, one record per index position keyed by the
+ *	name, size and timestamp of the image, so unchanged images are not read again.
+ *	Images written by the device keep their timestamp (FatFs has no clock here), they
+ *	are invalidated explicitly and checked again at the next step.
+ *
+ *	Only meant for the sync core while the card is idle: the scratch block of the
+ *	block store holds the frames being checked.
+ */
+
+#define LS_CHECKED_FRAMES	36		// header, 15 directory frames and 20 broken sector list frames
+#define LS_FRAMES_SIZE		(LS_CHECKED_FRAMES * MC_SEC_SIZE)
+#define LS_DIRTY_SLOTS		4		// images waiting to be checked again
+#define LS_RECORD_VALID		0x5C
+
+typedef struct {
+	uint32_t name_hash;
+	uint32_t size;
+	uint16_t date;
+	uint16_t time;
+	uint8_t flags;
+	uint8_t valid;
+	uint16_t reserved;
+} scan_record_t;
+
+typedef struct {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	uint8_t flags;
+	uint32_t pass;			// pass which last found the image bad
+} bad_image_t;
+
+static card_fs_t scan_fs;
+static library_scan_stats_t stats = {0};
+static bool pass_active = false;
+static bool use_cache = true;		// cleared for passes checking every image again
+static bool full_rescan = false;
+static absolute_time_t last_pass_end;
+static bad_image_t bad_images[LS_MAX_REPORTED];
+static uint32_t bad_count = 0;
+static uint8_t dirty[LS_DIRTY_SLOTS][MAX_MC_FILENAME_LEN + 1];
+static uint32_t dirty_count = 0;
+
+static uint32_t hash_name(const uint8_t* name) {
+	uint32_t hash = 0x811C9DC5;		// FNV-1a
+	while(*name) {
+		hash ^= *name++;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+/**
+ * @brief XOR of every byte of a frame, checksum included, must be 0
+ */
+static inline bool frame_checksum_ok(const uint32_t* frame) {
+	uint32_t x = 0;
+	for(uint32_t i = 0; i < MC_SEC_SIZE / sizeof(uint32_t); i++)
+		x ^= frame[i];
+	x ^= x >> 16;
+	x ^= x >> 8;
+	return !(x & 0xFF);
+}
+
+/**
+ * @brief Checks the frames read at the start of an image and builds scan_fs from them
+ */
+static uint8_t check_directory(const uint8_t* frames) {
+	const uint32_t* words = (const uint32_t*) frames;
+	uint8_t flags = 0;
+	if(frames[0] != 'M' || frames[1] != 'C')
+		flags |= LS_BAD_HEADER;
+	for(uint32_t frame = 0; frame < LS_CHECKED_FRAMES; frame++) {
+		if(!frame_checksum_ok(&words[frame * MC_SEC_SIZE / sizeof(uint32_t)])) {
+			flags |= LS_BAD_CHECKSUM;
+			break;
+		}
+	}
+
+	card_fs_build(&scan_fs, frames);
+	for(uint8_t block = 1; block < MC_BLOCK_COUNT; block++) {
+		if(scan_fs.block_type[block] != CF_BLOCK_FREE && !scan_fs.owner[block])
+			flags |= LS_BAD_CHAIN;	// not reached from any save
+	}
+	for(uint32_t i = 0; i < CF_SAVE_BLOCKS; i++) {
+		card_fs_save_t* save = &scan_fs.saves[i];
+		if(!save->first_block)
+			continue;
+		uint8_t last = save->blocks[save->block_count - 1];
+		const uint8_t* last_frame = &frames[last * MC_SEC_SIZE];
+		uint16_t next = last_frame[CF_FRAME_NEXT] | last_frame[CF_FRAME_NEXT + 1] << 8;
+		uint32_t size = get32(&frames[save->first_block * MC_SEC_SIZE + CF_FRAME_SIZE]);
+		if(next != CF_NO_NEXT || (save->block_count > 1 && scan_fs.block_type[last] != CF_BLOCK_LAST) ||
+			size != save->block_count * MC_BLOCK_SIZE)
+			flags |= LS_BAD_CHAIN;
+	}
+	return flags;
+}
+
+static bool is_save_header(FIL* fil, FSIZE_t offset) {
+	uint8_t magic[2];
+	UINT bytes_read;
+	return FR_OK == f_lseek(fil, offset) && FR_OK == f_read(fil, magic, sizeof(magic), &bytes_read) &&
+		bytes_read == sizeof(magic) && magic[0] == 'S' && magic[1] == 'C';
+}
+
+static uint8_t check_file(uint8_t* file_name, uint8_t* frames) {
+	FIL fil;
+	UINT bytes_read;
+	FSIZE_t data_offset;
+	uint8_t flags;
+	uint32_t status = image_format_open(&fil, file_name, FA_READ, &data_offset);
+	if(status != IF_OK)
+		return status == IF_FILE_OPEN_ERR ? LS_READ_ERR : LS_BAD_SIZE;
+	if(FR_OK != f_read(&fil, frames, LS_FRAMES_SIZE, &bytes_read) || bytes_read != LS_FRAMES_SIZE) {
+		flags = LS_READ_ERR;
+	}else {
+		flags = check_directory(frames);
+		for(uint32_t i = 0; i < CF_SAVE_BLOCKS; i++) {
+			if(scan_fs.saves[i].first_block && !is_save_header(&fil, data_offset + scan_fs.saves[i].first_block * MC_BLOCK_SIZE))
+				flags |= LS_BAD_SAVE;
+		}
+	}
+	f_close(&fil);
+	return flags;
+}
+
+static uint8_t check_manifest(uint8_t* file_name, uint8_t* frames) {
+	block_manifest_t manifest;
+	uint32_t status = block_store_read_manifest(file_name, &manifest);
+	if(status != BS_OK)
+		return status == BS_FILE_OPEN_ERR ? LS_READ_ERR : LS_BAD_SIZE;
+	if(BS_OK != block_store_load(manifest.blocks[0], frames))
+		return LS_READ_ERR;		// missing or corrupted directory block
+	uint8_t flags = check_directory(frames);
+	for(uint32_t i = 0; i < CF_SAVE_BLOCKS; i++) {
+		FIL fil;
+		uint8_t block = scan_fs.saves[i].first_block;
+		if(!block)
+			continue;
+		if(BS_OK != block_store_open_block(manifest.blocks[block], &fil)) {
+			flags |= LS_READ_ERR;
+			continue;
+		}
+		if(!is_save_header(&fil, 0))
+			flags |= LS_BAD_SAVE;
+		f_close(&fil);
+	}
+	return flags;
+}
+
+/**
+ * @brief Checks one image now, returns the problems found (LS_* flags, 0 when sound)
+ */
+uint32_t library_scan_check(uint8_t* file_name) {
+	uint8_t* frames = block_store_scratch_block();
+	if(block_store_is_manifest(file_name))
+		return check_manifest(file_name, frames);
+	return check_file(file_name, frames);
+}
+
+static bool stat_image(uint8_t* file_name, scan_record_t* out_record) {
+	FILINFO fno;
+	if(FR_OK != f_stat(file_name, &fno))
+		return false;
+	memset(out_record, 0, sizeof(scan_record_t));
+	out_record->name_hash = hash_name(file_name);
+	out_record->size = fno.fsize;
+	out_record->date = fno.fdate;
+	out_record->time = fno.ftime;
+	out_record->valid = LS_RECORD_VALID;
+	return true;
+}
+
+static bool read_record(uint32_t pos, scan_record_t* out_record) {
+	FIL fil;
+	UINT bytes_read;
+	if(FR_OK != f_open(&fil, LIBRARY_SCAN_FILE, FA_READ))
+		return false;
+	bool ok = FR_OK == f_lseek(&fil, pos * sizeof(scan_record_t)) &&
+		FR_OK == f_read(&fil, out_record, sizeof(scan_record_t), &bytes_read) && bytes_read == sizeof(scan_record_t);
+	f_close(&fil);
+	return ok;
+}
+
+static void write_record(uint32_t pos, const scan_record_t* record) {
+	FIL fil;
+	UINT bytes_written;
+	if(FR_OK != f_open(&fil, LIBRARY_SCAN_FILE, FA_OPEN_ALWAYS | FA_WRITE))
+		return;		// the image is checked again next time
+	if(FR_OK == f_lseek(&fil, pos * sizeof(scan_record_t)))
+		f_write(&fil, record, sizeof(scan_record_t), &bytes_written);
+	f_close(&fil);
+}
+
+static bool same_image(const scan_record_t* a, const scan_record_t* b) {
+	return a->valid == LS_RECORD_VALID && b->valid == LS_RECORD_VALID && a->name_hash == b->name_hash &&
+		a->size == b->size && a->date == b->date && a->time == b->time;
+}
+
+/**
+ * @brief Checks the image at an index position unless its cached result is still valid
+ */
+static uint8_t scan_image(uint32_t pos, uint8_t* file_name, bool cached_ok, bool* out_cached) {
+	scan_record_t current;
+	scan_record_t cached;
+	*out_cached = false;
+	if(!stat_image(file_name, &current))
+		return LS_READ_ERR;
+	if(cached_ok && read_record(pos, &cached) && same_image(&current, &cached)) {
+		*out_cached = true;
+		return cached.flags;
+	}
+	current.flags = library_scan_check(file_name);
+	if(!(current.flags & LS_READ_ERR))		// read errors may be transient, keep checking
+		write_record(pos, &current);
+	return current.flags;
+}
+
+/**
+ * @brief Updates the list of bad images, returns true when the image is newly bad or has new problems
+ */
+static bool report(const uint8_t* file_name, uint8_t flags) {
+	uint32_t i;
+	for(i = 0; i < bad_count && strcmp(bad_images[i].name, file_name); i++);
+	if(!flags) {
+		if(i < bad_count)
+			bad_images[i] = bad_images[--bad_count];
+		return false;
+	}
+	if(i < bad_count) {
+		bool changed = bad_images[i].flags != flags;
+		bad_images[i].flags = flags;
+		bad_images[i].pass = stats.passes;
+		return changed;
+	}
+	if(bad_count < LS_MAX_REPORTED) {
+		strcpy(bad_images[bad_count].name, file_name);
+		bad_images[bad_count].flags = flags;
+		bad_images[bad_count].pass = stats.passes;
+		bad_count++;
+	}
+	return true;
+}
+
+static void end_pass() {
+	/* images not met by this pass are no longer in the library */
+	for(uint32_t i = 0; i < bad_count;) {
+		if(bad_images[i].pass != stats.passes)
+			bad_images[i] = bad_images[--bad_count];
+		else
+			i++;
+	}
+	stats.passes++;
+	pass_active = false;
+	last_pass_end = get_absolute_time();
+}
+
+/***
+ *	Checks the next image: invalidated images first, then the next one of the current
+ *	pass. A new pass starts LIBRARY_SCAN_INTERVAL after the previous one ended. The name
+ *	and problems of an image newly found bad are returned when the result is LS_STEP_BAD.
+ */
+uint32_t library_scan_step(uint8_t* out_file_name, uint8_t* out_flags) {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	uint32_t pos;
+	uint8_t flags;
+	bool cached;
+	bool newly_bad;
+
+	if(dirty_count) {
+		strcpy(name, dirty[--dirty_count]);
+		if(MM_OK != memcard_manager_find(name, &pos))
+			return LS_STEP_DONE;	// removed meanwhile
+		flags = scan_image(pos, name, false, &cached);
+		newly_bad = report(name, flags);
+	}else {
+		if(!pass_active) {
+			if(stats.passes && !full_rescan && absolute_time_diff_us(last_pass_end, get_absolute_time()) < LIBRARY_SCAN_INTERVAL * 1000ll)
+				return LS_STEP_IDLE;
+			use_cache = !full_rescan;
+			full_rescan = false;
+			stats.position = 0;
+			stats.scanned = 0;
+			stats.skipped = 0;
+			stats.bad = 0;
+			pass_active = true;
+		}
+		if(stats.position >= memcard_manager_count() || MM_OK != memcard_manager_get(stats.position, name)) {
+			end_pass();
+			return LS_STEP_IDLE;
+		}
+		pos = stats.position++;
+		flags = scan_image(pos, name, use_cache, &cached);
+		if(cached)
+			stats.skipped++;
+		else
+			stats.scanned++;
+		if(flags)
+			stats.bad++;
+		newly_bad = report(name, flags);
+	}
+	if(!newly_bad)
+		return LS_STEP_DONE;
+	strcpy(out_file_name, name);
+	*out_flags = flags;
+	return LS_STEP_BAD;
+}
+
+/**
+ * @brief Has an image written by the device checked again, its timestamp does not change
+ */
+void library_scan_invalidate(const uint8_t* file_name) {
+	for(uint32_t i = 0; i < dirty_count; i++) {
+		if(!strcmp(dirty[i], file_name))
+			return;
+	}
+	if(dirty_count < LS_DIRTY_SLOTS) {
+		strcpy(dirty[dirty_count++], file_name);
+		return;
+	}
+	full_rescan = true;		// too many images changed at once, check the whole library again
+}
+
+void library_scan_get_stats(library_scan_stats_t* out_stats) {
+	*out_stats = stats;
+}
+
+/**
+ * @brief Returns one of the bad images remembered, false past the last one
+ */
+bool library_scan_get_bad(uint32_t index, uint8_t* out_file_name, uint8_t* out_flags) {
+	if(index >= bad_count)
+		return false;
+	strcpy(out_file_name, bad_images[index].name);
+	*out_flags = bad_images[index].flags;
+	return true;
+}
+
+/**
+ * @brief Short description of the most serious problem of an image
+ */
+const char* library_scan_describe(uint8_t flags) {
+	if(flags & LS_READ_ERR)
+		return "read error";
+	if(flags & LS_BAD_SIZE)
+		return "bad size";
+	if(flags & LS_BAD_HEADER)
+		return "bad header";
+	if(flags & LS_BAD_CHECKSUM)
+		return "bad checksum";
+	if(flags & LS_BAD_CHAIN)
+		return "broken chain";
+	if(flags & LS_BAD_SAVE)
+		return "bad save";
+	return "ok";
+}
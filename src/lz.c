@@ -0,0 +1,96 @@
+#include "lz.h"
+#include <string.h>
+#include <stdbool.h>
+
+#define LZ_HASH_BITS	10
+#define LZ_NO_POS		0xFFFF
+
+static uint16_t hash_head[1 << LZ_HASH_BITS];	// last position of each 3 bytes hash
+
+static inline uint32_t hash3(const uint8_t* p) {
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static bool emit_literals(const uint8_t* src, uint32_t count, uint8_t* dst, uint32_t* pos, uint32_t dst_size) {
+	while(count) {
+		uint32_t run = count > LZ_MAX_LITERALS ? LZ_MAX_LITERALS : count;
+		if(*pos + 1 + run > dst_size)
+			return false;
+		dst[(*pos)++] = run - 1;
+		memcpy(dst + *pos, src, run);
+		*pos += run;
+		src += run;
+		count -= run;
+	}
+	return true;
+}
+
+/***
+ *	Greedy compression with a single candidate per hash, only match starts are hashed so
+ *	long runs cost one lookup every LZ_MAX_MATCH bytes.
+ *	Returns the compressed size, 0 if it does not fit in dst_size (data is not worth compressing).
+ */
+uint32_t lz_compress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t dst_size) {
+	uint32_t pos = 0;
+	uint32_t literal_start = 0;
+	uint32_t i = 0;
+	if(len > LZ_MAX_INPUT)
+		return 0;
+	memset(hash_head, 0xFF, sizeof(hash_head));
+	while(i + LZ_MIN_MATCH <= len) {
+		uint32_t h = hash3(src + i);
+		uint32_t candidate = hash_head[h];
+		uint32_t match = 0;
+		hash_head[h] = i;
+		if(candidate != LZ_NO_POS) {
+			while(match < LZ_MAX_MATCH && i + match < len && src[candidate + match] == src[i + match])
+				match++;
+		}
+		if(match < LZ_MIN_MATCH) {
+			i++;
+			continue;
+		}
+		if(!emit_literals(src + literal_start, i - literal_start, dst, &pos, dst_size) || pos + 3 > dst_size)
+			return 0;
+		uint32_t distance = i - candidate;
+		dst[pos++] = 0x80 | (match - LZ_MIN_MATCH);
+		dst[pos++] = distance & 0xFF;
+		dst[pos++] = distance >> 8;
+		i += match;
+		literal_start = i;
+	}
+	if(!emit_literals(src + literal_start, len - literal_start, dst, &pos, dst_size))
+		return 0;
+	return pos;
+}
+
+/***
+ *	Returns the decompressed size, 0 if src is malformed or does not fit in dst_size.
+ */
+uint32_t lz_decompress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t dst_size) {
+	uint32_t in = 0;
+	uint32_t out = 0;
+	while(in < len) {
+		uint8_t token = src[in++];
+		if(token < 0x80) {
+			uint32_t run = token + 1;
+			if(in + run > len || out + run > dst_size)
+				return 0;
+			memcpy(dst + out, src + in, run);
+			in += run;
+			out += run;
+		} else {
+			uint32_t match = (token & 0x7F) + LZ_MIN_MATCH;
+			if(in + 2 > len)
+				return 0;
+			uint32_t distance = src[in] | (src[in + 1] << 8);
+			in += 2;
+			if(distance == 0 || distance > out || out + match > dst_size)
+				return 0;
+			for(uint32_t i = 0; i < match; i++, out++)
+				dst[out] = dst[out - distance];		// overlapping copies repeat the pattern
+		}
+	}
+	return out;
+}
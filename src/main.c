@@ -11,13 +11,16 @@
 #include "memcard_simulator.h"
 /* LED Control */
 #include "led.h"
+/* USB Mass Storage */
+#include "msc_handler.h"
+#include "virtual_fat.h"
+#include "cdc_protocol.h"
 /* Global Configuration */
 #include "config.h"
 
 
 bool tud_mount_status = false;
 int lcd_init_main();
-void cdc_task(void);
 
 /*------------- MAIN -------------*/
 int main(void) {
@@ -29,15 +32,18 @@ int main(void) {
 	tusb_init();
 	lcd_init_main();
 
+	#ifndef USB_CONCURRENT_MODE
 	while(true) {
 		tud_task(); // tinyusb device task
-		cdc_task();
+		cdc_protocol_task();
+		msc_task();
 
 		if(to_ms_since_boot(get_absolute_time()) > TUD_MOUNT_TIMEOUT && !tud_mount_status)
 			break;
 	}
+	#endif
 	
-	/* Pico powered by PSX, initialize memory card simulation */
+	/* Pico powered by PSX, initialize memory card simulation (in concurrent mode USB is served by its sync loop) */
 	simulate_memory_card();	
 
 	return 0;
@@ -53,11 +59,17 @@ void tud_mount_cb(void) {
 	/* Initialize SD card */
 	sd_card_t *p_sd = sd_get_by_num(0);
 	if (!p_sd) return;
-	sd_init_card(p_sd);
+	if(p_sd->m_Status & STA_NOINIT)		// already initialized when mounted while the memory card is served
+		sd_init_card(p_sd);
+	#ifdef MSC_VIRTUAL_FAT
+	virtual_fat_init();		// volume generated from the images on the card
+	#endif
 }
 
 // Invoked when device is unmounted
-void tud_umount_cb(void) {}
+void tud_umount_cb(void) {
+	msc_flush();
+}
 
 // Invoked when usb bus is suspended
 // remote_wakeup_en : if host allow us  to perform remote wakeup
@@ -70,30 +82,8 @@ void tud_suspend_cb(bool remote_wakeup_en) {
 void tud_resume_cb(void) {}
 
 //--------------------------------------------------------------------+
-// USB CDC
+// USB CDC (requests are handled by cdc_protocol_task)
 //--------------------------------------------------------------------+
-void cdc_task(void) {
-	// connected() check for DTR bit
-	// Most but not all terminal client set this when making connection
-	// if ( tud_cdc_connected() )
-	{
-		// connected and there are data available
-		if ( tud_cdc_available() )
-		{
-			// read datas
-			char buf[64];
-			uint32_t count = tud_cdc_read(buf, sizeof(buf));
-			(void) count;
-
-			// Echo back
-			// Note: Skip echo by commenting out write() and write_flush()
-			// for throughput test e.g
-			//    $ dd if=/dev/zero of=/dev/ttyACM0 count=10000
-			tud_cdc_write(buf, count);
-			tud_cdc_write_flush();
-		}
-	}
-}
 
 // Invoked when cdc when line state changed e.g connected/disconnected
 void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts) {
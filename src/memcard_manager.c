@@ -2,118 +2,336 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <ctype.h>
 #include "sd_config.h"
 #include "memory_card.h"
+#include "block_store.h"
+#include "image_format.h"
 
 #define LAST_MEMCARD_FILENAME "last_memcard.txt"
+#define MC_INDEX_MAGIC	0x58494D50	// "PMIX"
+
+#ifdef MC_BLOCK_STORE
+	#define NEW_IMAGE_EXT	BS_MANIFEST_EXT
+#else
+	#define NEW_IMAGE_EXT	".MCR"
+#endif
+
+/***
+ *	Images are kept in an in-RAM index sorted in natural order (2.MCR before 10.MCR).
+ *	Each entry is the offset of the image name inside a shared name arena.
+ *
+ *	The index is saved in MC_INDEX_FILE so that it can be loaded at boot without
+ *	scanning the root directory, the directory is scanned later on while the memory
+ *	card is idle to pick up images added or removed from a PC (see memcard_manager_reconcile).
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t count;			// number of entries
+	uint32_t arena_used;	// bytes of names following the entries
+} mc_index_header_t;
+
+typedef struct {
+	uint32_t* entries;
+	uint32_t count;
+	uint32_t capacity;
+	char* arena;
+	uint32_t arena_used;
+	uint32_t arena_size;
+} mc_index_t;
+
+static mc_index_t image_index = {0};
 
 bool is_name_valid(uint8_t* filename) {
 	if(!filename)
 		return false;
+	if(strlen(filename) > MAX_MC_FILENAME_LEN)
+		return false;
 	filename = strupr(filename);	// convert to upper case
-	/* check .MCR extension */
+	/* check image container (.MCR, .GME...) or .MCM (block store manifest) extension */
 	uint8_t* ext = strrchr(filename, '.');
-	if(!ext || strcmp(ext, ".MCR"))
-		return false;
-	/* check that filename (excluding extension) is only digits */
-	uint32_t digit_char_count = strspn(filename, "0123456789");
-	if(digit_char_count != strlen(filename) - strlen(".MCR"))
+	if(!ext || (!image_format_is_image_name(filename) && strcasecmp(ext, BS_MANIFEST_EXT)))
 		return false;
+	return ext != filename;	// name must not be empty
+}
+
+static bool is_size_valid(uint8_t* filename, FSIZE_t size) {
+	if(block_store_is_manifest(filename))
+		return size == sizeof(block_manifest_t);
+	return image_format_is_size_valid(size);	// check that memory card image has correct size
+}
+
+/***
+ *	Compares names treating runs of digits as numbers.
+ */
+static int natural_compare(const char* a, const char* b) {
+	const char* orig_a = a;
+	const char* orig_b = b;
+	while(*a && *b) {
+		if(isdigit((uint8_t) *a) && isdigit((uint8_t) *b)) {
+			while(*a == '0')
+				++a;
+			while(*b == '0')
+				++b;
+			size_t len_a = strspn(a, "0123456789");
+			size_t len_b = strspn(b, "0123456789");
+			if(len_a != len_b)
+				return len_a < len_b ? -1 : 1;	// more digits, bigger number
+			int res = strncmp(a, b, len_a);
+			if(res)
+				return res;
+			a += len_a;
+			b += len_b;
+		} else {
+			if(*a != *b)
+				return (uint8_t) *a < (uint8_t) *b ? -1 : 1;
+			++a;
+			++b;
+		}
+	}
+	if(*a != *b)
+		return (uint8_t) *a - (uint8_t) *b;
+	return strcmp(orig_a, orig_b);	// same numbers written with different leading zeros
+}
+
+static const char* entry_name(mc_index_t* idx, uint32_t i) {
+	return &idx->arena[idx->entries[i]];
+}
+
+/***
+ *	Returns the position of the first entry not smaller than the given name.
+ */
+static uint32_t lower_bound(mc_index_t* idx, const char* name) {
+	uint32_t low = 0, high = idx->count;
+	while(low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		if(natural_compare(entry_name(idx, mid), name) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static bool find_entry(mc_index_t* idx, const char* name, uint32_t* out_pos) {
+	uint32_t pos = lower_bound(idx, name);
+	*out_pos = pos;
+	return pos < idx->count && !strcmp(entry_name(idx, pos), name);
+}
+
+static void free_index(mc_index_t* idx) {
+	free(idx->entries);
+	free(idx->arena);
+	memset(idx, 0, sizeof(mc_index_t));
+}
+
+static bool reserve_index(mc_index_t* idx, uint32_t count, uint32_t arena_size) {
+	if(count > idx->capacity) {
+		uint32_t capacity = idx->capacity ? idx->capacity * 2 : 64;
+		while(capacity < count)
+			capacity *= 2;
+		uint32_t* entries = realloc(idx->entries, capacity * sizeof(uint32_t));
+		if(!entries)
+			return false;
+		idx->entries = entries;
+		idx->capacity = capacity;
+	}
+	if(arena_size > idx->arena_size) {
+		uint32_t size = idx->arena_size ? idx->arena_size * 2 : 1024;
+		while(size < arena_size)
+			size *= 2;
+		char* arena = realloc(idx->arena, size);
+		if(!arena)
+			return false;
+		idx->arena = arena;
+		idx->arena_size = size;
+	}
 	return true;
 }
 
-bool is_image_valid(uint8_t* filename) {
-	if(!filename)
-		return false;
-	filename = strupr(filename);	// convert to upper case
-	if(!is_name_valid(filename))
-		return false;
-	FILINFO f_info;
-	FRESULT f_res = f_stat(filename, &f_info);
-	if(f_res != FR_OK)
-		return false;
-	if(f_info.fsize != MC_SIZE)	// check that memory card image has correct size
+/* Appends a name without keeping the index sorted, used while scanning */
+static bool append_entry(mc_index_t* idx, const char* name) {
+	uint32_t len = strlen(name) + 1;
+	if(idx->count >= MAX_MC_IMAGES || !reserve_index(idx, idx->count + 1, idx->arena_used + len))
 		return false;
+	memcpy(&idx->arena[idx->arena_used], name, len);
+	idx->entries[idx->count++] = idx->arena_used;
+	idx->arena_used += len;
 	return true;
 }
 
-bool memcard_manager_exist(uint8_t* filename) {
-	if(!filename)
+static bool insert_entry(mc_index_t* idx, const char* name) {
+	uint32_t pos;
+	if(find_entry(idx, name, &pos))
+		return true;
+	if(!append_entry(idx, name))
 		return false;
-	return is_image_valid(filename);
+	uint32_t name_ofs = idx->entries[idx->count - 1];
+	memmove(&idx->entries[pos + 1], &idx->entries[pos], (idx->count - 1 - pos) * sizeof(uint32_t));
+	idx->entries[pos] = name_ofs;
+	return true;
 }
 
-uint32_t memcard_manager_count() {
-	FRESULT res;
+static const char* sort_arena;	// arena of the index being sorted, qsort has no context parameter
+
+static int compare_entries(const void* a, const void* b) {
+	return natural_compare(&sort_arena[*(const uint32_t*) a], &sort_arena[*(const uint32_t*) b]);
+}
+
+static uint32_t scan_directory(mc_index_t* out_idx) {
 	DIR root;
 	FILINFO f_info;
-	res = f_opendir(&root, "");	// open root directory
-	uint32_t count = 0;
-	if(res == FR_OK) {
-		while(true) {
-			res = f_readdir(&root, &f_info);
-			if(res != FR_OK || f_info.fname[0] == 0) break;
-			if(!(f_info.fattrib & AM_DIR)) {	// not a directory
-				if(is_image_valid(f_info.fname))
-					++count;
+	memset(out_idx, 0, sizeof(mc_index_t));
+	if(FR_OK != f_opendir(&root, ""))	// open root directory
+		return MM_FILE_OPEN_ERR;
+	uint32_t status = MM_OK;
+	while(true) {
+		FRESULT res = f_readdir(&root, &f_info);
+		if(res != FR_OK || f_info.fname[0] == 0) break;
+		if(f_info.fattrib & AM_DIR)	// not an image
+			continue;
+		if(is_name_valid(f_info.fname) && is_size_valid(f_info.fname, f_info.fsize)) {
+			if(!append_entry(out_idx, f_info.fname)) {
+				status = MM_ALLOC_FAIL;
+				break;
 			}
 		}
 	}
-	return count;
+	f_closedir(&root);
+	sort_arena = out_idx->arena;
+	if(out_idx->count)
+		qsort(out_idx->entries, out_idx->count, sizeof(uint32_t), compare_entries);
+	return status;
 }
 
+static void save_index(mc_index_t* idx) {
+	FIL fil;
+	UINT bytes_written;
+	mc_index_header_t header = {
+		.magic = MC_INDEX_MAGIC,
+		.count = idx->count,
+		.arena_used = idx->arena_used,
+	};
+	if(FR_OK != f_open(&fil, MC_INDEX_FILE, FA_CREATE_ALWAYS | FA_WRITE))
+		return;
+	f_write(&fil, &header, sizeof(header), &bytes_written);
+	if(idx->count) {
+		f_write(&fil, idx->entries, idx->count * sizeof(uint32_t), &bytes_written);
+		f_write(&fil, idx->arena, idx->arena_used, &bytes_written);
+	}
+	f_close(&fil);
+}
+
+static bool load_index(mc_index_t* out_idx) {
+	FIL fil;
+	UINT bytes_read;
+	mc_index_header_t header;
+	memset(out_idx, 0, sizeof(mc_index_t));
+	if(FR_OK != f_open(&fil, MC_INDEX_FILE, FA_READ))
+		return false;
+	bool valid = FR_OK == f_read(&fil, &header, sizeof(header), &bytes_read) && bytes_read == sizeof(header) &&
+		header.magic == MC_INDEX_MAGIC && header.count <= MAX_MC_IMAGES &&
+		f_size(&fil) == sizeof(header) + header.count * sizeof(uint32_t) + header.arena_used;
+	if(valid && header.count)
+		valid = reserve_index(out_idx, header.count, header.arena_used) &&
+			FR_OK == f_read(&fil, out_idx->entries, header.count * sizeof(uint32_t), &bytes_read) &&
+			FR_OK == f_read(&fil, out_idx->arena, header.arena_used, &bytes_read) && bytes_read == header.arena_used;
+	f_close(&fil);
+	if(valid) {
+		out_idx->count = header.count;
+		out_idx->arena_used = header.arena_used;
+		for(uint32_t i = 0; i < out_idx->count && valid; i++)	// names must be inside the arena
+			valid = out_idx->entries[i] < header.arena_used && memchr(&out_idx->arena[out_idx->entries[i]], '\0', header.arena_used - out_idx->entries[i]);
+	}
+	if(!valid)
+		free_index(out_idx);
+	return valid;
+}
+
+static bool is_index_equal(mc_index_t* a, mc_index_t* b) {
+	if(a->count != b->count)
+		return false;
+	for(uint32_t i = 0; i < a->count; i++) {
+		if(strcmp(entry_name(a, i), entry_name(b, i)))
+			return false;
+	}
+	return true;
+}
+
+/***
+ *	Loads the image index saved on the SD card, scanning the root directory if missing.
+ *	Must be called once the filesystem is mounted.
+ */
+uint32_t memcard_manager_init() {
+	free_index(&image_index);
+	if(load_index(&image_index))
+		return MM_OK;
+	uint32_t status = scan_directory(&image_index);
+	save_index(&image_index);
+	return status;
+}
+
+/***
+ *	Scans the root directory and updates the index if it changed since it was saved
+ *	(e.g. images copied over USB). Meant to be called while the memory card is idle.
+ */
+uint32_t memcard_manager_reconcile() {
+	mc_index_t scanned;
+	uint32_t status = scan_directory(&scanned);
+	if(status != MM_OK) {
+		free_index(&scanned);
+		return status;
+	}
+	if(is_index_equal(&image_index, &scanned)) {
+		free_index(&scanned);
+		return MM_OK;
+	}
+	free_index(&image_index);
+	image_index = scanned;
+	save_index(&image_index);
+	return MM_OK;
+}
 
+bool memcard_manager_exist(uint8_t* filename) {
+	if(!filename)
+		return false;
+	uint32_t pos;
+	return is_name_valid(filename) && find_entry(&image_index, filename, &pos);
+}
 
-uint32_t memcard_manager_get(uint32_t index, uint8_t* out_filename) {
+uint32_t memcard_manager_find(uint8_t* filename, uint32_t* out_index) {
+	if(!filename || !out_index)
+		return MM_BAD_PARAM;
+	return find_entry(&image_index, filename, out_index) ? MM_OK : MM_NO_ENTRY;
+}
+
+uint32_t memcard_manager_count() {
+	return image_index.count;
+}
+
+uint32_t memcard_manager_get(uint32_t index_pos, uint8_t* out_filename) {
 	if(!out_filename)
 		return MM_BAD_PARAM;
-	if(index < 0 || index > MAX_MC_IMAGES)
-		return MM_INDEX_OUT_OF_BOUNDS;
-	uint32_t count = memcard_manager_count();
-	if(index >= count)
+	if(index_pos >= image_index.count)
 		return MM_INDEX_OUT_OF_BOUNDS;
-	uint8_t* image_names = malloc(((MAX_MC_FILENAME_LEN + 1) * count));	// allocate space for image names
-	if(!image_names)
-		return MM_ALLOC_FAIL; // malloc failed
-	/* retrive images names */
-	FRESULT res;
-	DIR root;
-	FILINFO f_info;
-	res = f_opendir(&root, "");	// open root directory
-	uint32_t i = 0;
-	if(res == FR_OK) {
-		while(true) {
-			res = f_readdir(&root, &f_info);
-			if(res != FR_OK || f_info.fname[0] == 0) break;
-			if(!(f_info.fattrib & AM_DIR)) {	// not a directory
-				if(is_image_valid(f_info.fname)) {
-					strcpy(&image_names[(MAX_MC_FILENAME_LEN + 1) * i], f_info.fname);
-					++i;
-				}
-			}
-		}
-	}
-	/* sort names alphabetically */
-	qsort(image_names, count, (MAX_MC_FILENAME_LEN + 1), (__compar_fn_t) strcmp);
-	strcpy(out_filename, &image_names[(MAX_MC_FILENAME_LEN + 1) * index]);
-	free(image_names);	// free allocated memory
+	strcpy(out_filename, entry_name(&image_index, index_pos));
 	return MM_OK;
 }
 
 static const char* read_last_memcard()
 {
-	static char last_memcard[16] = "";
+	static char last_memcard[MAX_MC_FILENAME_LEN + 2] = "";
 	FIL fil;
 	FRESULT f_res = f_open(&fil, LAST_MEMCARD_FILENAME, FA_READ);
 	if(f_res != FR_OK) {
 		return "";
 	}
 	last_memcard[0] = '\0';
-	f_gets(last_memcard,16,&fil);
+	f_gets(last_memcard, sizeof(last_memcard), &fil);
 	f_close(&fil);
 
 	int len = strlen(last_memcard);
-	if (len <= 0 || len >=16 )
+	if (len <= 0 || len >= sizeof(last_memcard))
 		return "";
 
 	if (last_memcard[len - 1] == '\n')
@@ -124,257 +342,202 @@ static const char* read_last_memcard()
 uint32_t memcard_manager_get_last(uint8_t* out_filename) {
 	if(!out_filename)
 		return MM_BAD_PARAM;
-	uint32_t count = memcard_manager_count();
-	uint8_t* image_names = malloc(((MAX_MC_FILENAME_LEN + 1) * count));	// allocate space for image names
-	if(!image_names)
-		return MM_ALLOC_FAIL; // malloc failed
-	/* retrive images names */
-	FRESULT res;
-	DIR root;
-	FILINFO f_info;
-	res = f_opendir(&root, "");	// open root directory
-	uint32_t i = 0;
-	if(res == FR_OK) {
-		while(true) {
-			res = f_readdir(&root, &f_info);
-			if(res != FR_OK || f_info.fname[0] == 0) break;
-			if(!(f_info.fattrib & AM_DIR)) {	// not a directory
-				if(is_image_valid(f_info.fname)) {
-					strcpy(&image_names[(MAX_MC_FILENAME_LEN + 1) * i], f_info.fname);
-					++i;
-				}
-			}
-		}
-	}
-	qsort(image_names, count, (MAX_MC_FILENAME_LEN + 1), (__compar_fn_t) strcmp);
-	strcpy(out_filename, &image_names[(MAX_MC_FILENAME_LEN + 1) * 0]);
-	const char* last = read_last_memcard();
-
-	if (strcmp(last, "") != 0)
-	{
-		for( int ii=0;ii<i ;ii++)
-		{
-			if (strcmp(&image_names[(MAX_MC_FILENAME_LEN + 1) * ii], last)==0)
-			{
-				strcpy(out_filename, last);
-				break;
-			}
-		}
-	}
-
-	free(image_names);	// free allocated memory
+	uint32_t status = memcard_manager_get_first(out_filename);
+	if(status != MM_OK)
+		return status;
+	uint8_t last[MAX_MC_FILENAME_LEN + 2];
+	strcpy(last, read_last_memcard());
+	if(strcmp(last, "") != 0 && memcard_manager_exist(last))
+		strcpy(out_filename, last);
 	return MM_OK;
 }
 
 uint32_t memcard_manager_get_next(uint8_t* filename, uint8_t* out_nextfile) {
 	if(!filename || !out_nextfile)
 		return MM_BAD_PARAM;
-	uint32_t count = memcard_manager_count();
-	uint32_t buff_size = (MAX_MC_FILENAME_LEN + 1) * count;
-	uint8_t* image_names = malloc(buff_size);	// allocate space for image names
-	if(!image_names)
-		return MM_ALLOC_FAIL; // malloc failed
-	/* retrive images names */
-	FRESULT res;
-	DIR root;
-	FILINFO f_info;
-	res = f_opendir(&root, "");	// open root directory
-	uint32_t i = 0;
-	if(res == FR_OK) {
-		while(true) {
-			res = f_readdir(&root, &f_info);
-			if(res != FR_OK || f_info.fname[0] == 0) break;
-			if(!(f_info.fattrib & AM_DIR)) {	// not a directory
-				if(is_image_valid(f_info.fname)) {
-					strcpy(&image_names[(MAX_MC_FILENAME_LEN + 1) * i], f_info.fname);
-					++i;
-				}
-			}
-		}
-	}
-	/* sort names alphabetically */
-	qsort(image_names, count, (MAX_MC_FILENAME_LEN + 1), (__compar_fn_t) strcmp);
-	/* find current and return following one */
-	bool found = false;
-	for(uint32_t i = 0; i < buff_size; i = i + (MAX_MC_FILENAME_LEN + 1)) {
-		if(!strcmp(filename, &image_names[i])) {
-			int32_t next_i = i + (MAX_MC_FILENAME_LEN + 1);
-			if(next_i < buff_size) {
-				strcpy(out_nextfile, &image_names[next_i]);
-				found = true;
-				break;
-			}
-		}
-	}
-	free(image_names);	// free allocated memory
-	/* return */
-	if(found)
-		return MM_OK;
-	else
+	uint32_t pos;
+	if(!find_entry(&image_index, filename, &pos) || pos + 1 >= image_index.count)
 		return MM_NO_ENTRY;
+	strcpy(out_nextfile, entry_name(&image_index, pos + 1));
+	return MM_OK;
 }
 
 uint32_t memcard_manager_get_prev(uint8_t* filename, uint8_t* out_prevfile) {
 	if(!filename || !out_prevfile)
 		return MM_BAD_PARAM;
-	uint32_t count = memcard_manager_count();
-	uint32_t buff_size = (MAX_MC_FILENAME_LEN + 1) * count;
-	uint8_t* image_names = malloc(buff_size);	// allocate space for image names
-	if(!image_names)
-		return MM_ALLOC_FAIL; // malloc failed
-	/* retrive images names */
-	FRESULT res;
-	DIR root;
-	FILINFO f_info;
-	res = f_opendir(&root, "");	// open root directory
-	uint32_t i = 0;
-	if(res == FR_OK) {
-		while(true) {
-			res = f_readdir(&root, &f_info);
-			if(res != FR_OK || f_info.fname[0] == 0) break;
-			if(!(f_info.fattrib & AM_DIR)) {	// not a directory
-				if(is_image_valid(f_info.fname)) {
-					strcpy(&image_names[(MAX_MC_FILENAME_LEN + 1) * i], f_info.fname);
-					++i;
-				}
-			}
-		}
+	uint32_t pos;
+	if(!find_entry(&image_index, filename, &pos) || pos == 0)
+		return MM_NO_ENTRY;
+	strcpy(out_prevfile, entry_name(&image_index, pos - 1));
+	return MM_OK;
+}
+
+/***
+ *	Contents of a freshly formatted memory card, built at compile time and kept in flash.
+ *	Frames are described with designated initializers, everything else is zero.
+ *	The last byte of each frame is the XOR of the other 127 bytes.
+ */
+#define FRAME_OFS(n)			((n) * MC_SEC_SIZE)
+#define FRAME_XOR_OFS(n)		(FRAME_OFS(n) + MC_SEC_SIZE - 1)
+
+/* header frame, also used as test write sector: "MC" */
+#define ID_FRAME(n)				[FRAME_OFS(n)] = 'M', [FRAME_OFS(n) + 1] = 'C', [FRAME_XOR_OFS(n)] = 'M' ^ 'C'
+/* directory frame: free block, no next block */
+#define DIR_FRAME(n)			[FRAME_OFS(n)] = 0xa0, [FRAME_OFS(n) + 8] = 0xff, [FRAME_OFS(n) + 9] = 0xff, [FRAME_XOR_OFS(n)] = 0xa0
+/* broken sector list frame: no broken sector, 0 fill, 1 fill */
+#define BROKEN_FRAME(n)			[FRAME_OFS(n) ... FRAME_OFS(n) + 3] = 0xff, [FRAME_OFS(n) + 8] = 0xff, [FRAME_OFS(n) + 9] = 0xff, [FRAME_XOR_OFS(n)] = 0x00
+
+#define FRAMES_5(F, n)			F(n), F((n) + 1), F((n) + 2), F((n) + 3), F((n) + 4)
+#define FRAMES_15(F, n)			FRAMES_5(F, n), FRAMES_5(F, (n) + 5), FRAMES_5(F, (n) + 10)
+#define FRAMES_20(F, n)			FRAMES_15(F, n), FRAMES_5(F, (n) + 15)
+
+static const uint8_t directory_block_template[MC_BLOCK_SIZE] = {
+	ID_FRAME(0),						// header frame (block 0, sec 0)
+	FRAMES_15(DIR_FRAME, 1),			// directory frames (block 0, sec 1..15)
+	FRAMES_20(BROKEN_FRAME, 16),		// broken sector list (block 0, sec 16..35)
+										// broken sector replacement data (block 0, sec 36..55) and unused frames (block 0, sec 56..62) are zero
+	ID_FRAME(MC_TEST_SEC),				// test write sector (block 0, sec 63)
+};
+
+static const uint8_t empty_block_template[MC_BLOCK_SIZE] = {0};	// remaining 15 blocks
+
+/**
+ * @brief Contents of a block of a newly formatted image
+ */
+const uint8_t* memcard_manager_get_template_block(uint8_t block) {
+	return block == 0 ? directory_block_template : empty_block_template;
+}
+
+#ifndef MC_BLOCK_STORE
+/***
+ *	Writes the image from the templates into a file preallocated contiguously,
+ *	whole blocks are written at once so that they reach the card as multi-block writes.
+ */
+static uint32_t write_image(uint8_t* name) {
+	FIL memcard_image;
+	FRESULT f_res = f_open(&memcard_image, name, FA_CREATE_NEW | FA_WRITE);
+	if(f_res != FR_OK)
+		return MM_FILE_OPEN_ERR;
+	f_res = f_expand(&memcard_image, MC_SIZE, 1);	// contiguous, image can later be accessed by raw sector
+	if(f_res == FR_DENIED)
+		f_res = FR_OK;	// no contiguous free space (fragmented card), clusters are allocated while writing
+	UINT bytes_written = MC_BLOCK_SIZE;
+	for(int i = 0; i < MC_BLOCK_COUNT && f_res == FR_OK && bytes_written == MC_BLOCK_SIZE; i++) {
+		const uint8_t* block = memcard_manager_get_template_block(i);
+		f_res = f_write(&memcard_image, block, MC_BLOCK_SIZE, &bytes_written);
 	}
-	/* sort names alphabetically */
-	qsort(image_names, count, (MAX_MC_FILENAME_LEN + 1), (__compar_fn_t) strcmp);
-	/* find current and return prior one */
-	bool found = false;
-	for(uint32_t i = 0; i < buff_size; i = i + (MAX_MC_FILENAME_LEN + 1)) {
-		if(!strcmp(filename, &image_names[i])) {
-			int32_t prev_i = i - (MAX_MC_FILENAME_LEN + 1);
-			if(prev_i >= 0) {
-				strcpy(out_prevfile, &image_names[prev_i]);
-				found = true;
-				break;
-			}
+	if(f_res != FR_OK || bytes_written != MC_BLOCK_SIZE) {
+		f_close(&memcard_image);
+		f_unlink(name);
+		return MM_FILE_WRITE_ERR;
+	}
+	if(FR_OK != f_close(&memcard_image))
+		return MM_FILE_WRITE_ERR;
+	return MM_OK;
+}
+#endif
+
+/***
+ *	Generates a name for a new image by incrementing the highest image number.
+ */
+static uint32_t generate_new_name(uint8_t* out_filename) {
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	uint32_t memcard_n = 0;
+	/* numeric names sort before the others, the last one is the highest */
+	for(int32_t i = image_index.count - 1; i >= 0; i--) {
+		const char* entry = entry_name(&image_index, i);
+		const char* ext = strrchr(entry, '.');
+		if(ext && ext != entry && strspn(entry, "0123456789") == ext - entry) {
+			memcard_n = atoi(entry);	// convert to integer
+			break;
 		}
 	}
-	free(image_names);	// free allocated memory
-	/* return */
-	if(found)
-		return MM_OK;
-	else
-		return MM_NO_ENTRY;
+	snprintf(name, MAX_MC_FILENAME_LEN + 1, "%lu%s", ++memcard_n, NEW_IMAGE_EXT);	// generate new name by incrementing by 1
+	if(memcard_manager_exist(name))	// check that generated name does not exist
+		return MM_NAME_CONFLICT;
+	strcpy(out_filename, name);
+	return MM_OK;
+}
+
+/***
+ *	Adds a newly created image to the index.
+ */
+static uint32_t add_to_index(uint8_t* filename) {
+	if(!insert_entry(&image_index, filename))
+		return MM_ALLOC_FAIL;
+	save_index(&image_index);
+	return MM_OK;
 }
 
 uint32_t memcard_manager_create(uint8_t* out_filename) {
 	if(!out_filename)
 		return MM_BAD_PARAM;
 	uint8_t name[MAX_MC_FILENAME_LEN + 1];
-	uint32_t count = memcard_manager_count();
-	uint32_t status = memcard_manager_get(count - 1, name);	// get name of last (alphabetically) memory card image
-	uint32_t memcard_n = atoi(name);	// convert to integer
-	snprintf(name, MAX_MC_FILENAME_LEN + 1, "%d.MCR", ++memcard_n);	// generate new name by incrementing by 1
-	if(memcard_manager_exist(name))	// check that generated name does not exist
-		return MM_NAME_CONFLICT;
+	uint32_t status = generate_new_name(name);
+	if(status != MM_OK)
+		return status;
 	strcpy(out_filename, name);
 	/* generate image file */
-	FIL memcard_image;
-	FRESULT f_res = f_open(&memcard_image, name, FA_CREATE_NEW | FA_WRITE);
-	if(f_res == FR_OK) {
-		UINT bytes_written = 0;
-		uint8_t buffer[MC_SEC_SIZE];
-		uint8_t xor;
-		/* header frame (block 0, sec 0) */
-		buffer[0] = 'M';
-		buffer[1] = 'C';
-		xor = buffer[0] ^ buffer[1];
-		for(int i = 2; i < MC_SEC_SIZE - 1; i++) {
-			buffer[i] = 0;
-			xor = xor ^ buffer[i];
-		}
-		buffer[MC_SEC_SIZE - 1] = xor;
-		f_res = f_write(&memcard_image, buffer, MC_SEC_SIZE, &bytes_written);
-		if(f_res != FR_OK || bytes_written != MC_SEC_SIZE) {
-			f_close(&memcard_image);
-			return MM_FILE_WRITE_ERR;
-		}
-		/* directory frames (block 0, sec 1..15) */
-		buffer[0] = 0xa0;	// free block
-		xor = buffer[0];
-		for(int i = 1; i < 8; i++) {
-			buffer[i] = 0;
-			xor = xor ^ buffer[i];
-		}
-		buffer[8] = buffer[9] = 0xff;	// no next block
-		xor = xor ^ buffer[8] ^ buffer[9];
-		for(int i = 10; i < MC_SEC_SIZE - 1; i++) {
-			buffer[i] = 0;
-			xor = xor ^ buffer[i];
-		}
-		buffer[MC_SEC_SIZE - 1] = xor;
-		for(int i = 0; i < 15; i++) {
-			f_res = f_write(&memcard_image, buffer, MC_SEC_SIZE, &bytes_written);
-			if(f_res != FR_OK || bytes_written != MC_SEC_SIZE) {
-				f_close(&memcard_image);
-				return MM_FILE_WRITE_ERR;
-			}
-		}
-		/* broken sector list (block 0, sec 16..35) */
-		buffer[0] = buffer[1] = buffer[2] = buffer[3] = 0xff;	// no broken sector
-		xor = buffer[0] ^ buffer[1] ^ buffer[2] ^ buffer[3];
-		buffer[4] = buffer[5] = buffer[6] = buffer[7] = 0x00;	// 0 fill
-		xor = xor ^ buffer[4] ^ buffer[5] ^ buffer[6] ^ buffer[7];
-		buffer[8] = buffer[9] = 0xff;	// 1 fill
-		xor = xor ^ buffer[8] ^ buffer[9];
-		for(int i = 10; i < MC_SEC_SIZE - 1; i++) {
-			buffer[i] = 0x00;
-			xor = xor ^ buffer[i];
-		}
-		buffer[MC_SEC_SIZE - 1] = xor;
-		for(int i = 0; i < 20; i++) {
-			f_res = f_write(&memcard_image, buffer, MC_SEC_SIZE, &bytes_written);
-			if(f_res != FR_OK || bytes_written != MC_SEC_SIZE) {
-				f_close(&memcard_image);
-				return MM_FILE_WRITE_ERR;
-			}
-		}
-		/* broken sector replacement data (block 0, sec 36..55) and unused frames (block 0, sec 56..62) */
-		for(int i = 0; i < MC_SEC_SIZE; i++) {
-			buffer[i] = 0x00;
-		}
-		for(int i = 0; i < 27; i++) {
-			f_res = f_write(&memcard_image, buffer, MC_SEC_SIZE, &bytes_written);
-			if(f_res != FR_OK || bytes_written != MC_SEC_SIZE) {
-				f_close(&memcard_image);
-				return MM_FILE_WRITE_ERR;
-			}
-		}
-		/* test write sector (block 0, sec 63) */
-		buffer[0] = 'M';
-		buffer[1] = 'C';
-		xor = buffer[0] ^ buffer[1];
-		for(int i = 2; i < MC_SEC_SIZE - 1; i++) {
-			buffer[i] = 0;
-			xor = xor ^ buffer[i];
-		}
-		buffer[MC_SEC_SIZE - 1] = xor;
-		f_res = f_write(&memcard_image, buffer, MC_SEC_SIZE, &bytes_written);
-		if(f_res != FR_OK || bytes_written != MC_SEC_SIZE) {
-			f_close(&memcard_image);
+#ifdef MC_BLOCK_STORE
+	status = block_store_create_image(name, directory_block_template);
+	if(status == BS_FILE_OPEN_ERR)
+		return MM_FILE_OPEN_ERR;
+	else if(status != BS_OK)
+		return MM_FILE_WRITE_ERR;
+#else
+	status = write_image(name);
+	if(status != MM_OK)
+		return status;
+#endif
+	return add_to_index(name);
+}
+
+/***
+ *	Creates a new image with the same contents as an existing one. Images kept in
+ *	the block store are cloned by writing a new manifest sharing all blocks.
+ */
+uint32_t memcard_manager_clone(uint8_t* filename, uint8_t* out_filename) {
+	if(!filename || !out_filename)
+		return MM_BAD_PARAM;
+	uint8_t name[MAX_MC_FILENAME_LEN + 1];
+	uint32_t status = generate_new_name(name);
+	if(status != MM_OK)
+		return status;
+	if(block_store_is_manifest(filename)) {
+		strcpy(strrchr(name, '.'), BS_MANIFEST_EXT);	// clone keeps the storage format of the source
+		status = block_store_clone(filename, name);
+		if(status == BS_FILE_OPEN_ERR || status == BS_BAD_MANIFEST)
+			return MM_FILE_OPEN_ERR;
+		else if(status != BS_OK)
 			return MM_FILE_WRITE_ERR;
+	} else {
+		strcpy(strrchr(name, '.'), ".MCR");	// images of foreign containers are cloned as raw ones
+		FIL src, dst;
+		FSIZE_t data_offset;
+		if(IF_OK != image_format_open(&src, filename, FA_READ, &data_offset))
+			return MM_FILE_OPEN_ERR;
+		if(FR_OK != f_open(&dst, name, FA_CREATE_NEW | FA_WRITE)) {
+			f_close(&src);
+			return MM_FILE_OPEN_ERR;
 		}
-		/* fill remaining 15 blocks with zeros */
-		for(int i = 0; i < MC_SEC_SIZE; i++) {
-			buffer[i] = 0;
+		uint8_t buffer[BLOCK_SIZE];
+		UINT bytes_read, bytes_written;
+		status = MM_OK;
+		for(uint32_t offset = 0; offset < MC_SIZE && status == MM_OK; offset += sizeof(buffer)) {
+			if(FR_OK != f_read(&src, buffer, sizeof(buffer), &bytes_read) || bytes_read != sizeof(buffer) ||
+				FR_OK != f_write(&dst, buffer, sizeof(buffer), &bytes_written) || bytes_written != sizeof(buffer))
+				status = MM_FILE_WRITE_ERR;
 		}
-		for(int i = 0; i < MC_SEC_COUNT - 64; i++) {	// 64 are the number of sectors written already (forming block 0)
-			f_res = f_write(&memcard_image, buffer, MC_SEC_SIZE, &bytes_written);
-			if(f_res != FR_OK || bytes_written != MC_SEC_SIZE) {
-				f_close(&memcard_image);
-				return MM_FILE_WRITE_ERR;
-			}
+		f_close(&src);
+		if(FR_OK != f_close(&dst) && status == MM_OK)
+			status = MM_FILE_WRITE_ERR;
+		if(status != MM_OK) {
+			f_unlink(name);
+			return status;
 		}
-		f_close(&memcard_image);
-	} else {
-		return MM_FILE_OPEN_ERR;
 	}
-	return MM_OK;
+	strcpy(out_filename, name);
+	return add_to_index(name);
 }
 
 void memcard_manager_write_last_memcard(const char* lastmemcard)
@@ -15,6 +15,19 @@
 #include "led.h"
 #include "title_id.h"
 #include "lcd.h"
+#include "save_history.h"
+#include "block_store.h"
+#include "save_transfer.h"
+#include "card_fs.h"
+#include "library_scan.h"
+#include "msc_handler.h"
+#include "cdc_protocol.h"
+#ifdef MC_FLASH_STORE
+#include "flash_store.h"
+#endif
+#ifdef USB_CONCURRENT_MODE
+#include "tusb.h"
+#endif
 
 #define MEMCARD_TOP 0x81
 #define MEMCARD_READ 0x52
@@ -35,6 +48,8 @@ uint offsetDatWriter;
 uint offsetDatReader;
 
 memory_card_t mc;
+card_fs_t mc_fs;	// saves of the image being served
+uint16_t compacted_blocks = 0;	// blocks rewritten by the last compaction, bit 0 = directory frames
 
 uint8_t mc_file_name[MAX_MC_FILENAME_LEN + 1];	// +1 for null terminator character
 uint8_t new_file_name[MAX_MC_FILENAME_LEN + 1]; // +1 for null terminator character
@@ -43,6 +58,22 @@ queue_t mc_sector_sync_queue;
 queue_t cmd_queue;
 queue_t request_key_queue;
 
+#ifdef USB_CONCURRENT_MODE
+/* memory card sector written over USB, to be copied into RAM by the simulation core */
+typedef struct {
+	sector_t sector;
+	bool stored;		// already written to the card (MSC), otherwise synced like a console write
+	uint8_t data[MC_SEC_SIZE];
+} mc_reload_t;
+
+queue_t mc_reload_queue;
+static uint32_t reload_pending[MC_SEC_COUNT / 32];	// sectors queued for reload, only used by core 0
+#endif
+
+#ifdef MC_FLASH_STORE
+static volatile uint32_t last_card_access = 0;	// time (in us) of the last memory card command, flash is written away from it
+#endif
+
 enum REQ{
 	REQ_NONE,
 	REQ_REPLACE_NEXT_MC,
@@ -50,11 +81,19 @@ enum REQ{
 	REQ_REPLACE_NEW_MC,
 	REQ_DISPLAY_NEXT_BLOCK,
 	REQ_DISPLAY_PREV_BLOCK,
+	REQ_DISPLAY_HISTORY,
+	REQ_ROLLBACK_SAVE,
+	REQ_CLONE_MC,
+	REQ_EXPORT_SAVE,
+	REQ_EXPORT_SAVE_PSV,
+	REQ_IMPORT_SAVES,
+	REQ_COMPACT_MC,
 };
 
 enum CMD{
 	CMD_DO_REPLACE_MC,
 	CMD_FINISH_REPLACE_MC,
+	CMD_COMPACT_MC,
 };
 
 enum states {
@@ -156,6 +195,9 @@ void state_machine_tick(uint8_t data) {
 					// Send flag byte and start transaction
 					write_byte_blocking(pio0, smDatWriter, mc.flag_byte);
 					next_state = MC_COMMAND;
+					#ifdef MC_FLASH_STORE
+					last_card_access = time_us_32();
+					#endif
 					break;
 				case PAD_TOP:
 					next_state = PAD_ACCESS;
@@ -208,6 +250,34 @@ void state_machine_tick(uint8_t data) {
 							req = REQ_DISPLAY_NEXT_BLOCK;
 							queue_try_add(&request_key_queue, &req);
 							break;
+						case START & SELECT & SQUARE:
+							req = REQ_DISPLAY_HISTORY;
+							queue_try_add(&request_key_queue, &req);
+							break;
+						case START & SELECT & CIRCLE:
+							req = REQ_ROLLBACK_SAVE;
+							queue_try_add(&request_key_queue, &req);
+							break;
+						case START & SELECT & X:
+							req = REQ_CLONE_MC;
+							queue_try_add(&request_key_queue, &req);
+							break;
+						case START & SELECT & R1:
+							req = REQ_EXPORT_SAVE;
+							queue_try_add(&request_key_queue, &req);
+							break;
+						case START & SELECT & L2:
+							req = REQ_EXPORT_SAVE_PSV;
+							queue_try_add(&request_key_queue, &req);
+							break;
+						case START & SELECT & L1:
+							req = REQ_IMPORT_SAVES;
+							queue_try_add(&request_key_queue, &req);
+							break;
+						case START & SELECT & R2:
+							req = REQ_COMPACT_MC;
+							queue_try_add(&request_key_queue, &req);
+							break;
 					}
 					break;
 				default:
@@ -335,6 +405,7 @@ void state_machine_tick(uint8_t data) {
 						// ACK 2
 						write_byte_blocking(pio0, smDatWriter, MC_ACK2);
 						memory_card_reset_seen_flag(&mc);
+						card_fs_sector_written(&mc_fs, sm_address);
 						if(sm_address != MC_TEST_SEC) {
 							queue_add_blocking(&mc_sector_sync_queue, &sm_address);
 						}
@@ -366,6 +437,164 @@ void state_machine_tick(uint8_t data) {
 	}
 }
 
+void handle_next_cmd() {
+	enum CMD get_cmd;
+	if (queue_try_peek(&cmd_queue, &get_cmd))
+	{
+		if (get_cmd == CMD_COMPACT_MC && next_state != MC_IDLE)
+			return;		// blocks must not move under a transaction in progress
+		if (get_cmd == CMD_DO_REPLACE_MC)
+		{
+			uint32_t status = memory_card_import(&mc, new_file_name);
+			if(status != MC_OK)
+			{
+				memory_card_import(&mc, mc_file_name);
+			}else
+			{
+				strcpy(mc_file_name, new_file_name);
+			}
+			memcard_manager_write_last_memcard(mc_file_name);
+			simulate_mc_reconnect();
+		}
+		else if (get_cmd == CMD_COMPACT_MC)
+		{
+			/* scratch block is free, the sync core waits for the command */
+			compacted_blocks = card_fs_compact(&mc_fs, mc.data, block_store_scratch_block());
+			if (compacted_blocks)
+			{
+				/* console must read the directory again */
+				mc.flag_byte = MC_FLAG_BYTE_DEF;
+				simulate_mc_reconnect();
+			}
+		}
+		queue_remove_blocking(&cmd_queue, &get_cmd);
+	}
+}
+
+#ifdef USB_CONCURRENT_MODE
+/**
+ * @brief Waits until count sectors can be queued for reload, gives up after MC_RELOAD_TIMEOUT
+ */
+bool memcard_simulator_reserve_reload(uint32_t count) {
+	absolute_time_t timeout = make_timeout_time_ms(MC_RELOAD_TIMEOUT);
+	while(queue_get_level(&mc_reload_queue) + count > MC_RELOAD_MAX_SECTORS) {
+		if(time_reached(timeout))
+			return false;
+		tight_loop_contents();
+	}
+	return true;
+}
+
+/**
+ * @brief Queues a sector written by the USB host for reload, room must have been reserved first
+ */
+void memcard_simulator_reload_sector(sector_t sector, const uint8_t* sector_data) {
+	mc_reload_t entry;
+	entry.sector = sector;
+	entry.stored = true;
+	memcpy(entry.data, sector_data, MC_SEC_SIZE);
+	reload_pending[sector / 32] |= (1u << (sector % 32));
+	queue_add_blocking(&mc_reload_queue, &entry);
+}
+
+/**
+ * @brief Writes sectors of the image being served as if the console did, through RAM and the sync queue
+ * Syncs wait for the reload queue to be empty, so the queued syncs always see the new data.
+ */
+static bool queue_write(sector_t sector, const uint8_t* data, bool sync) {
+	mc_reload_t entry;
+	entry.sector = sector;
+	entry.stored = false;
+	memcpy(entry.data, data, MC_SEC_SIZE);
+	/* core 0 is the only consumer of the sync queue, it must never block on it */
+	if(sync && !queue_try_add(&mc_sector_sync_queue, &entry.sector))
+		return false;
+	queue_add_blocking(&mc_reload_queue, &entry);
+	return true;
+}
+
+/**
+ * @brief Returns whether count more host written sectors still leave room in the sync queue for the console
+ * The simulation core blocks on the sync queue in the middle of a write transaction, where it
+ * cannot reload sectors, while core 0 waits for the reloads before syncing: a full queue would
+ * stop both cores.
+ */
+static bool has_sync_room(uint32_t count) {
+	return queue_get_level(&mc_sector_sync_queue) + count <= MC_HOST_SYNC_MAX_SECTORS;
+}
+
+bool memcard_simulator_write_sectors(sector_t first, uint32_t count, const uint8_t* data) {
+	if(!has_sync_room(count) || !memcard_simulator_reserve_reload(count))
+		return false;
+	for(uint32_t i = 0; i < count; i++) {
+		if(!queue_write(first + i, &data[i * MC_SEC_SIZE], true))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Writes a frame on behalf of an emulator, with the same side effects as a console write in state_machine_tick()
+ */
+bool memcard_simulator_write_frame(sector_t sector, const uint8_t* data) {
+	if(!has_sync_room(1) || !memcard_simulator_reserve_reload(1) || !queue_write(sector, data, sector != MC_TEST_SEC))
+		return false;
+	memory_card_reset_seen_flag(&mc);
+	return true;
+}
+
+uint8_t memcard_simulator_get_flag() {
+	return mc.flag_byte;
+}
+
+void memcard_simulator_get_id(uint8_t* out_id) {
+	memcpy(out_id, id_data, sizeof(id_data));
+}
+
+bool memcard_simulator_is_reload_pending(sector_t sector) {
+	if(queue_is_empty(&mc_reload_queue)) {
+		memset(reload_pending, 0, sizeof(reload_pending));
+		return false;
+	}
+	return reload_pending[sector / 32] & (1u << (sector % 32));
+}
+
+/**
+ * @brief Copies the next sector written over USB into RAM, only between two memory card transactions
+ * The entry leaves the queue once copied, so core 0 never sees an empty queue with a reload half done.
+ */
+static void reload_next_sector() {
+	static mc_reload_t entry;
+	if(next_state != MC_IDLE || !queue_try_peek(&mc_reload_queue, &entry))
+		return;
+	if(entry.stored)
+		memory_card_reload_sector(&mc, entry.sector, entry.data);
+	else
+		memcpy(memory_card_get_sector_ptr(&mc, entry.sector), entry.data, MC_SEC_SIZE);
+	card_fs_sector_written(&mc_fs, entry.sector);
+	queue_remove_blocking(&mc_reload_queue, &entry);
+}
+#endif
+
+#ifdef MC_FLASH_STORE
+/**
+ * @brief Runs the flash operation requested by the sync core, only outside of memory card transactions
+ */
+static void run_flash_job() {
+	if(next_state != MC_IDLE)
+		return;
+	flash_store_run_job(time_us_32() - last_card_access);
+}
+#endif
+
+static inline bool reloads_pending() {
+	#ifdef USB_CONCURRENT_MODE
+	return !queue_is_empty(&mc_reload_queue);
+	#else
+	return false;
+	#endif
+}
+
 _Noreturn void simulation_thread() {
 	printf("\n\nInitializing memory card simulation...\n");
 
@@ -394,59 +623,40 @@ _Noreturn void simulation_thread() {
 	pio_enable_sm_mask_in_sync(pio0, smMask);
 
 	printf("Simulation core begin...\n");
-	enum CMD get_cmd;
 	while(true) {
+		#if defined(USB_CONCURRENT_MODE) || defined(MC_FLASH_STORE)
+		/* USB requests and flash writes are handled while the console is not talking to the memory card */
+		while(pio_sm_is_rx_fifo_empty(pio0, smCmdReader)) {
+			#ifdef USB_CONCURRENT_MODE
+			reload_next_sector();
+			#endif
+			#ifdef MC_FLASH_STORE
+			run_flash_job();
+			#endif
+			handle_next_cmd();
+		}
+		#endif
 		uint8_t item = read_byte_blocking(pio0, smCmdReader);
 		state_machine_tick(item);
-
-		if (queue_try_peek(&cmd_queue, &get_cmd))
-		{
-			if (get_cmd == CMD_DO_REPLACE_MC)
-			{
-				uint32_t status = memory_card_import(&mc, new_file_name);
-				if(status != MC_OK)
-				{
-					memory_card_import(&mc, mc_file_name);
-				}else
-				{
-					strcpy(mc_file_name, new_file_name);
-				}
-				memcard_manager_write_last_memcard(mc_file_name);
-				simulate_mc_reconnect();
-			}
-			queue_remove_blocking(&cmd_queue, &get_cmd);
-		}
+		handle_next_cmd();
 	}
 }
 
-void display_mc_info(memory_card_t* mc, const char* file_name){
+void display_mc_info(card_fs_t* fs, const char* file_name){
 
 	uint8_t b_info[16] = {0,};
 
 	for (int i=0; i<15; i++)
 	{
-		uint8_t* current_header = memory_card_get_sector_ptr(mc, 1 + i);
-		if ( current_header[0] == 0x51)
+		uint8_t type = fs->block_type[1 + i];
+		if (type == CF_BLOCK_FIRST)
 		{
-			uint8_t countrycode_first = current_header[0x0A];
-			uint8_t countrycode_last = current_header[0x0B];
-			if (countrycode_first == 'B' && countrycode_last == 'I')
-			{
-				b_info[i] = 'J';
-			}else if (countrycode_first == 'B' && countrycode_last == 'A')
-			{
-				b_info[i] = 'U';
-			}else if (countrycode_first == 'B' && countrycode_last == 'E')
-			{
-				b_info[i] = 'E';
-			}else
-			{
-				b_info[i] = '[';
-			}
-		}else if (current_header[0] == 0x52)
+			char region = fs->saves[i].region;
+			b_info[i] = region ? region : '[';
+		}else if (type == CF_BLOCK_MIDDLE)
 		{
 			b_info[i] = '-';
-		}else if (current_header[0] == 0x53)
+		}else if (type == CF_BLOCK_LAST)
 		{
 			b_info[i] = ']';
 		}else
@@ -454,10 +664,7 @@ void display_mc_info(memory_card_t* mc, const char* file_name){
 			b_info[i] = '0';
 		}
 	}
-	int use_count = 0;
-	for (int i=0;i<15;i++)
-		if (b_info[i] != '0')
-			use_count++;
+	int use_count = fs->used_blocks;
 	int not_use_count = 15- use_count;
 
 	lcd_clear();
@@ -480,17 +687,254 @@ void display_mc_info(memory_card_t* mc, const char* file_name){
 	lcd_string((char*)b_info);
 }
 
+void display_history_info(uint32_t index, uint32_t count, save_history_info_t* info) {
+	char buf[32];
+	lcd_clear();
+	snprintf(buf, sizeof(buf), "Undo %lu/%lu #%lu", index + 1, count, info->seq);
+	lcd_string(buf);
+	lcd_set_cursor(1, 0);
+	for(int i = 0; i < MC_BLOCK_COUNT; i++)
+		buf[i] = (info->block_mask & (1 << i)) ? '*' : '.';	// blocks the save modified
+	buf[MC_BLOCK_COUNT] = '\0';
+	lcd_string(buf);
+}
+
+void display_transfer_info(const char* action, const char* detail) {
+	lcd_clear();
+	lcd_string(action);
+	lcd_set_cursor(1, 0);
+	lcd_scroll_string(1, detail);
+}
+
+void display_scan_info(const uint8_t* file_name, uint8_t flags) {
+	char detail[MAX_MC_FILENAME_LEN + 16];
+	snprintf(detail, sizeof(detail), "%s: %s", file_name, library_scan_describe(flags));
+	display_transfer_info("Bad image", detail);
+}
+
+void sync_next_sector() {
+	uint32_t status;
+	uint16_t next_entry;
+	queue_remove_blocking(&mc_sector_sync_queue, &next_entry);
+	if(memory_card_is_sector_changed(&mc, next_entry)) {
+		/* keep previous contents of the block, history failures must not prevent the sync */
+		status = save_history_record_block(mc_file_name, next_entry / MC_SEC_PER_BLOCK);
+		if(status != SH_OK)
+			printf("Unable to record save history (%lu)\n", status);
+	}
+	status = memory_card_sync_sector(&mc, next_entry, mc_file_name);
+	if(status != MC_OK)
+		led_blink_error(status);
+	library_scan_invalidate(mc_file_name);
+}
+
+/**
+ * @brief Stores every pending change of the current image, including blocks not yet committed to the block store
+ */
+uint32_t flush_mc_changes() {
+	while(reloads_pending())	// sectors written by the USB host must reach RAM before it is synced
+		tight_loop_contents();
+	while(!queue_is_empty(&mc_sector_sync_queue))
+		sync_next_sector();
+	return memory_card_commit(&mc, mc_file_name);
+}
+
+/**
+ * @brief Writes the image served, kept as a manifest, to SAVE_EXPORT_DIR as a plain .MCR image for other tools
+ */
+static uint32_t export_plain_image(char* out_file_name) {
+	char* name = out_file_name + sprintf(out_file_name, "%s/", SAVE_EXPORT_DIR);
+	strcpy(name, mc_file_name);
+	strcpy(strrchr(name, '.'), ".MCR");		// manifests always carry BS_MANIFEST_EXT
+	f_mkdir(SAVE_EXPORT_DIR);	// fails harmlessly when already existing
+	return block_store_export(mc_file_name, (uint8_t*) out_file_name);
+}
+
+/**
+ * @brief Has the simulation core load new_file_name (or reload the current image on failure), waits until done
+ */
+void replace_mc() {
+	#ifdef USB_CONCURRENT_MODE
+	msc_unshare_image();	// RAM is about to be overwritten
+	#endif
+	enum CMD cmd = CMD_DO_REPLACE_MC;
+	queue_add_blocking(&cmd_queue,&cmd);
+	while (!queue_is_empty(&cmd_queue)) // sync: wait until replace_mc
+	{
+		sleep_ms(10);
+	}
+	card_fs_build(&mc_fs, memory_card_get_sector_ptr(&mc, 0));
+	library_scan_invalidate(mc_file_name);	// may have been rewritten (rollback, import), check it soon
+	#ifdef USB_CONCURRENT_MODE
+	msc_share_image(mc_file_name, mc.data);
+	#endif
+}
+
+/**
+ * @brief Has the simulation core compact the image being served, changed sectors are then synced as one batch
+ * Returns the number of blocks rewritten through out_blocks, 0 when the image was already compact.
+ */
+uint32_t memcard_simulator_compact(uint32_t* out_blocks) {
+	*out_blocks = 0;
+	uint32_t status = flush_mc_changes();	// sync queue must have room for the whole image
+	if(status != MC_OK)
+		return status;
+	enum CMD cmd = CMD_COMPACT_MC;
+	queue_add_blocking(&cmd_queue, &cmd);
+	while(!queue_is_empty(&cmd_queue))
+		sleep_ms(10);
+	for(sector_t block = 0; block < MC_BLOCK_COUNT; block++) {
+		if(!(compacted_blocks & (1 << block)))
+			continue;
+		sector_t first = block ? block * MC_SEC_PER_BLOCK : 1;
+		sector_t last = block ? first + MC_SEC_PER_BLOCK : MC_BLOCK_COUNT;	// directory frames only
+		for(sector_t sector = first; sector < last; sector++)
+			queue_try_add(&mc_sector_sync_queue, &sector);
+		if(block)
+			++*out_blocks;
+	}
+	return MC_OK;
+}
+
+#ifdef USB_CONCURRENT_MODE
+/**
+ * @brief Copies sectors of the image being served, once every pending reload reached RAM
+ */
+bool memcard_simulator_read_sectors(sector_t first, uint32_t count, uint8_t* out_data) {
+	absolute_time_t timeout = make_timeout_time_ms(MC_RELOAD_TIMEOUT);
+	while(reloads_pending()) {
+		if(time_reached(timeout))
+			return false;
+		tight_loop_contents();
+	}
+	memcpy(out_data, memory_card_get_sector_ptr(&mc, first), count * MC_SEC_SIZE);
+	return true;
+}
+
+void memcard_simulator_get_active(uint8_t* out_file_name) {
+	strcpy(out_file_name, mc_file_name);
+}
+
+/**
+ * @brief Stores pending changes and switches to another image, as requested from the controller
+ */
+uint32_t memcard_simulator_switch(uint8_t* file_name) {
+	uint32_t status = flush_mc_changes();
+	if(status != MC_OK)
+		return status;
+	status = memory_card_check(file_name);
+	if(status != MC_OK)
+		return status;
+	strcpy(new_file_name, file_name);
+	replace_mc();
+	display_mc_info(&mc_fs, mc_file_name);
+	return strcmp(mc_file_name, new_file_name) ? MC_FILE_READ_ERR : MC_OK;	// previous image reloaded
+}
+
+void memcard_simulator_get_stats(memcard_simulator_stats_t* out_stats) {
+	out_stats->elided_writes = memory_card_get_elided_writes(&mc);
+	out_stats->pending_syncs = queue_get_level(&mc_sector_sync_queue);
+	out_stats->pending_reloads = queue_get_level(&mc_reload_queue);
+	out_stats->pending_commit = memory_card_has_pending_commit(&mc);
+}
+#endif
+
+#ifdef MC_FLASH_STORE
+/**
+ * @brief Serves the image kept in onboard flash when no SD card could be mounted
+ * Images cannot be switched, the loop only syncs the card and maintains the flash store.
+ */
+static _Noreturn void simulate_flash_memory_card() {
+	uint32_t status = memory_card_init(&mc);
+	if(status == MC_OK)
+		status = memory_card_import_flash(&mc);
+	if(status != MC_OK) {
+		while(true) {
+			led_blink_error(status);
+			sleep_ms(2000);
+		}
+	}
+	strcpy(mc_file_name, FL_NAME);
+	card_fs_build(&mc_fs, memory_card_get_sector_ptr(&mc, 0));
+	display_mc_info(&mc_fs, mc_file_name);
+
+	/* Launch memory card thread, it programs the flash while this core waits in RAM */
+	multicore_launch_core1(simulation_thread);
+	multicore_lockout_victim_init();
+
+	absolute_time_t last_sync_time = get_absolute_time();
+	while(true) {
+		if(card_fs_refresh(&mc_fs))
+			display_mc_info(&mc_fs, mc_file_name);
+		if(!queue_is_empty(&mc_sector_sync_queue)) {
+			led_output_sync_status(true);
+			sector_t sector;
+			queue_remove_blocking(&mc_sector_sync_queue, &sector);
+			status = memory_card_sync_sector(&mc, sector, mc_file_name);
+			if(status != MC_OK)
+				led_blink_error(status);
+			last_sync_time = get_absolute_time();
+		} else if(memory_card_has_pending_commit(&mc)) {
+			/* staged sectors are programmed once the card has been quiet for a while */
+			if(absolute_time_diff_us(last_sync_time, get_absolute_time()) > BLOCK_STORE_COMMIT_TIMEOUT * 1000) {
+				status = memory_card_commit(&mc, mc_file_name);
+				if(status != MC_OK) {
+					led_blink_error(status);
+					last_sync_time = get_absolute_time();	// retry later
+				}
+			}
+		} else {
+			led_output_sync_status(false);
+			if(absolute_time_diff_us(last_sync_time, get_absolute_time()) > SAVE_BURST_TIMEOUT * 1000) {
+				status = flash_store_maintain();
+				if(status != FL_OK) {
+					if(status != FL_BUSY)
+						led_blink_error(status);
+					last_sync_time = get_absolute_time();	// retry later
+				}
+			}
+		}
+
+		/* there is no other image to switch to */
+		enum REQ req;
+		if(queue_try_remove(&request_key_queue, &req))
+			led_output_end_mc_list();
+	}
+}
+#endif
+
+/**
+ * @brief Loads the first image of the index that can be loaded, it becomes the last image served
+ */
+static uint32_t import_first_image() {
+	uint32_t status = MC_FILE_OPEN_ERR;
+	for(uint32_t i = 0; status != MC_OK && i < memcard_manager_count(); i++) {
+		if(MM_OK == memcard_manager_get(i, mc_file_name))
+			status = memory_card_import(&mc, mc_file_name);
+		if(status == MC_OK)
+			memcard_manager_write_last_memcard(mc_file_name);
+	}
+	return status;
+}
+
 _Noreturn int simulate_memory_card() {
 	queue_init(&mc_sector_sync_queue, sizeof(sector_t), MC_SEC_COUNT);	// enough space to do complete MC copy
 	queue_init(&cmd_queue, sizeof(enum CMD), 1);
 	queue_init(&request_key_queue, sizeof(enum REQ), 1);
+	#ifdef USB_CONCURRENT_MODE
+	queue_init(&mc_reload_queue, sizeof(mc_reload_t), MC_RELOAD_MAX_SECTORS);
+	#endif
 
 	/* Mount and test SD card filesystem */
 	sd_card_t *p_sd = sd_get_by_num(0);
 	if(FR_OK != f_mount(&p_sd->fatfs, "", 1)) {
+		#ifdef MC_FLASH_STORE
+		simulate_flash_memory_card();
+		#endif
 		while(true)
 			led_blink_error(1);
 	}
+	sd_negotiate_speed(p_sd);
 	title_id_make_index();
 
 	uint32_t status;	
@@ -502,37 +946,84 @@ _Noreturn int simulate_memory_card() {
 		}
 	}
 
-	status = memcard_manager_get_last(mc_file_name);
+	status = memcard_manager_init();
 	if(status != MM_OK) {
 		while(true) {
 			led_blink_error(status);
 			sleep_ms(1000);
 		}
 	}
-	status = memory_card_import(&mc, mc_file_name);
+	bool index_reconciled = false;
+	status = memcard_manager_get_last(mc_file_name);
+	if(status == MM_OK)
+		status = memory_card_import(&mc, mc_file_name);
+	if(status != MC_OK) {
+		/* index saved before the last image was deleted or renamed over USB, rescan the SD card */
+		memcard_manager_reconcile();
+		index_reconciled = true;
+		status = import_first_image();
+	}
 	if(status != MC_OK) {
 		while(true) {
 			led_blink_error(status);
 			sleep_ms(2000);
 		}
 	}
-	display_mc_info(&mc, mc_file_name);
+	card_fs_build(&mc_fs, memory_card_get_sector_ptr(&mc, 0));
+	display_mc_info(&mc_fs, mc_file_name);
+	#ifdef USB_CONCURRENT_MODE
+	msc_share_image(mc_file_name, mc.data);
+	#endif
 
 	/* Launch memory card thread */
 	multicore_launch_core1(simulation_thread);
 
+	uint32_t sync_batch_size = sd_get_sync_batch_size();	// faster cards sync more sectors between requests
 	int display_memory_block_index = -1;
+	int display_history_index = -1;
 	absolute_time_t before_time= get_absolute_time();
+	absolute_time_t last_sync_time = get_absolute_time();
 	while(true) {
-		if(!queue_is_empty(&mc_sector_sync_queue)) {
+		#ifdef USB_CONCURRENT_MODE
+		tud_task();		// host requests are served between sync batches
+		msc_task();
+		cdc_protocol_task();
+		#endif
+		if(card_fs_refresh(&mc_fs) && display_memory_block_index < 0 && display_history_index < 0)
+			display_mc_info(&mc_fs, mc_file_name);	// a save was created or deleted
+		if(!queue_is_empty(&mc_sector_sync_queue) && !reloads_pending()) {
+			/* while the USB host's writes are being reloaded RAM is older than the card */
 			led_output_sync_status(true);
-			uint16_t next_entry;
-			queue_remove_blocking(&mc_sector_sync_queue, &next_entry);
-			status = memory_card_sync_sector(&mc, next_entry, mc_file_name);
-			if(status != MC_OK)
-				led_blink_error(status);
+			for(uint32_t i = 0; i < sync_batch_size && !queue_is_empty(&mc_sector_sync_queue); i++)
+				sync_next_sector();
+			last_sync_time = get_absolute_time();
+		} else if(memory_card_has_pending_commit(&mc)) {
+			/* blocks are committed as a whole once the card has been quiet for a while */
+			if(absolute_time_diff_us(last_sync_time, get_absolute_time()) > BLOCK_STORE_COMMIT_TIMEOUT * 1000) {
+				status = memory_card_commit(&mc, mc_file_name);
+				if(status != MC_OK) {
+					led_blink_error(status);
+					last_sync_time = get_absolute_time();	// retry later
+				}
+			}
 		} else {
 			led_output_sync_status(false);
+			if(absolute_time_diff_us(last_sync_time, get_absolute_time()) > SAVE_BURST_TIMEOUT * 1000)
+				save_history_end_burst();
+			card_fs_resolve_next_title(&mc_fs);	// titles shown while browsing blocks are ready
+			if(absolute_time_diff_us(last_sync_time, get_absolute_time()) > MC_INDEX_RECONCILE_DELAY * 1000) {
+				if(!index_reconciled) {
+					/* images may have been added or removed from a PC, check once per boot */
+					memcard_manager_reconcile();
+					index_reconciled = true;
+				} else {
+					/* integrity scan, one image per loop, bad ones are shown unless the user is browsing */
+					uint8_t bad_name[MAX_MC_FILENAME_LEN + 1];
+					uint8_t bad_flags;
+					if(library_scan_step(bad_name, &bad_flags) == LS_STEP_BAD && display_memory_block_index < 0 && display_history_index < 0)
+						display_scan_info(bad_name, bad_flags);
+				}
+			}
 		}
 
 		if (!queue_is_empty(&request_key_queue)) {
@@ -547,12 +1038,23 @@ _Noreturn int simulate_memory_card() {
 			}
 			before_time = current_time;
 
-			if (req == REQ_REPLACE_NEXT_MC || req == REQ_REPLACE_PREV_MC || req == REQ_REPLACE_NEW_MC)
+			if (req == REQ_REPLACE_NEXT_MC || req == REQ_REPLACE_PREV_MC || req == REQ_REPLACE_NEW_MC || req == REQ_CLONE_MC)
 			{
+				/* changes of the current image must be stored before leaving it */
+				status = flush_mc_changes();
+				if (status != MC_OK)
+				{
+					led_blink_error(status);
+					queue_remove_blocking(&request_key_queue, &req);
+					continue;
+				}
+
 				if (req == REQ_REPLACE_NEXT_MC)
 					status = memcard_manager_get_next(mc_file_name, new_file_name);
 				else if (req == REQ_REPLACE_PREV_MC)
 					status = memcard_manager_get_prev(mc_file_name, new_file_name);
+				else if (req == REQ_CLONE_MC)
+					status = memcard_manager_clone(mc_file_name, new_file_name);
 				else
 					status = memcard_manager_create(new_file_name);
 
@@ -566,23 +1068,144 @@ _Noreturn int simulate_memory_card() {
 				status = memory_card_check(new_file_name);
 				if (status != MC_OK)
 				{
+					memcard_manager_reconcile();	// index is out of date
 					led_blink_error(status);
 					queue_remove_blocking(&request_key_queue, &req);
 					continue;
 				}
 
-				if (req == REQ_REPLACE_NEW_MC)
+				if (req == REQ_REPLACE_NEW_MC || req == REQ_CLONE_MC)
 					led_output_new_mc();
 
-				enum CMD cmd = CMD_DO_REPLACE_MC;
-				queue_add_blocking(&cmd_queue,&cmd);
-				while (!queue_is_empty(&cmd_queue)) // sync: wait until replace_mc
+				replace_mc();
+				queue_remove_blocking(&request_key_queue, &req);
+				display_mc_info(&mc_fs, mc_file_name);
+				display_memory_block_index = -1;
+				display_history_index = -1;
+
+			}else if (req == REQ_DISPLAY_HISTORY)
+			{
+				save_history_info_t info;
+				uint32_t count = 0;
+				display_history_index++;
+				status = save_history_get_info(mc_file_name, display_history_index, &info, &count);
+				if (status == SH_OK)
+				{
+					display_history_info(display_history_index, count, &info);
+				}else
+				{
+					/* past the oldest save, go back to memory card overview */
+					display_history_index = -1;
+					display_mc_info(&mc_fs, mc_file_name);
+				}
+				display_memory_block_index = -1;
+				queue_remove_blocking(&request_key_queue, &req);
+
+			}else if (req == REQ_ROLLBACK_SAVE)
+			{
+				if (!queue_is_empty(&mc_sector_sync_queue) || memory_card_has_pending_commit(&mc) || reloads_pending())
+				{
+					/* latest changes are not stored yet, they would overwrite the restored data */
+					led_output_end_mc_list();
+					queue_remove_blocking(&request_key_queue, &req);
+					continue;
+				}
+
+				/* when browsing the history undo every save up to the one displayed */
+				uint32_t amount = display_history_index >= 0 ? display_history_index + 1 : 1;
+				save_history_info_t info;
+				status = save_history_rollback(mc_file_name, amount, &info);
+				if (status != SH_OK)
+				{
+					led_blink_error(status);
+					queue_remove_blocking(&request_key_queue, &req);
+					continue;
+				}
+
+				/* reload restored image */
+				strcpy(new_file_name, mc_file_name);
+				replace_mc();
+				queue_remove_blocking(&request_key_queue, &req);
+				display_mc_info(&mc_fs, mc_file_name);
+				display_memory_block_index = -1;
+				display_history_index = -1;
+
+			}else if (req == REQ_EXPORT_SAVE && display_memory_block_index < 0 && mc.block_store)
+			{
+				/* not browsing blocks: an image kept as a manifest is exported as a plain image */
+				char image_file_name[sizeof(SAVE_EXPORT_DIR) + MAX_MC_FILENAME_LEN + 1];
+				status = flush_mc_changes();
+				if (status == MC_OK)
+					status = export_plain_image(image_file_name);
+				if (status != BS_OK)
+					led_blink_error(status);
+				else
+					display_transfer_info("Exported", image_file_name + sizeof(SAVE_EXPORT_DIR));
+				display_history_index = -1;
+				queue_remove_blocking(&request_key_queue, &req);
+
+			}else if (req == REQ_EXPORT_SAVE || req == REQ_EXPORT_SAVE_PSV)
+			{
+				/* exports the save displayed while browsing blocks */
+				uint8_t format = req == REQ_EXPORT_SAVE_PSV ? ST_FORMAT_PSV : ST_FORMAT_MCS;
+				char save_file_name[ST_FILE_NAME_LEN];
+				if (display_memory_block_index < 0)
+				{
+					led_output_end_mc_list();
+					queue_remove_blocking(&request_key_queue, &req);
+					continue;
+				}
+				status = flush_mc_changes();
+				if (status == MC_OK)
+					status = save_transfer_export(mc_file_name, 1 + display_memory_block_index, format, save_file_name);
+				if (status != ST_OK)
+					led_blink_error(status);
+				else
+					display_transfer_info("Exported", save_file_name + sizeof(SAVE_EXPORT_DIR));
+				display_memory_block_index = -1;
+				queue_remove_blocking(&request_key_queue, &req);
+
+			}else if (req == REQ_IMPORT_SAVES)
+			{
+				uint32_t imported = 0;
+				status = flush_mc_changes();
+				if (status == MC_OK)
+					status = save_transfer_import_all(mc_file_name, &imported);
+				if (imported)
+				{
+					/* reload the image with the new saves */
+					strcpy(new_file_name, mc_file_name);
+					replace_mc();
+				}
+				if (status != ST_OK)
+				{
+					led_blink_error(status);
+				}else
 				{
-					sleep_ms(10);
+					char buf[17];
+					snprintf(buf, sizeof(buf), "%lu saves", imported);
+					display_transfer_info("Imported", buf);
 				}
+				display_memory_block_index = -1;
+				display_history_index = -1;
 				queue_remove_blocking(&request_key_queue, &req);
-				display_mc_info(&mc, mc_file_name);
+
+			}else if (req == REQ_COMPACT_MC)
+			{
+				uint32_t blocks;
+				status = memcard_simulator_compact(&blocks);
+				if (status != MC_OK)
+				{
+					led_blink_error(status);
+				}else
+				{
+					char buf[17];
+					snprintf(buf, sizeof(buf), "%lu blocks moved", blocks);
+					display_transfer_info("Compacted", buf);
+				}
 				display_memory_block_index = -1;
+				display_history_index = -1;
+				queue_remove_blocking(&request_key_queue, &req);
 
 			}else if (req == REQ_DISPLAY_NEXT_BLOCK || req == REQ_DISPLAY_PREV_BLOCK)
 			{
@@ -610,37 +1233,26 @@ _Noreturn int simulate_memory_card() {
 				}
 				str_display_memory_block_index[2] = '\0';
 
+				if (display_history_index >= 0)
+				{
+					/* leaving history browsing, restore memory card overview */
+					display_history_index = -1;
+					display_mc_info(&mc_fs, mc_file_name);
+				}
 				lcd_set_cursor(0, 14);
 				lcd_string(str_display_memory_block_index);
-				uint8_t* current_header = memory_card_get_sector_ptr(&mc, 1 + display_memory_block_index);
-				if (current_header)
+				lcd_set_cursor(1, 0);
+				uint8_t type = mc_fs.block_type[1 + display_memory_block_index];
+				if (type == CF_BLOCK_FIRST)
 				{
-					lcd_set_cursor(1, 0);
-
-					if (current_header[0] == 0x51)
-					{
-						char title_id[16] = "";
-						char title_name_16[20] = "";
-						strncpy(title_id, &(current_header[0x0C]), 10);
-						title_id[10] = '\0';
-						const char* title_name = title_id_find_name(title_id);
-
-						if (title_name)
-						{
-							strncpy(title_name_16, title_name, 16);
-							title_name_16[17] = '\0';
-							lcd_string(title_name_16);
-						}else
-						{
-							lcd_string(title_id);
-						}
-					}else if(current_header[0] == 0x52){
-						lcd_string("--->            ");
-					}else if(current_header[0] == 0x53){
-						lcd_string("----]           ");
-					}else{
-						lcd_string("                ");
-					}
+					/* names longer than the display scroll */
+					lcd_scroll_string(1, card_fs_get_title(&mc_fs.saves[display_memory_block_index]));
+				}else if(type == CF_BLOCK_MIDDLE){
+					lcd_string("--->            ");
+				}else if(type == CF_BLOCK_LAST){
+					lcd_string("----]           ");
+				}else{
+					lcd_string("                ");
 				}
 				queue_remove_blocking(&request_key_queue, &req);
 
@@ -1,16 +1,103 @@
 #include "memory_card.h"
 #include <stdlib.h>
+#include <string.h>
 #include "config.h"
+#include "checksum.h"
+#include "block_store.h"
+#include "image_format.h"
+#ifdef MC_FLASH_STORE
+#include "flash_store.h"
+#endif
 #include "ff.h"
 #include "pico/stdlib.h"
 
+#define FINGERPRINT_WORDS	(MC_SEC_COUNT / 32)	// size of sector fingerprint validity bitmap
+
+static uint32_t sector_fingerprint(const uint8_t* sector_data) {
+	return crc32(sector_data, MC_SEC_SIZE);
+}
+
+static void fingerprint_all_sectors(memory_card_t* mc) {
+	for(sector_t i = 0; i < MC_SEC_COUNT; i++)
+		mc->sec_fingerprint[i] = sector_fingerprint(&mc->data[i * MC_SEC_SIZE]);
+	memset(mc->sec_fingerprint_valid, 0xFF, FINGERPRINT_WORDS * sizeof(uint32_t));
+}
+
+static void invalidate_all_fingerprints(memory_card_t* mc) {
+	memset(mc->sec_fingerprint_valid, 0x00, FINGERPRINT_WORDS * sizeof(uint32_t));
+}
+
+static bool is_fingerprint_valid(memory_card_t* mc, sector_t sector) {
+	return mc->sec_fingerprint_valid[sector / 32] & (1u << (sector % 32));
+}
+
+static void fingerprint_sector(memory_card_t* mc, sector_t sector, const uint8_t* sector_data) {
+	mc->sec_fingerprint[sector] = sector_fingerprint(sector_data);
+	mc->sec_fingerprint_valid[sector / 32] |= (1u << (sector % 32));
+}
+
+/***
+ *	Returns whether the in-RAM copy of a block is exactly what was last stored.
+ */
+static bool is_block_unchanged(memory_card_t* mc, uint8_t block) {
+	for(sector_t i = block * MC_SEC_PER_BLOCK; i < (block + 1) * MC_SEC_PER_BLOCK; i++) {
+		if(memory_card_is_sector_changed(mc, i))
+			return false;
+	}
+	return true;
+}
+
+/***
+ *	Loads the blocks listed in a manifest. Blocks already in RAM with the same
+ *	hash (e.g. empty blocks when switching between images) are not read again.
+ */
+static uint32_t import_manifest(memory_card_t* mc, uint8_t* file_name) {
+	block_manifest_t manifest;
+	uint32_t status = block_store_read_manifest(file_name, &manifest);
+	if(status == BS_FILE_OPEN_ERR)
+		return MC_FILE_OPEN_ERR;
+	else if(status != BS_OK)
+		return MC_FILE_READ_ERR;
+
+	bool cached = mc->block_store && !mc->dirty_blocks;
+	for(uint8_t i = 0; i < MC_BLOCK_COUNT; i++) {
+		uint8_t* block_data = &mc->data[i * MC_BLOCK_SIZE];
+		if(cached && mc->block_hash[i] == manifest.blocks[i] && is_block_unchanged(mc, i))
+			continue;
+		/* same block appearing earlier in this image */
+		int8_t copy_from = -1;
+		for(uint8_t j = 0; j < i && copy_from < 0; j++) {
+			if(manifest.blocks[j] == manifest.blocks[i])
+				copy_from = j;
+		}
+		if(copy_from >= 0) {
+			memcpy(block_data, &mc->data[copy_from * MC_BLOCK_SIZE], MC_BLOCK_SIZE);
+		} else if(BS_OK != block_store_load(manifest.blocks[i], block_data)) {
+			return MC_FILE_READ_ERR;
+		}
+		for(sector_t s = i * MC_SEC_PER_BLOCK; s < (i + 1) * MC_SEC_PER_BLOCK; s++)
+			fingerprint_sector(mc, s, &mc->data[s * MC_SEC_SIZE]);
+	}
+	memcpy(mc->block_hash, manifest.blocks, sizeof(mc->block_hash));
+	return MC_OK;
+}
+
 uint32_t memory_card_init(memory_card_t* mc) {
 	if(!mc)
 		return MC_NO_INIT;
 	mc->flag_byte = MC_FLAG_BYTE_DEF;
+	mc->elided_writes = 0;
+	mc->block_store = false;
+	mc->flash_store = false;
+	mc->read_only = false;
+	mc->data_offset = 0;
+	mc->dirty_blocks = 0;
 	mc->data = (uint8_t*) malloc(sizeof(uint8_t) * MC_SIZE);
-	if(!mc->data)
+	mc->sec_fingerprint = (uint32_t*) malloc(sizeof(uint32_t) * MC_SEC_COUNT);
+	mc->sec_fingerprint_valid = (uint32_t*) malloc(sizeof(uint32_t) * FINGERPRINT_WORDS);
+	if(!mc->data || !mc->sec_fingerprint || !mc->sec_fingerprint_valid)
 		return MC_NO_INIT;	// malloc failed
+	invalidate_all_fingerprints(mc);
 	return MC_OK;
 }
 
@@ -18,26 +105,45 @@ uint32_t memory_card_check(uint8_t* file_name) {
 
 	uint32_t status = MC_OK;
 	FIL memcard;
-	if (FR_OK == f_open(&memcard, file_name, FA_READ))
-	{
-		if (f_size(&memcard) != MC_SIZE)
-		{
-			status = MC_FILE_SIZE_ERR;
-		}
-	}else{
-		return MC_FILE_OPEN_ERR;
+	FSIZE_t data_offset;
+	if(block_store_is_manifest(file_name)) {
+		block_manifest_t manifest;
+		status = block_store_read_manifest(file_name, &manifest);
+		if(status == BS_FILE_OPEN_ERR)
+			return MC_FILE_OPEN_ERR;
+		return status == BS_OK ? MC_OK : MC_FILE_SIZE_ERR;
 	}
+	status = image_format_open(&memcard, file_name, FA_READ, &data_offset);
+	if(status == IF_FILE_OPEN_ERR)
+		return MC_FILE_OPEN_ERR;
+	else if(status != IF_OK)
+		return MC_FILE_SIZE_ERR;	// not MC_SIZE bytes of card data, or unknown header
 	f_close(&memcard);
-	return status;
+	return MC_OK;
 }
 uint32_t memory_card_import(memory_card_t* mc, uint8_t* file_name) {
 	uint32_t status = MC_OK;
 	FIL memcard;
 
-	if(mc) {
+	if(mc && block_store_is_manifest(file_name)) {
 		mc->flag_byte = MC_FLAG_BYTE_DEF;
-		if(FR_OK == f_open(&memcard, file_name, FA_READ)) {
+		status = import_manifest(mc, file_name);
+		if(status != MC_OK)
+			invalidate_all_fingerprints(mc);
+		mc->block_store = status == MC_OK;
+		mc->read_only = false;
+		mc->data_offset = 0;
+		mc->dirty_blocks = 0;
+	} else if(mc) {
+		mc->flag_byte = MC_FLAG_BYTE_DEF;
+		mc->block_store = false;
+		mc->dirty_blocks = 0;
+		FSIZE_t data_offset;
+		uint32_t open_status = image_format_open(&memcard, file_name, FA_READ, &data_offset);
+		if(open_status == IF_OK) {
 			UINT bytes_read;
+			mc->data_offset = data_offset;	// file is positioned on the card data
+			mc->read_only = !image_format_is_writable(data_offset);
 			if(FR_OK == f_read(&memcard, mc->data, MC_SIZE, &bytes_read)) {
 				if(MC_SIZE != bytes_read) {
 					status = MC_FILE_READ_ERR;
@@ -46,8 +152,13 @@ uint32_t memory_card_import(memory_card_t* mc, uint8_t* file_name) {
 				status = MC_FILE_SIZE_ERR;
 			}
 			f_close(&memcard);
+			/* RAM copy now mirrors storage, unless the read failed half way */
+			if(status == MC_OK)
+				fingerprint_all_sectors(mc);
+			else
+				invalidate_all_fingerprints(mc);
 		} else {
-			status = MC_FILE_OPEN_ERR;
+			status = open_status == IF_FILE_OPEN_ERR ? MC_FILE_OPEN_ERR : MC_FILE_SIZE_ERR;
 		}
 	} else {
 		status = MC_NO_INIT;
@@ -56,6 +167,29 @@ uint32_t memory_card_import(memory_card_t* mc, uint8_t* file_name) {
 	return status;
 }
 
+#ifdef MC_FLASH_STORE
+/***
+ *	Loads the image kept in onboard flash, served when there is no SD card.
+ */
+uint32_t memory_card_import_flash(memory_card_t* mc) {
+	if(!mc)
+		return MC_NO_INIT;
+	mc->flag_byte = MC_FLAG_BYTE_DEF;
+	mc->block_store = false;
+	mc->read_only = false;
+	mc->data_offset = 0;
+	mc->dirty_blocks = 0;
+	if(FL_OK != flash_store_init()) {
+		invalidate_all_fingerprints(mc);
+		return MC_FILE_READ_ERR;
+	}
+	flash_store_load(mc->data);
+	fingerprint_all_sectors(mc);
+	mc->flash_store = true;
+	return MC_OK;
+}
+#endif
+
 bool memory_card_is_sector_valid(memory_card_t* mc, sector_t sector) {
 	(void) mc;
 	if(sector < 0 || sector >= MC_SEC_COUNT)
@@ -74,6 +208,15 @@ void memory_card_reset_seen_flag(memory_card_t* mc) {
 		mc->flag_byte &= ~(1 << 3);
 }
 
+/***
+ *	Returns whether the in-RAM copy of a sector differs from what was last stored.
+ */
+bool memory_card_is_sector_changed(memory_card_t* mc, sector_t sector) {
+	if(!is_fingerprint_valid(mc, sector))
+		return true;
+	return mc->sec_fingerprint[sector] != sector_fingerprint(&mc->data[sector * MC_SEC_SIZE]);
+}
+
 /***
  *	Sync memory card modified sectors back into flash storage.
  *	Does not create concurrency problem as it only reads from the in-RAM copy.
@@ -81,15 +224,45 @@ void memory_card_reset_seen_flag(memory_card_t* mc) {
  * 	then there is a transient loss of consistency. Consistency is eventually
  * 	resolved since there will be another entry further down the queue
  * 	enforcing the sync for that same sector to occurr once again.
+ *
+ *	The sector is snapshotted before being written so that its fingerprint
+ *	always describes exactly what reached storage. Syncs of sectors whose
+ *	content matches the last durable fingerprint are elided altogether.
  */
 uint32_t memory_card_sync_sector(memory_card_t* mc, sector_t sector, uint8_t* file_name) {
 	uint32_t status = MC_OK;
 	FIL memcard;
+	uint8_t snapshot[MC_SEC_SIZE];
+
+	memcpy(snapshot, &mc->data[sector * MC_SEC_SIZE], MC_SEC_SIZE);
+	uint32_t fingerprint = sector_fingerprint(snapshot);
+	if(is_fingerprint_valid(mc, sector) && mc->sec_fingerprint[sector] == fingerprint) {
+		++mc->elided_writes;
+		return MC_OK;
+	}
+	if(mc->block_store) {
+		mc->dirty_blocks |= (1 << (sector / MC_SEC_PER_BLOCK));
+		return MC_OK;
+	}
+	#ifdef MC_FLASH_STORE
+	if(mc->flash_store) {
+		/* staged in RAM, programmed by memory_card_commit or once the batch is full */
+		if(FL_OK != flash_store_write(sector, snapshot))
+			return MC_FILE_WRITE_ERR;
+		fingerprint_sector(mc, sector, snapshot);
+		return MC_OK;
+	}
+	#endif
+	if(mc->read_only) {
+		/* nothing to store, the sector is not synced again until it changes */
+		fingerprint_sector(mc, sector, snapshot);
+		return MC_OK;
+	}
 
 	if(FR_OK == f_open(&memcard, file_name, FA_READ | FA_WRITE)) {
 		UINT bytes_written;
-		f_lseek(&memcard, (sector * MC_SEC_SIZE));
-		if(FR_OK == f_write(&memcard, &mc->data[sector * MC_SEC_SIZE], MC_SEC_SIZE, &bytes_written)) {
+		f_lseek(&memcard, mc->data_offset + sector * MC_SEC_SIZE);
+		if(FR_OK == f_write(&memcard, snapshot, MC_SEC_SIZE, &bytes_written)) {
 			if(MC_SEC_SIZE != bytes_written) {
 				status = MC_FILE_SIZE_ERR;
 			}
@@ -97,10 +270,78 @@ uint32_t memory_card_sync_sector(memory_card_t* mc, sector_t sector, uint8_t* fi
 			status = MC_FILE_WRITE_ERR;
 		}
 
-		f_close(&memcard);
+		if(FR_OK != f_close(&memcard) && status == MC_OK)
+			status = MC_FILE_WRITE_ERR;
+		if(status == MC_OK)
+			fingerprint_sector(mc, sector, snapshot);
 	} else {
 		status = MC_FILE_OPEN_ERR;
 	}
 
 	return status;
 }
+
+/***
+ *	Stores the dirty blocks of an image kept in the block store and updates its manifest.
+ *	Blocks are committed one at a time: the new block is stored first, then the manifest
+ *	is updated and only then the reference to the old block is dropped.
+ *
+ *	Each block is snapshotted before being stored, sectors modified by the simulation
+ *	while committing are synced again and mark the block dirty once more.
+ */
+uint32_t memory_card_commit(memory_card_t* mc, uint8_t* file_name) {
+	if(!mc)
+		return MC_NO_INIT;
+	#ifdef MC_FLASH_STORE
+	if(mc->flash_store)
+		return FL_OK == flash_store_flush() ? MC_OK : MC_FILE_WRITE_ERR;
+	#endif
+	if(!mc->block_store || !mc->dirty_blocks)
+		return MC_OK;
+	block_manifest_t manifest;
+	if(BS_OK != block_store_read_manifest(file_name, &manifest))
+		return MC_FILE_READ_ERR;
+
+	uint8_t* snapshot = block_store_scratch_block();
+	for(uint8_t i = 0; i < MC_BLOCK_COUNT; i++) {
+		if(!(mc->dirty_blocks & (1 << i)))
+			continue;
+		memcpy(snapshot, &mc->data[i * MC_BLOCK_SIZE], MC_BLOCK_SIZE);
+		block_hash_t old_hash = manifest.blocks[i];
+		if(BS_OK != block_store_put(snapshot, 1, &manifest.blocks[i]))
+			return MC_FILE_WRITE_ERR;
+		if(manifest.blocks[i] != old_hash && BS_OK != block_store_write_manifest(file_name, &manifest)) {
+			block_store_ref(manifest.blocks[i], -1);
+			return MC_FILE_WRITE_ERR;
+		}
+		block_store_ref(old_hash, -1);	// on failure the old block is only leaked
+		mc->block_hash[i] = manifest.blocks[i];
+		mc->dirty_blocks &= ~(1 << i);
+		for(sector_t s = 0; s < MC_SEC_PER_BLOCK; s++)
+			fingerprint_sector(mc, i * MC_SEC_PER_BLOCK + s, &snapshot[s * MC_SEC_SIZE]);
+	}
+	return MC_OK;
+}
+
+/***
+ *	Replaces the in-RAM copy of a sector with data already written to storage by someone else (e.g. USB host).
+ *	Must be called by the core serving the memory card, the sector is not synced again.
+ */
+void memory_card_reload_sector(memory_card_t* mc, sector_t sector, const uint8_t* sector_data) {
+	memcpy(&mc->data[sector * MC_SEC_SIZE], sector_data, MC_SEC_SIZE);
+	fingerprint_sector(mc, sector, sector_data);
+}
+
+bool memory_card_has_pending_commit(memory_card_t* mc) {
+	#ifdef MC_FLASH_STORE
+	if(mc && mc->flash_store)
+		return flash_store_has_pending();
+	#endif
+	return mc && mc->block_store && mc->dirty_blocks;
+}
+
+uint32_t memory_card_get_elided_writes(memory_card_t* mc) {
+	if(!mc)
+		return 0;
+	return mc->elided_writes;
+}
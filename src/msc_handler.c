@@ -2,11 +2,25 @@
 #include "tusb.h"
 #include "config.h"
 #include "sd_config.h"
+#include "disk_cache.h"
+#include "msc_handler.h"
+#include "virtual_fat.h"
+#include "memcard_simulator.h"
+#include "memory_card.h"
+#include "block_store.h"
+#include "image_format.h"
+#include "pico/time.h"
+
+#if defined(USB_CONCURRENT_MODE) && defined(MSC_VIRTUAL_FAT)
+#error "USB_CONCURRENT_MODE exposes the raw SD card, it cannot be combined with MSC_VIRTUAL_FAT"
+#endif
 
 #define VID "PicoMC"
 #define PID "Mass Storage"
 #define REV "1.0"
 
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10	0x35
+
 
 /* invoked when received SCSI_CMD_INQUIRY */
 void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
@@ -29,7 +43,11 @@ bool tud_msc_test_unit_ready_cb(uint8_t lun)
 	sd_card_t* p_sd = sd_get_by_num(lun);
 	if (!p_sd) return false;
 
+	#ifdef MSC_VIRTUAL_FAT
+	if(p_sd->m_Status != 0 || !virtual_fat_is_ready()) {
+	#else
 	if(p_sd->m_Status != 0) {
+	#endif
 		// Additional Sense 3A-00 is NOT_FOUND
 		tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00);
 		return false;
@@ -44,7 +62,11 @@ void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_siz
 	sd_card_t* p_sd = sd_get_by_num(lun);
 	if (!p_sd) return;
 
+	#ifdef MSC_VIRTUAL_FAT
+	*block_count = virtual_fat_sector_count();
+	#else
 	*block_count = (uint32_t) p_sd->sectors;
+	#endif
 	*block_size  = (uint16_t) BLOCK_SIZE;
 }
 
@@ -62,25 +84,409 @@ bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, boo
 		if(start) {
 			return true;
 		}
+		/* disk ejected, nothing may stay in the write-back cache */
+		return msc_flush();
+	}
+
+	return true;
+}
+
+/*
+	Sequential read-ahead: sectors following a read are fetched with the same multi-block
+	command and kept in a ring, sector lba is stored in slot lba % MSC_READ_AHEAD_BLOCKS.
+	The ring always holds the sectors [ra_lba, ra_lba + ra_count).
+*/
+static uint8_t ra_ring[MSC_READ_AHEAD_BLOCKS][BLOCK_SIZE];
+static uint32_t ra_lba = 0;
+static uint32_t ra_count = 0;
+static uint32_t next_read_lba = UINT32_MAX;		// sector following the last read, to detect sequential reads
+static uint8_t partial_block[BLOCK_SIZE];		// for transfers not aligned on sectors
+
+static inline bool ra_contains(uint32_t lba) {
+	return lba >= ra_lba && lba - ra_lba < ra_count;
+}
+
+static void ra_invalidate(uint32_t lba, uint32_t count) {
+	if(ra_count && lba < ra_lba + ra_count && lba + count > ra_lba)
+		ra_count = 0;
+}
+
+#ifndef USB_CONCURRENT_MODE
+/**
+ * @brief Refills the ring with the sectors starting at lba, using at most two multi-block reads (ring wrap)
+ */
+static bool ra_fill(sd_card_t* p_sd, uint32_t lba) {
+	uint32_t count = MSC_READ_AHEAD_BLOCKS;
+	if(lba + count > p_sd->sectors)
+		count = p_sd->sectors - lba;
+	ra_count = 0;
+	for(uint32_t done = 0; done < count;) {
+		uint32_t slot = (lba + done) % MSC_READ_AHEAD_BLOCKS;
+		uint32_t run = MSC_READ_AHEAD_BLOCKS - slot;
+		if(run > count - done)
+			run = count - done;
+		if(sd_read_blocks(p_sd, ra_ring[slot], lba + done, run) != SD_BLOCK_DEVICE_ERROR_NONE)
+			return false;
+		done += run;
+	}
+	ra_lba = lba;
+	ra_count = count;
+	return true;
+}
+#endif
+
+/**
+ * @brief Reads count whole sectors, from the read-ahead ring when possible
+ */
+static bool msc_read_blocks(sd_card_t* p_sd, uint8_t* buffer, uint32_t lba, uint32_t count) {
+	#ifdef USB_CONCURRENT_MODE
+	/* the device writes the card through FatFs meanwhile, sectors kept in the ring would go stale */
+	return sd_read_blocks(p_sd, buffer, lba, count) == SD_BLOCK_DEVICE_ERROR_NONE;
+	#else
+	bool sequential = (lba == next_read_lba) || ra_contains(lba);
+	next_read_lba = lba + count;
+
+	/* sectors already in the ring */
+	while(count && ra_contains(lba)) {
+		memcpy(buffer, ra_ring[lba % MSC_READ_AHEAD_BLOCKS], BLOCK_SIZE);
+		buffer += BLOCK_SIZE;
+		lba++;
+		count--;
+	}
+	if(!count)
+		return true;
+	if(!sequential || count > MSC_READ_AHEAD_BLOCKS) {
+		/* random access (or larger than the ring): straight to the USB buffer */
+		return sd_read_blocks(p_sd, buffer, lba, count) == SD_BLOCK_DEVICE_ERROR_NONE;
+	}
+	if(!ra_fill(p_sd, lba))
+		return false;
+	for(; count; count--, lba++, buffer += BLOCK_SIZE)
+		memcpy(buffer, ra_ring[lba % MSC_READ_AHEAD_BLOCKS], BLOCK_SIZE);
+	return true;
+	#endif
+}
+
+static bool msc_write_blocks(sd_card_t* p_sd, const uint8_t* buffer, uint32_t lba, uint32_t count) {
+	int status = sd_write_blocks(p_sd, buffer, lba, count);
+	ra_invalidate(lba, count);
+	disk_cache_invalidate_range(lba, count);		// written bypassing FatFs
+	return status == SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+/*
+	Write-back cache: short writes (FAT and directory sectors, rewritten by the host after every
+	file) are kept in RAM and merged until MSC_WRITE_SYNC_TIMEOUT expires, the host sends
+	SYNCHRONIZE CACHE or ejects the disk, or the cache is full. Lines 0..wc_count-1 are in use.
+	Not used in concurrent mode, where the device shares the card with the host.
+*/
+static uint8_t wc_data[MSC_WRITE_CACHE_BLOCKS][BLOCK_SIZE];
+static uint32_t wc_lba[MSC_WRITE_CACHE_BLOCKS];
+static uint32_t wc_count = 0;
+static absolute_time_t last_write_time;
+
+static int32_t wc_find(uint32_t lba) {
+	for(uint32_t i = 0; i < wc_count; i++)
+		if(wc_lba[i] == lba)
+			return i;
+	return -1;
+}
+
+/**
+ * @brief Writes every cached sector to the card, consecutive sectors in consecutive lines with a single command
+ */
+static bool wc_flush(sd_card_t* p_sd) {
+	uint8_t order[MSC_WRITE_CACHE_BLOCKS];
+	bool ok = true;
+
+	/* sort lines by sector so runs can be detected */
+	for(uint32_t i = 0; i < wc_count; i++) {
+		uint32_t j = i;
+		for(; j > 0 && wc_lba[order[j - 1]] > wc_lba[i]; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+	for(uint32_t i = 0; i < wc_count;) {
+		uint32_t run = 1;
+		while(i + run < wc_count && order[i + run] == order[i] + run && wc_lba[order[i + run]] == wc_lba[order[i]] + run)
+			run++;
+		ok &= msc_write_blocks(p_sd, wc_data[order[i]], wc_lba[order[i]], run);
+		i += run;
+	}
+	if(ok)
+		wc_count = 0;
+	return ok;
+}
+
+/**
+ * @brief Stores count sectors in the cache, flushing it first if there is no room left
+ */
+static bool wc_write(sd_card_t* p_sd, const uint8_t* buffer, uint32_t lba, uint32_t count) {
+	for(uint32_t i = 0; i < count; i++) {
+		int32_t line = wc_find(lba + i);
+		if(line < 0) {
+			if(wc_count == MSC_WRITE_CACHE_BLOCKS && !wc_flush(p_sd))
+				return false;
+			line = wc_count++;
+			wc_lba[line] = lba + i;
+		}
+		memcpy(wc_data[line], buffer + i * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	return true;
+}
+
+/**
+ * @brief Drops cached sectors overwritten by a write going straight to the card
+ */
+static void wc_discard(uint32_t lba, uint32_t count) {
+	for(uint32_t i = 0; i < wc_count;) {
+		if(wc_lba[i] >= lba && wc_lba[i] - lba < count) {
+			wc_count--;
+			wc_lba[i] = wc_lba[wc_count];
+			memcpy(wc_data[i], wc_data[wc_count], BLOCK_SIZE);
+		} else {
+			i++;
+		}
+	}
+}
+
+/**
+ * @brief Replaces sectors read from the card with their cached (newer) version
+ */
+static void wc_overlay(uint8_t* buffer, uint32_t lba, uint32_t count) {
+	for(uint32_t i = 0; i < wc_count; i++)
+		if(wc_lba[i] >= lba && wc_lba[i] - lba < count)
+			memcpy(buffer + (wc_lba[i] - lba) * BLOCK_SIZE, wc_data[i], BLOCK_SIZE);
+}
+
+#ifdef USB_CONCURRENT_MODE
+/*
+	Concurrent mode: the image being served lives in RAM and is newer than its clusters on the
+	card until synced. The clusters of its file are mapped to SD sectors when the image is loaded,
+	host reads of those sectors are served from RAM and host writes go straight to the card, then
+	the simulation core is asked to reload the affected memory card sectors. Sectors waiting to be
+	reloaded keep being read from the card. Only plain images are mapped, images kept as manifests
+	are seen as stored in the block store. Images in foreign containers (.GME, .VMP...) are not
+	mapped either: their card data is not aligned on SD sectors.
+	The device keeps writing files, FAT and directory sectors through FatFs (save history, indexes,
+	new images), whose cached FAT window and free cluster count would not follow host changes:
+	every host write outside the mapped sectors is refused as write protected.
+*/
+typedef struct {
+	uint32_t lba;		// first SD sector of the extent
+	uint32_t first;		// image offset of the extent, in BLOCK_SIZE units
+	uint32_t count;		// SD sectors in the extent
+} image_extent_t;
+
+static image_extent_t image_extents[MC_SIZE / BLOCK_SIZE];
+static uint32_t image_extent_count = 0;
+static const uint8_t* image_data = NULL;
+
+static void image_add_extent(uint32_t lba, uint32_t first, uint32_t count) {
+	image_extent_t* last = image_extent_count ? &image_extents[image_extent_count - 1] : NULL;
+	if(last && last->lba + last->count == lba && last->first + last->count == first) {
+		last->count += count;		// contiguous clusters
+		return;
+	}
+	image_extents[image_extent_count].lba = lba;
+	image_extents[image_extent_count].first = first;
+	image_extents[image_extent_count].count = count;
+	image_extent_count++;
+}
+
+/**
+ * @brief Returns the image offset (in BLOCK_SIZE units) stored in SD sector lba, -1 outside the image
+ */
+static int32_t image_block_index(uint32_t lba) {
+	for(uint32_t i = 0; i < image_extent_count; i++)
+		if(lba >= image_extents[i].lba && lba - image_extents[i].lba < image_extents[i].count)
+			return image_extents[i].first + (lba - image_extents[i].lba);
+	return -1;
+}
+
+static bool image_contains(uint32_t lba, uint32_t count) {
+	for(uint32_t i = 0; i < count; i++)
+		if(image_block_index(lba + i) < 0)
+			return false;
+	return true;
+}
+
+/**
+ * @brief Replaces image sectors read from the card with the in-RAM copy, unless they are being reloaded
+ */
+static void image_overlay(uint8_t* buffer, uint32_t lba, uint32_t count) {
+	if(!image_extent_count)
+		return;
+	for(uint32_t i = 0; i < count; i++) {
+		int32_t block = image_block_index(lba + i);
+		if(block < 0)
+			continue;
+		sector_t sector = block * (BLOCK_SIZE / MC_SEC_SIZE);
+		for(uint32_t s = 0; s < BLOCK_SIZE / MC_SEC_SIZE; s++, sector++)
+			if(!memcard_simulator_is_reload_pending(sector))
+				memcpy(buffer + i * BLOCK_SIZE + s * MC_SEC_SIZE, &image_data[sector * MC_SEC_SIZE], MC_SEC_SIZE);
+	}
+}
+
+/**
+ * @brief Writes image sectors straight to the card and queues the reload of the memory card sectors
+ */
+static bool image_write(uint8_t lun, sd_card_t* p_sd, const uint8_t* buffer, uint32_t lba, uint32_t count) {
+	/* room is reserved first, data on the card must never get ahead of what can be reloaded */
+	if(!memcard_simulator_reserve_reload(count * (BLOCK_SIZE / MC_SEC_SIZE))) {
+		// Additional Sense 04-01 is BECOMING_READY, the host retries later
+		tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x04, 0x01);
+		return false;
+	}
+	if(!msc_write_blocks(p_sd, buffer, lba, count))
+		return false;
+	for(uint32_t i = 0; i < count; i++) {
+		sector_t sector = image_block_index(lba + i) * (BLOCK_SIZE / MC_SEC_SIZE);
+		for(uint32_t s = 0; s < BLOCK_SIZE / MC_SEC_SIZE; s++)
+			memcard_simulator_reload_sector(sector + s, buffer + i * BLOCK_SIZE + s * MC_SEC_SIZE);
 	}
+	return true;
+}
 
+/**
+ * @brief Maps the clusters of the image being served, must be called again whenever the image changes
+ */
+bool msc_share_image(uint8_t* file_name, const uint8_t* data) {
+	FIL memcard;
+	FSIZE_t data_offset;
+	msc_unshare_image();
+	if(block_store_is_manifest(file_name))
+		return false;
+	if(IF_OK != image_format_open(&memcard, file_name, FA_READ, &data_offset))
+		return false;
+	FATFS* fs = memcard.obj.fs;
+	uint32_t cluster_size = fs->csize * BLOCK_SIZE;
+	bool ok = data_offset == 0;
+	for(uint32_t ofs = 0; ok && ofs < MC_SIZE; ofs += cluster_size) {
+		uint32_t end = ofs + cluster_size < MC_SIZE ? ofs + cluster_size : MC_SIZE;
+		/* seeking to the end of a cluster leaves the file on that cluster without reading it */
+		ok = FR_OK == f_lseek(&memcard, end) && memcard.clust >= 2;
+		if(ok)
+			image_add_extent(fs->database + (LBA_t) (memcard.clust - 2) * fs->csize, ofs / BLOCK_SIZE, (end - ofs) / BLOCK_SIZE);
+	}
+	f_close(&memcard);
+	if(!ok) {
+		image_extent_count = 0;
+		return false;
+	}
+	image_data = data;
 	return true;
 }
 
+void msc_unshare_image() {
+	image_extent_count = 0;
+	image_data = NULL;
+}
+#endif
+
+/**
+ * @brief Stores count whole sectors: short writes in the write-back cache, long ones straight to the card
+ */
+static bool msc_store_blocks(uint8_t lun, sd_card_t* p_sd, const uint8_t* buffer, uint32_t lba, uint32_t count) {
+	#ifdef USB_CONCURRENT_MODE
+	if(image_contains(lba, count))
+		return image_write(lun, p_sd, buffer, lba, count);
+	/* FatFs on the device would not see the change: only the image may be written */
+	tud_msc_set_sense(lun, SCSI_SENSE_DATA_PROTECT, 0x27, 0x00);	// write protected
+	return false;
+	#else
+	(void) lun;
+	#endif
+	if(count <= MSC_WRITE_CACHE_MAX_RUN)
+		return wc_write(p_sd, buffer, lba, count);
+	wc_discard(lba, count);
+	return msc_write_blocks(p_sd, buffer, lba, count);
+}
+
+bool msc_flush() {
+	sd_card_t* p_sd = sd_get_by_num(0);
+	if (!p_sd) return false;
+	return wc_flush(p_sd);
+}
+
+/**
+ * @brief Flushes the write-back cache once the host has stopped writing for a while, call from the USB loop
+ */
+void msc_task() {
+	if(wc_count && absolute_time_diff_us(last_write_time, get_absolute_time()) > MSC_WRITE_SYNC_TIMEOUT * 1000)
+		msc_flush();
+}
+
+#ifdef MSC_VIRTUAL_FAT
+/**
+ * @brief Serves READ10/WRITE10 from the virtual FAT volume, one generated sector at a time
+ */
+static int32_t virtual_fat_transfer(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize, bool write) {
+	uint32_t done = 0;
+	if(lba >= virtual_fat_sector_count()) return -1;	// invalid sector
+	while(done < bufsize && lba < virtual_fat_sector_count()) {
+		uint32_t len = BLOCK_SIZE - offset;
+		uint32_t status;
+		if(len > bufsize - done) len = bufsize - done;
+		if(offset == 0 && len == BLOCK_SIZE) {
+			status = write ? virtual_fat_write(lba, buffer + done) : virtual_fat_read(lba, buffer + done);
+		} else {
+			/* partial sector */
+			status = virtual_fat_read(lba, partial_block);
+			if(status == VF_OK && write) {
+				memcpy(partial_block + offset, buffer + done, len);
+				status = virtual_fat_write(lba, partial_block);
+			} else if(status == VF_OK) {
+				memcpy(buffer + done, partial_block + offset, len);
+			}
+		}
+		if(status == VF_READ_ONLY) {
+			tud_msc_set_sense(lun, SCSI_SENSE_DATA_PROTECT, 0x27, 0x00);	// write protected
+			return -1;
+		}
+		if(status != VF_OK) return -1;
+		done += len;
+		offset = 0;
+		lba++;
+	}
+	return (int32_t) done;
+}
+#endif
+
 /* callback invoked when received READ10 command */
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize)
 {
 	sd_card_t* p_sd = sd_get_by_num(lun);
 	if (!p_sd) return -1;							// not valid drive
 
-	if(lba < 0 || lba >= p_sd->sectors) return -1;	// invalid sector
-	if(bufsize != BLOCK_SIZE) return -1;			// invalid transfer unit
-	if(offset != 0) return -1;						// cannot read unaligned sectors
+	#ifdef MSC_VIRTUAL_FAT
+	return virtual_fat_transfer(lun, lba, offset, buffer, bufsize, false);
+	#endif
+
+	if(lba >= p_sd->sectors) return -1;			// invalid sector
 
-	int status = sd_read_blocks(p_sd, (uint8_t*) buffer, (uint64_t) lba, 1);
-	if(status != SD_BLOCK_DEVICE_ERROR_NONE) return -1;		// read failed
+	if(offset != 0 || bufsize < BLOCK_SIZE) {
+		/* unaligned: return the rest of the sector, tinyusb calls back for the remaining data */
+		uint32_t len = BLOCK_SIZE - offset;
+		if(len > bufsize) len = bufsize;
+		if(!msc_read_blocks(p_sd, partial_block, lba, 1)) return -1;
+		wc_overlay(partial_block, lba, 1);
+		#ifdef USB_CONCURRENT_MODE
+		image_overlay(partial_block, lba, 1);
+		#endif
+		memcpy(buffer, partial_block + offset, len);
+		return (int32_t) len;
+	}
+
+	uint32_t count = bufsize / BLOCK_SIZE;
+	if(lba + count > p_sd->sectors) count = p_sd->sectors - lba;
+	if(!msc_read_blocks(p_sd, (uint8_t*) buffer, lba, count)) return -1;	// read failed
+	wc_overlay((uint8_t*) buffer, lba, count);
+	#ifdef USB_CONCURRENT_MODE
+	image_overlay((uint8_t*) buffer, lba, count);
+	#endif
 
-	return (int32_t) bufsize;
+	return (int32_t) (count * BLOCK_SIZE);
 }
 
 bool tud_msc_is_writable_cb (uint8_t lun)
@@ -97,14 +503,33 @@ int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t*
 	sd_card_t* p_sd = sd_get_by_num(lun);
 	if (!p_sd) return -1;							// not valid drive
 
-	if(lba < 0 || lba >= p_sd->sectors) return -1;	// invalid sector
-	if(bufsize != BLOCK_SIZE) return -1;			// invalid transfer unit
-	if(offset != 0) return -1;						// writes must be sector aligned
+	#ifdef MSC_VIRTUAL_FAT
+	return virtual_fat_transfer(lun, lba, offset, buffer, bufsize, true);
+	#endif
+
+	if(lba >= p_sd->sectors) return -1;			// invalid sector
 
-	int status = sd_write_blocks(p_sd, buffer, lba, 1);
-	if(status != SD_BLOCK_DEVICE_ERROR_NONE) return -1;		// write failed
+	if(offset != 0 || bufsize < BLOCK_SIZE) {
+		/* unaligned: read-modify-write of a single sector */
+		uint32_t len = BLOCK_SIZE - offset;
+		if(len > bufsize) len = bufsize;
+		if(!msc_read_blocks(p_sd, partial_block, lba, 1)) return -1;
+		wc_overlay(partial_block, lba, 1);
+		#ifdef USB_CONCURRENT_MODE
+		image_overlay(partial_block, lba, 1);
+		#endif
+		memcpy(partial_block + offset, buffer, len);
+		if(!msc_store_blocks(lun, p_sd, partial_block, lba, 1)) return -1;
+		last_write_time = get_absolute_time();
+		return (int32_t) len;
+	}
+
+	uint32_t count = bufsize / BLOCK_SIZE;
+	if(lba + count > p_sd->sectors) count = p_sd->sectors - lba;
+	if(!msc_store_blocks(lun, p_sd, buffer, lba, count)) return -1;	// write failed
+	last_write_time = get_absolute_time();
 
-	return (int32_t) bufsize;
+	return (int32_t) (count * BLOCK_SIZE);
 }
 
 /*
@@ -124,6 +549,15 @@ int32_t tud_msc_scsi_cb (uint8_t lun, uint8_t const scsi_cmd[16], void* buffer,
 		case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
 			resplen = 0;
 			break;
+		case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+			if(msc_flush()) {
+				resplen = 0;
+			} else {
+				// Set Sense = Write Error
+				tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);
+				resplen = -1;
+			}
+			break;
 		default:
 			// Set Sense = Invalid Command Operation
 			tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
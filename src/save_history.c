@@ -0,0 +1,320 @@
+#include "save_history.h"
+#include <string.h>
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "ff.h"
+#include "config.h"
+#include "memory_card.h"
+#include "block_store.h"
+#include "image_format.h"
+
+/***
+ *	Every image has its own history file inside SAVE_HISTORY_DIR. The file is a
+ *	sequence of entries, one per completed save (burst of sector writes), each
+ *	made of a header followed by the contents the modified blocks had *before*
+ *	the save. Rolling back a save means writing those pre-images back into the
+ *	image and truncating the history file at the start of the entry.
+ *
+ *	The header is rewritten after every block appended to the entry, so a
+ *	power loss can at most leave trailing data which is discarded on next use.
+ *
+ *	Images kept in the block store (.MCM) are handled the same way, pre-images are
+ *	read from the stored blocks and restored by pointing the manifest to new blocks.
+ */
+
+#define SH_ENTRY_MAGIC		0x48534D50	// "PMSH"
+#define SH_EXT				".HIS"
+#define SH_FILE_NAME_LEN	(sizeof(SAVE_HISTORY_DIR) + MAX_MC_FILENAME_LEN + sizeof(SH_EXT))
+#define SH_TRIM_SLACK		4			// extra entries tolerated before trimming, so that trimming is not done at every save
+#define SH_MAX_TRACKED		(SAVE_HISTORY_MAX_ENTRIES + SH_TRIM_SLACK + 1)
+#define SH_TRIM_FILE_NAME	SAVE_HISTORY_DIR "/TRIM.TMP"
+
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t timestamp;
+	uint16_t block_mask;
+	uint8_t block_count;
+	uint8_t reserved;
+	uint8_t blocks[MC_BLOCK_COUNT];	// order in which the pre-images follow the header
+} save_history_entry_t;
+
+static uint8_t copy_buffer[BLOCK_SIZE];
+
+/* State of the save currently being recorded */
+static bool burst_open = false;
+static FSIZE_t burst_offset;
+static save_history_entry_t burst_entry;
+static uint8_t burst_mc_file_name[MAX_MC_FILENAME_LEN + 1];
+
+static void get_history_file_name(uint8_t* mc_file_name, char* out_name) {
+	snprintf(out_name, SH_FILE_NAME_LEN, "%s/%s", SAVE_HISTORY_DIR, mc_file_name);
+	char* ext = strrchr(out_name, '.');
+	if(!ext)
+		ext = out_name + strlen(out_name);
+	strcpy(ext, SH_EXT);
+}
+
+static void fill_info(save_history_entry_t* entry, save_history_info_t* out_info) {
+	if(!out_info)
+		return;
+	out_info->seq = entry->seq;
+	out_info->timestamp = entry->timestamp;
+	out_info->block_mask = entry->block_mask;
+	out_info->block_count = entry->block_count;
+}
+
+static uint32_t copy_range(FIL* src, FSIZE_t src_offset, FIL* dst, FSIZE_t dst_offset, FSIZE_t length) {
+	UINT bytes_read, bytes_written;
+	while(length > 0) {
+		UINT chunk = length > sizeof(copy_buffer) ? sizeof(copy_buffer) : (UINT) length;
+		if(FR_OK != f_lseek(src, src_offset) || FR_OK != f_read(src, copy_buffer, chunk, &bytes_read) || bytes_read != chunk)
+			return SH_FILE_READ_ERR;
+		if(FR_OK != f_lseek(dst, dst_offset) || FR_OK != f_write(dst, copy_buffer, chunk, &bytes_written) || bytes_written != chunk)
+			return SH_FILE_WRITE_ERR;
+		src_offset += chunk;
+		dst_offset += chunk;
+		length -= chunk;
+	}
+	return SH_OK;
+}
+
+/***
+ *	Opens the file holding the durable contents of a block of an image.
+ */
+static uint32_t open_image_block(uint8_t* mc_file_name, uint8_t block, FIL* out_fil, FSIZE_t* out_offset) {
+	if(block_store_is_manifest(mc_file_name)) {
+		block_manifest_t manifest;
+		if(BS_OK != block_store_read_manifest(mc_file_name, &manifest) || BS_OK != block_store_open_block(manifest.blocks[block], out_fil))
+			return SH_FILE_OPEN_ERR;
+		*out_offset = 0;
+	} else {
+		if(IF_OK != image_format_open(out_fil, mc_file_name, FA_READ, out_offset))
+			return SH_FILE_OPEN_ERR;
+		*out_offset += (FSIZE_t) block * MC_BLOCK_SIZE;
+	}
+	return SH_OK;
+}
+
+static bool read_entry(FIL* history, FSIZE_t offset, save_history_entry_t* out_entry) {
+	UINT bytes_read;
+	if(FR_OK != f_lseek(history, offset))
+		return false;
+	if(FR_OK != f_read(history, out_entry, sizeof(save_history_entry_t), &bytes_read) || bytes_read != sizeof(save_history_entry_t))
+		return false;
+	return out_entry->magic == SH_ENTRY_MAGIC && out_entry->block_count > 0 && out_entry->block_count <= MC_BLOCK_COUNT;
+}
+
+/***
+ *	Walks the entry headers keeping track of the offsets of the most recent ones.
+ *	Returns the offset right after the last complete entry.
+ */
+static FSIZE_t scan_entries(FIL* history, FSIZE_t* offsets, uint32_t* out_count, uint32_t* out_next_seq) {
+	FSIZE_t offset = 0;
+	FSIZE_t size = f_size(history);
+	uint32_t count = 0;
+	save_history_entry_t entry;
+	*out_next_seq = 0;
+	while(offset + sizeof(entry) <= size) {
+		if(!read_entry(history, offset, &entry))
+			break;
+		FSIZE_t entry_end = offset + sizeof(entry) + (FSIZE_t) entry.block_count * MC_BLOCK_SIZE;
+		if(entry_end > size)
+			break;	// torn entry
+		offsets[count % SH_MAX_TRACKED] = offset;
+		++count;
+		*out_next_seq = entry.seq + 1;
+		offset = entry_end;
+	}
+	*out_count = count;
+	return offset;
+}
+
+/***
+ *	Drops the oldest entries once the history grew past its limit.
+ *	Done by copying the entries worth keeping into a new file.
+ */
+static void trim_history(char* history_name) {
+	FIL history, trimmed;
+	FSIZE_t offsets[SH_MAX_TRACKED];
+	uint32_t count, next_seq;
+	if(FR_OK != f_open(&history, history_name, FA_READ))
+		return;
+	FSIZE_t end = scan_entries(&history, offsets, &count, &next_seq);
+	if(count <= SAVE_HISTORY_MAX_ENTRIES + SH_TRIM_SLACK) {
+		f_close(&history);
+		return;
+	}
+	FSIZE_t keep_from = offsets[(count - SAVE_HISTORY_MAX_ENTRIES) % SH_MAX_TRACKED];
+	if(FR_OK != f_open(&trimmed, SH_TRIM_FILE_NAME, FA_CREATE_ALWAYS | FA_WRITE)) {
+		f_close(&history);
+		return;
+	}
+	uint32_t status = copy_range(&history, keep_from, &trimmed, 0, end - keep_from);
+	f_close(&trimmed);
+	f_close(&history);
+	if(status == SH_OK && FR_OK == f_unlink(history_name))
+		f_rename(SH_TRIM_FILE_NAME, history_name);
+	else
+		f_unlink(SH_TRIM_FILE_NAME);
+}
+
+/***
+ *	Must be called before a modified sector is written to the image. The first time
+ *	a block is touched during a save its current (durable) contents are appended to
+ *	the history, following blocks of the same save are only recorded once.
+ */
+uint32_t save_history_record_block(uint8_t* mc_file_name, uint8_t block) {
+	if(!mc_file_name || block >= MC_BLOCK_COUNT)
+		return SH_BAD_PARAM;
+	if(burst_open && strcmp(burst_mc_file_name, mc_file_name))
+		save_history_end_burst();	// image changed in the middle of a save
+	if(burst_open && (burst_entry.block_mask & (1 << block)))
+		return SH_OK;	// pre-image already recorded
+
+	char history_name[SH_FILE_NAME_LEN];
+	get_history_file_name(mc_file_name, history_name);
+	f_mkdir(SAVE_HISTORY_DIR);	// fails harmlessly when already existing
+
+	FIL history, memcard;
+	FSIZE_t block_offset;
+	if(FR_OK != f_open(&history, history_name, FA_OPEN_ALWAYS | FA_READ | FA_WRITE))
+		return SH_FILE_OPEN_ERR;
+	if(SH_OK != open_image_block(mc_file_name, block, &memcard, &block_offset)) {
+		f_close(&history);
+		return SH_FILE_OPEN_ERR;
+	}
+
+	uint32_t status = SH_OK;
+	UINT bytes_written;
+	if(!burst_open) {
+		FSIZE_t offsets[SH_MAX_TRACKED];
+		uint32_t count, next_seq;
+		burst_offset = scan_entries(&history, offsets, &count, &next_seq);
+		f_lseek(&history, burst_offset);
+		f_truncate(&history);	// discard leftovers of interrupted saves
+		memset(&burst_entry, 0, sizeof(burst_entry));
+		burst_entry.magic = SH_ENTRY_MAGIC;
+		burst_entry.seq = next_seq;
+		burst_entry.timestamp = to_ms_since_boot(get_absolute_time());
+		strcpy(burst_mc_file_name, mc_file_name);
+		burst_open = true;
+	}
+
+	FSIZE_t data_offset = burst_offset + sizeof(save_history_entry_t) + (FSIZE_t) burst_entry.block_count * MC_BLOCK_SIZE;
+	status = copy_range(&memcard, block_offset, &history, data_offset, MC_BLOCK_SIZE);
+	if(status == SH_OK) {
+		burst_entry.blocks[burst_entry.block_count++] = block;
+		burst_entry.block_mask |= (1 << block);
+		if(FR_OK != f_lseek(&history, burst_offset) || FR_OK != f_write(&history, &burst_entry, sizeof(burst_entry), &bytes_written) || bytes_written != sizeof(burst_entry))
+			status = SH_FILE_WRITE_ERR;
+	}
+	f_close(&memcard);
+	if(FR_OK != f_close(&history) && status == SH_OK)
+		status = SH_FILE_WRITE_ERR;
+	if(status != SH_OK)
+		burst_open = false;	// stop recording this save, what is already stored stays consistent
+	return status;
+}
+
+/***
+ *	Marks the end of the save being recorded, following writes will start a new entry.
+ */
+void save_history_end_burst() {
+	if(!burst_open)
+		return;
+	burst_open = false;
+	char history_name[SH_FILE_NAME_LEN];
+	get_history_file_name(burst_mc_file_name, history_name);
+	trim_history(history_name);
+}
+
+/***
+ *	Retrieves information about a save stored in the history.
+ *	Index 0 is the most recent save.
+ */
+uint32_t save_history_get_info(uint8_t* mc_file_name, uint32_t index, save_history_info_t* out_info, uint32_t* out_count) {
+	if(!mc_file_name || !out_info)
+		return SH_BAD_PARAM;
+	char history_name[SH_FILE_NAME_LEN];
+	get_history_file_name(mc_file_name, history_name);
+	FIL history;
+	if(FR_OK != f_open(&history, history_name, FA_READ))
+		return SH_NO_ENTRY;
+	FSIZE_t offsets[SH_MAX_TRACKED];
+	uint32_t count, next_seq;
+	scan_entries(&history, offsets, &count, &next_seq);
+	uint32_t tracked = count > SH_MAX_TRACKED ? SH_MAX_TRACKED : count;	// older entries are about to be trimmed anyway
+	if(out_count)
+		*out_count = tracked;
+	uint32_t status = SH_NO_ENTRY;
+	save_history_entry_t entry;
+	if(index < tracked) {
+		if(read_entry(&history, offsets[(count - 1 - index) % SH_MAX_TRACKED], &entry)) {
+			fill_info(&entry, out_info);
+			status = SH_OK;
+		} else {
+			status = SH_FILE_READ_ERR;
+		}
+	}
+	f_close(&history);
+	return status;
+}
+
+/***
+ *	Restores the image to the state it had before the most recent saves.
+ *	Saves are undone one at a time starting from the most recent, the history
+ *	is truncated accordingly. The in-RAM copy of the image must be reloaded afterwards.
+ */
+uint32_t save_history_rollback(uint8_t* mc_file_name, uint32_t amount, save_history_info_t* out_info) {
+	if(!mc_file_name || amount == 0)
+		return SH_BAD_PARAM;
+	if(burst_open && !strcmp(burst_mc_file_name, mc_file_name))
+		save_history_end_burst();
+
+	char history_name[SH_FILE_NAME_LEN];
+	get_history_file_name(mc_file_name, history_name);
+	FIL history, memcard;
+	FSIZE_t image_offset = 0;
+	bool manifest = block_store_is_manifest(mc_file_name);
+	if(FR_OK != f_open(&history, history_name, FA_READ | FA_WRITE))
+		return SH_NO_ENTRY;
+	if(!manifest && IF_OK != image_format_open(&memcard, mc_file_name, FA_READ | FA_WRITE, &image_offset)) {
+		f_close(&history);
+		return SH_FILE_OPEN_ERR;
+	}
+
+	FSIZE_t offsets[SH_MAX_TRACKED];
+	uint32_t count, next_seq;
+	scan_entries(&history, offsets, &count, &next_seq);
+	uint32_t tracked = count > SH_MAX_TRACKED ? SH_MAX_TRACKED : count;
+	uint32_t status = tracked ? SH_OK : SH_NO_ENTRY;
+	for(uint32_t i = 0; i < amount && i < tracked && status == SH_OK; i++) {
+		FSIZE_t offset = offsets[(count - 1 - i) % SH_MAX_TRACKED];
+		save_history_entry_t entry;
+		if(!read_entry(&history, offset, &entry)) {
+			status = SH_FILE_READ_ERR;
+			break;
+		}
+		FSIZE_t data_offset = offset + sizeof(save_history_entry_t);
+		for(uint8_t b = 0; b < entry.block_count && status == SH_OK; b++) {
+			if(manifest) {
+				if(BS_OK != block_store_set_block(mc_file_name, entry.blocks[b], &history, data_offset))
+					status = SH_FILE_WRITE_ERR;
+			} else {
+				status = copy_range(&history, data_offset, &memcard, image_offset + (FSIZE_t) entry.blocks[b] * MC_BLOCK_SIZE, MC_BLOCK_SIZE);
+			}
+			data_offset += MC_BLOCK_SIZE;
+		}
+		if(status == SH_OK) {
+			/* image must be durable before the entry restoring it is dropped */
+			if((!manifest && FR_OK != f_sync(&memcard)) || FR_OK != f_lseek(&history, offset) || FR_OK != f_truncate(&history))
+				status = SH_FILE_WRITE_ERR;
+			fill_info(&entry, out_info);
+		}
+	}
+	if(!manifest)
+		f_close(&memcard);
+	f_close(&history);
+	return status;
+}
@@ -0,0 +1,304 @@
+#include "save_transfer.h"
+#include <string.h>
+#include <stdio.h>
+#include "ff.h"
+#include "memory_card.h"
+#include "block_store.h"
+#include "image_format.h"
+#include "card_fs.h"
+#include "byte_order.h"
+
+/***
+ *	Moves single saves between images and save files on the SD card.
+ *
+ *	Saves are found through the model of the image directory (see card_fs.h).
+ *	Exporting writes the blocks in link order after the save header. Importing copies
+ *	the blocks into free ones first and then writes the directory block, so an
+ *	interrupted import only leaves unreferenced data behind.
+ *
+ *	Images are accessed on the SD card: the caller stores pending changes of the image
+ *	being served before and reloads it after an import, like a rollback.
+ */
+
+#define PSV_HEADER_SIZE		0x84
+#define PSV_MAGIC			"\0VSP"
+#define PSV_SIZE			0x40
+#define PSV_DATA_OFFSET		0x44
+#define PSV_NAME			0x64
+
+typedef struct {
+	uint8_t* file_name;
+	bool manifest;
+	FIL fil;			// image file, unused for manifests
+	FSIZE_t offset;		// start of the card data in the image file
+} image_t;
+
+static uint32_t open_image(image_t* img, uint8_t* file_name, BYTE mode) {
+	img->file_name = file_name;
+	img->manifest = block_store_is_manifest(file_name);
+	if(img->manifest)
+		return ST_OK;
+	switch(image_format_open(&img->fil, file_name, mode, &img->offset)) {
+		case IF_OK:
+			return ST_OK;
+		case IF_FILE_OPEN_ERR:
+		case IF_READ_ONLY:
+			return ST_FILE_OPEN_ERR;
+		default:
+			return ST_BAD_FORMAT;
+	}
+}
+
+static uint32_t close_image(image_t* img) {
+	if(!img->manifest && FR_OK != f_close(&img->fil))
+		return ST_FILE_WRITE_ERR;
+	return ST_OK;
+}
+
+static uint32_t read_block(image_t* img, uint8_t block, uint8_t* out_block) {
+	UINT bytes_read;
+	if(img->manifest) {
+		block_manifest_t manifest;
+		if(BS_OK != block_store_read_manifest(img->file_name, &manifest) || BS_OK != block_store_load(manifest.blocks[block], out_block))
+			return ST_FILE_READ_ERR;
+		return ST_OK;
+	}
+	if(FR_OK != f_lseek(&img->fil, img->offset + block * MC_BLOCK_SIZE) || FR_OK != f_read(&img->fil, out_block, MC_BLOCK_SIZE, &bytes_read) || bytes_read != MC_BLOCK_SIZE)
+		return ST_FILE_READ_ERR;
+	return ST_OK;
+}
+
+static uint32_t write_block(image_t* img, uint8_t block, const uint8_t* block_data) {
+	UINT bytes_written;
+	if(img->manifest)
+		return BS_OK == block_store_write_block(img->file_name, block, block_data) ? ST_OK : ST_FILE_WRITE_ERR;
+	if(FR_OK != f_lseek(&img->fil, img->offset + block * MC_BLOCK_SIZE) || FR_OK != f_write(&img->fil, block_data, MC_BLOCK_SIZE, &bytes_written) || bytes_written != MC_BLOCK_SIZE)
+		return ST_FILE_WRITE_ERR;
+	return FR_OK == f_sync(&img->fil) ? ST_OK : ST_FILE_WRITE_ERR;
+}
+
+/***
+ *	Reads the header and the 15 directory frames at the start of the image.
+ */
+static uint32_t read_directory(image_t* img, uint8_t frames[MC_BLOCK_COUNT][MC_SEC_SIZE]) {
+	UINT bytes_read;
+	if(!img->manifest)
+		return FR_OK == f_lseek(&img->fil, img->offset) && FR_OK == f_read(&img->fil, frames, MC_BLOCK_COUNT * MC_SEC_SIZE, &bytes_read) &&
+			bytes_read == MC_BLOCK_COUNT * MC_SEC_SIZE ? ST_OK : ST_FILE_READ_ERR;
+	block_manifest_t manifest;
+	FIL fil;
+	if(BS_OK != block_store_read_manifest(img->file_name, &manifest) || BS_OK != block_store_open_block(manifest.blocks[0], &fil))
+		return ST_FILE_READ_ERR;
+	bool ok = FR_OK == f_read(&fil, frames, MC_BLOCK_COUNT * MC_SEC_SIZE, &bytes_read) && bytes_read == MC_BLOCK_COUNT * MC_SEC_SIZE;
+	f_close(&fil);
+	return ok ? ST_OK : ST_FILE_READ_ERR;
+}
+
+/***
+ *	Save file name made of the save name, characters FAT does not allow are replaced.
+ */
+static void get_save_file_name(const uint8_t* name, uint8_t format, char* out_name) {
+	char* p = out_name + sprintf(out_name, "%s/", SAVE_EXPORT_DIR);
+	for(uint32_t i = 0; i < CF_NAME_LEN && name[i]; i++)
+		*p++ = (name[i] > ' ' && name[i] < 0x7F && !strchr("\"*/:<>?\\|", name[i])) ? name[i] : '_';
+	strcpy(p, format == ST_FORMAT_PSV ? ".PSV" : ".MCS");
+}
+
+static void make_psv_header(const uint8_t* first_frame, uint32_t block_count, uint8_t* out_header) {
+	memset(out_header, 0, PSV_HEADER_SIZE);
+	memcpy(out_header, PSV_MAGIC, 4);		// key seed and signature left empty, PS3 needs the file re-signed
+	put32(&out_header[0x38], 0x14);
+	put32(&out_header[0x3C], 1);			// PS1 save
+	put32(&out_header[PSV_SIZE], block_count * MC_BLOCK_SIZE);
+	put32(&out_header[PSV_DATA_OFFSET], PSV_HEADER_SIZE);
+	put32(&out_header[0x48], 0x200);
+	put32(&out_header[0x5C], 0x2000);
+	put32(&out_header[0x60], 0x9003);
+	memcpy(&out_header[PSV_NAME], &first_frame[CF_FRAME_NAME], CF_NAME_LEN);
+}
+
+/**
+ * @brief Writes the save using block of an image to SAVE_EXPORT_DIR, returns the name of the file
+ */
+uint32_t save_transfer_export(uint8_t* mc_file_name, uint8_t block, uint8_t format, char* out_file_name) {
+	uint8_t frames[MC_BLOCK_COUNT][MC_SEC_SIZE];
+	uint8_t header[PSV_HEADER_SIZE];
+	card_fs_t fs;
+	uint8_t* block_data = block_store_scratch_block();
+	image_t img;
+	FIL save;
+	UINT bytes_written;
+	if(!mc_file_name || !out_file_name || block < 1 || block >= MC_BLOCK_COUNT || format > ST_FORMAT_PSV)
+		return ST_BAD_PARAM;
+	uint32_t status = open_image(&img, mc_file_name, FA_READ);
+	if(status != ST_OK)
+		return status;
+	status = read_directory(&img, frames);
+	card_fs_save_t* save_info = NULL;
+	if(status == ST_OK) {
+		card_fs_build(&fs, (uint8_t*) frames);
+		save_info = card_fs_get_save(&fs, block);
+		if(!save_info)
+			status = ST_NO_SAVE;
+	}
+	if(status != ST_OK) {
+		close_image(&img);
+		return status;
+	}
+	uint32_t count = save_info->block_count;
+	const uint8_t* first_frame = frames[save_info->first_block];
+
+	uint32_t header_size;
+	if(format == ST_FORMAT_PSV) {
+		make_psv_header(first_frame, count, header);
+		header_size = PSV_HEADER_SIZE;
+	} else {
+		/* links are only meaningful inside the image */
+		card_fs_set_frame(header, CF_FRAME_FIRST, count * MC_BLOCK_SIZE, CF_NO_NEXT, &first_frame[CF_FRAME_NAME]);
+		header_size = MC_SEC_SIZE;
+	}
+	get_save_file_name(&first_frame[CF_FRAME_NAME], format, out_file_name);
+	f_mkdir(SAVE_EXPORT_DIR);	// fails harmlessly when already existing
+	if(FR_OK != f_open(&save, out_file_name, FA_CREATE_ALWAYS | FA_WRITE)) {
+		close_image(&img);
+		return ST_FILE_OPEN_ERR;
+	}
+	if(FR_OK != f_write(&save, header, header_size, &bytes_written) || bytes_written != header_size)
+		status = ST_FILE_WRITE_ERR;
+	for(uint32_t i = 0; i < count && status == ST_OK; i++) {
+		status = read_block(&img, save_info->blocks[i], block_data);
+		if(status == ST_OK && (FR_OK != f_write(&save, block_data, MC_BLOCK_SIZE, &bytes_written) || bytes_written != MC_BLOCK_SIZE))
+			status = ST_FILE_WRITE_ERR;
+	}
+	if(FR_OK != f_close(&save) && status == ST_OK)
+		status = ST_FILE_WRITE_ERR;
+	close_image(&img);
+	if(status != ST_OK)
+		f_unlink(out_file_name);
+	return status;
+}
+
+/***
+ *	Reads the header of a save file, returns the name, block count and offset of the data.
+ */
+static uint32_t read_save_header(FIL* save, uint8_t* out_name, uint32_t* out_count, uint32_t* out_offset) {
+	uint8_t header[PSV_HEADER_SIZE];
+	UINT bytes_read;
+	FSIZE_t size = f_size(save);
+	if(FR_OK != f_read(save, header, sizeof(header), &bytes_read))
+		return ST_FILE_READ_ERR;
+	if(bytes_read == PSV_HEADER_SIZE && !memcmp(header, PSV_MAGIC, 4)) {
+		*out_count = get32(&header[PSV_SIZE]) / MC_BLOCK_SIZE;
+		*out_offset = get32(&header[PSV_DATA_OFFSET]);
+		memcpy(out_name, &header[PSV_NAME], CF_NAME_LEN);
+	} else if(bytes_read >= MC_SEC_SIZE && header[0] == CF_FRAME_FIRST) {
+		*out_count = (size - MC_SEC_SIZE) / MC_BLOCK_SIZE;
+		*out_offset = MC_SEC_SIZE;
+		memcpy(out_name, &header[CF_FRAME_NAME], CF_NAME_LEN);
+	} else {
+		return ST_BAD_FORMAT;
+	}
+	if(*out_count < 1 || *out_count > CF_SAVE_BLOCKS || *out_offset + *out_count * MC_BLOCK_SIZE > size)
+		return ST_BAD_FORMAT;
+	return ST_OK;
+}
+
+/**
+ * @brief Copies a .mcs or .psv save into free blocks of an image, returns the first block of the imported save
+ */
+uint32_t save_transfer_import(uint8_t* mc_file_name, const char* save_file_name, uint8_t* out_first_block) {
+	uint8_t frames[MC_BLOCK_COUNT][MC_SEC_SIZE];
+	uint8_t blocks[CF_SAVE_BLOCKS];
+	uint8_t name[CF_NAME_LEN];
+	card_fs_t fs;
+	uint8_t* block_data = block_store_scratch_block();
+	uint32_t count, offset;
+	image_t img;
+	FIL save;
+	UINT bytes_read;
+	if(!mc_file_name || !save_file_name)
+		return ST_BAD_PARAM;
+	if(FR_OK != f_open(&save, save_file_name, FA_READ))
+		return ST_FILE_OPEN_ERR;
+	uint32_t status = read_save_header(&save, name, &count, &offset);
+	if(status == ST_OK)
+		status = open_image(&img, mc_file_name, FA_READ | FA_WRITE);
+	if(status != ST_OK) {
+		f_close(&save);
+		return status;
+	}
+
+	/* pick the free blocks in order, refusing a second copy of the same save */
+	uint32_t free_count = 0;
+	status = read_directory(&img, frames);
+	if(status == ST_OK)
+		card_fs_build(&fs, (uint8_t*) frames);
+	for(uint8_t b = 1; b < MC_BLOCK_COUNT && status == ST_OK; b++) {
+		if(fs.block_type[b] == CF_BLOCK_FIRST && !strncmp(fs.saves[b - 1].name, name, CF_NAME_LEN))
+			status = ST_NAME_CONFLICT;
+		else if(fs.block_type[b] == CF_BLOCK_FREE && free_count < count)
+			blocks[free_count++] = b;
+	}
+	if(status == ST_OK && free_count < count)
+		status = ST_NO_SPACE;
+
+	for(uint32_t i = 0; i < count && status == ST_OK; i++) {
+		if(FR_OK != f_lseek(&save, offset + i * MC_BLOCK_SIZE) || FR_OK != f_read(&save, block_data, MC_BLOCK_SIZE, &bytes_read) || bytes_read != MC_BLOCK_SIZE)
+			status = ST_FILE_READ_ERR;
+		else
+			status = write_block(&img, blocks[i], block_data);
+	}
+	/* data is in place, link it */
+	if(status == ST_OK)
+		status = read_block(&img, 0, block_data);
+	if(status == ST_OK) {
+		for(uint32_t i = 0; i < count; i++) {
+			uint8_t state = i == 0 ? CF_FRAME_FIRST : (i == count - 1 ? CF_FRAME_LAST : CF_FRAME_MIDDLE);
+			uint16_t next = i == count - 1 ? CF_NO_NEXT : blocks[i + 1] - 1;
+			card_fs_set_frame(&block_data[blocks[i] * MC_SEC_SIZE], state, i == 0 ? count * MC_BLOCK_SIZE : 0, next, i == 0 ? name : NULL);
+		}
+		status = write_block(&img, 0, block_data);
+	}
+	if(close_image(&img) != ST_OK && status == ST_OK)
+		status = ST_FILE_WRITE_ERR;
+	f_close(&save);
+	if(status == ST_OK && out_first_block)
+		*out_first_block = blocks[0];
+	return status;
+}
+
+static bool is_save_file(const char* file_name) {
+	const char* ext = strrchr(file_name, '.');
+	return ext && (!strcasecmp(ext, ".MCS") || !strcasecmp(ext, ".PSV"));
+}
+
+/**
+ * @brief Imports every save of SAVE_IMPORT_DIR into an image, imported files are moved to SAVE_EXPORT_DIR
+ */
+uint32_t save_transfer_import_all(uint8_t* mc_file_name, uint32_t* out_imported) {
+	DIR dir;
+	FILINFO fno;
+	char src[sizeof(SAVE_IMPORT_DIR) + sizeof(fno.fname) + 1];
+	char dst[sizeof(SAVE_EXPORT_DIR) + sizeof(fno.fname) + 1];
+	uint32_t status = ST_OK;
+	*out_imported = 0;
+	if(FR_OK != f_opendir(&dir, SAVE_IMPORT_DIR))
+		return ST_FILE_OPEN_ERR;
+	f_mkdir(SAVE_EXPORT_DIR);
+	while(FR_OK == f_readdir(&dir, &fno) && fno.fname[0]) {
+		if((fno.fattrib & AM_DIR) || !is_save_file(fno.fname))
+			continue;
+		snprintf(src, sizeof(src), "%s/%s", SAVE_IMPORT_DIR, fno.fname);
+		uint32_t file_status = save_transfer_import(mc_file_name, src, NULL);
+		if(file_status == ST_OK) {
+			++*out_imported;
+			snprintf(dst, sizeof(dst), "%s/%s", SAVE_EXPORT_DIR, fno.fname);
+			f_unlink(dst);		// older export of the same save
+			f_rename(src, dst);
+		} else if(file_status != ST_NAME_CONFLICT) {
+			status = file_status;	// keep going, other saves may fit
+		}
+	}
+	f_closedir(&dir);
+	return status;
+}
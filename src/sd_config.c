@@ -3,6 +3,12 @@
 #include "ff.h" 
 #include "diskio.h"
 #include "config.h"
+#include "checksum.h"
+#include "disk_cache.h"
+#include "hardware/spi.h"
+#include "pico/time.h"
+
+#define SD_PROFILE_MAGIC 0x46505350 // "PSPF"
 
 void spi0_dma_isr();
 
@@ -44,4 +50,167 @@ spi_t *spi_get_by_num(size_t num) {
     } else {
         return NULL;
     }
-}
\ No newline at end of file
+}
+
+/*
+ * SD bus speed negotiation.
+ * After init the SPI clock is raised step by step, every step is verified by writing
+ * and reading back a scratch area with CRC checked data. The first failing step
+ * makes the clock fall back to the last verified one. The result, together with
+ * measured latencies, is stored on the card so later boots only verify it once.
+ */
+static const uint32_t baud_steps[] = {
+    12500 * 1000,
+    20833 * 1000,
+    25000 * 1000,
+    31250 * 1000,
+};
+
+static sd_profile_t profile = {
+    .baud_rate = BAUD_RATE,
+};
+
+static uint8_t bench_buffer[BLOCK_SIZE * SD_BENCH_MULTI_BLOCKS];
+static uint8_t verify_buffer[BLOCK_SIZE * SD_BENCH_MULTI_BLOCKS];
+
+static void fill_pattern(uint8_t *buffer, uint32_t size, uint32_t seed) {
+    uint32_t x = seed | 1;
+    for (uint32_t i = 0; i < size; i++) {
+        x ^= x << 13;   // xorshift, different data at each step
+        x ^= x >> 17;
+        x ^= x << 5;
+        buffer[i] = (uint8_t) x;
+    }
+}
+
+/*
+ * Returns the first sector of the contiguous scratch file, 0 on failure.
+ * The file is recreated every time: f_expand only works on empty files, and an existing
+ * file of the right size may have been rewritten on other clusters by a computer.
+ */
+static LBA_t get_scratch_area() {
+    FIL fil;
+    if (FR_OK != f_open(&fil, SD_SCRATCH_FILE, FA_CREATE_ALWAYS | FA_READ | FA_WRITE))
+        return 0;
+    FRESULT f_res = f_expand(&fil, sizeof(bench_buffer), 1);    // allocate contiguous clusters
+    LBA_t lba = 0;
+    if (f_res == FR_OK && fil.obj.sclust >= 2) {
+        FATFS *fs = fil.obj.fs;
+        lba = fs->database + (LBA_t) (fil.obj.sclust - 2) * fs->csize;
+    }
+    f_close(&fil);
+    return lba;
+}
+
+/* Writes and reads back the scratch area, optionally measuring latency */
+static bool verify_scratch_area(sd_card_t *p_sd, LBA_t lba, uint32_t seed, sd_profile_t *out_profile) {
+    uint64_t start;
+    disk_cache_invalidate_range(lba, SD_BENCH_MULTI_BLOCKS);    // written bypassing FatFs
+    fill_pattern(bench_buffer, sizeof(bench_buffer), seed);
+    uint32_t expected_crc = crc32(bench_buffer, sizeof(bench_buffer));
+
+    start = time_us_64();
+    if (SD_BLOCK_DEVICE_ERROR_NONE != sd_write_blocks(p_sd, bench_buffer, lba, 1))
+        return false;
+    uint32_t write_single_us = time_us_64() - start;
+    start = time_us_64();
+    if (SD_BLOCK_DEVICE_ERROR_NONE != sd_write_blocks(p_sd, bench_buffer, lba, SD_BENCH_MULTI_BLOCKS))
+        return false;
+    uint32_t write_multi_us = time_us_64() - start;
+
+    memset(verify_buffer, 0, sizeof(verify_buffer));
+    start = time_us_64();
+    if (SD_BLOCK_DEVICE_ERROR_NONE != sd_read_blocks(p_sd, verify_buffer, lba, 1))
+        return false;
+    uint32_t read_single_us = time_us_64() - start;
+    if (crc32(verify_buffer, BLOCK_SIZE) != crc32(bench_buffer, BLOCK_SIZE))
+        return false;
+    start = time_us_64();
+    if (SD_BLOCK_DEVICE_ERROR_NONE != sd_read_blocks(p_sd, verify_buffer, lba, SD_BENCH_MULTI_BLOCKS))
+        return false;
+    uint32_t read_multi_us = time_us_64() - start;
+    if (crc32(verify_buffer, sizeof(verify_buffer)) != expected_crc)
+        return false;
+
+    if (out_profile) {
+        out_profile->read_single_us = read_single_us;
+        out_profile->write_single_us = write_single_us;
+        out_profile->read_multi_us = read_multi_us;
+        out_profile->write_multi_us = write_multi_us;
+    }
+    return true;
+}
+
+static void set_baud_rate(sd_card_t *p_sd, uint32_t baud_rate) {
+    p_sd->spi->baud_rate = baud_rate;   // also used by the driver when reinitializing the card
+    spi_set_baudrate(p_sd->spi->hw_inst, baud_rate);
+}
+
+static bool load_profile(sd_card_t *p_sd, sd_profile_t *out_profile) {
+    FIL fil;
+    UINT bytes_read;
+    if (FR_OK != f_open(&fil, SD_PROFILE_FILE, FA_READ))
+        return false;
+    bool valid = FR_OK == f_read(&fil, out_profile, sizeof(sd_profile_t), &bytes_read) && bytes_read == sizeof(sd_profile_t);
+    f_close(&fil);
+    return valid && out_profile->magic == SD_PROFILE_MAGIC && out_profile->sectors == p_sd->sectors;
+}
+
+static void store_profile(sd_profile_t *profile) {
+    FIL fil;
+    UINT bytes_written;
+    if (FR_OK != f_open(&fil, SD_PROFILE_FILE, FA_CREATE_ALWAYS | FA_WRITE))
+        return;
+    f_write(&fil, profile, sizeof(sd_profile_t), &bytes_written);
+    f_close(&fil);
+}
+
+/* Must be called after the filesystem has been mounted */
+void sd_negotiate_speed(sd_card_t *p_sd) {
+    LBA_t lba = get_scratch_area();
+    if (!lba)
+        return;     // keep default speed
+
+    /* cached profile from a previous boot, only check it still works */
+    sd_profile_t cached;
+    if (load_profile(p_sd, &cached)) {
+        set_baud_rate(p_sd, cached.baud_rate);
+        if (verify_scratch_area(p_sd, lba, cached.baud_rate, NULL)) {
+            profile = cached;
+            return;
+        }
+    }
+
+    sd_profile_t candidate = { .magic = SD_PROFILE_MAGIC, .sectors = p_sd->sectors };
+    set_baud_rate(p_sd, BAUD_RATE);
+    if (!verify_scratch_area(p_sd, lba, BAUD_RATE, &candidate))
+        return;     // card does not even work reliably at default speed, keep it and do not cache anything
+    candidate.baud_rate = BAUD_RATE;
+    profile = candidate;
+    for (size_t i = 0; i < count_of(baud_steps) && baud_steps[i] <= SD_MAX_BAUD_RATE; i++) {
+        set_baud_rate(p_sd, baud_steps[i]);
+        if (!verify_scratch_area(p_sd, lba, baud_steps[i], &candidate))
+            break;
+        candidate.baud_rate = baud_steps[i];
+        profile = candidate;
+    }
+    set_baud_rate(p_sd, profile.baud_rate);    // fall back to last verified step
+    store_profile(&profile);
+}
+
+const sd_profile_t *sd_get_profile() {
+    return &profile;
+}
+
+/* Number of sector syncs fitting in SD_SYNC_BATCH_BUDGET, each costing roughly a block read and write */
+uint32_t sd_get_sync_batch_size() {
+    uint32_t sync_us = profile.read_single_us + profile.write_single_us;
+    if (!sync_us)
+        return 1;   // not measured
+    uint32_t batch = SD_SYNC_BATCH_BUDGET / sync_us;
+    if (batch < 1)
+        batch = 1;
+    if (batch > SD_BENCH_MULTI_BLOCKS * 4)
+        batch = SD_BENCH_MULTI_BLOCKS * 4;
+    return batch;
+}
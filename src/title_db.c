@@ -0,0 +1,57 @@
+#include "title_db.h"
+#include <stddef.h>
+
+/***
+ *	Lookup in the title database linked into flash. Tables are read in place
+ *	from XIP flash, no SD card access nor heap allocation is needed.
+ */
+
+#define IS_DICT_REF(byte)	((byte) >= 0x01 && (byte) <= 0x1F)
+
+static const uint8_t* skip_name(const uint8_t* name) {
+	while(*name) {
+		name += IS_DICT_REF(*name) ? 2 : 1;
+	}
+	return name + 1;
+}
+
+static uint32_t decode_name(const uint8_t* name, char* out_name, uint32_t max_len) {
+	uint32_t len = 0;
+	while(*name && len + 1 < max_len) {
+		if(IS_DICT_REF(*name)) {
+			uint32_t code = ((name[0] - 1) << 8) | name[1];
+			name += 2;
+			if(code >= title_db_dict_count)
+				break;
+			for(uint32_t i = title_db_dict_ofs[code]; i < title_db_dict_ofs[code + 1] && len + 1 < max_len; i++)
+				out_name[len++] = title_db_dict[i];
+		} else {
+			out_name[len++] = *name++;
+		}
+	}
+	out_name[len] = '\0';
+	return len;
+}
+
+/***
+ *	Copies the name matching a packed title key into out_name, returns false if unknown.
+ */
+bool title_db_find(uint32_t key, char* out_name, uint32_t max_len) {
+	if(!out_name || max_len == 0)
+		return false;
+	uint32_t low = 0, high = title_db_count;
+	while(low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		if(title_db_keys[mid] < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if(low >= title_db_count || title_db_keys[low] != key)
+		return false;
+	const uint8_t* name = &title_db_names[title_db_bucket_ofs[low / TITLE_DB_BUCKET_SIZE]];
+	for(uint32_t i = 0; i < low % TITLE_DB_BUCKET_SIZE; i++)
+		name = skip_name(name);
+	decode_name(name, out_name, max_len);
+	return true;
+}
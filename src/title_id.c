@@ -1,220 +1,425 @@
-#include <stdlib.h>
-#include <string.h>
-#include <stdio.h>
-
-#include "sd_config.h"
-
-
-static int find_index_pos(const char* title_id)
-{
-	char first_id[5] = "";
-	first_id[0] = title_id[0];
-	first_id[1] = title_id[1];
-	first_id[2] = title_id[2];
-	first_id[3] = title_id[3];
-	int second_id = atoi(&(title_id[5]));
-	
-	FIL fil;
-	FRESULT fr = f_open(&fil, "titleid_name.index.txt", FA_READ);
-	if(FR_OK != fr)
-		return 0;
-	
-	char buffer_first_id[64]="";
-	int buffer_second_id = 0;
-
-	int buffer_pos;
-	int before_pos = 0;
-
-
-	int pos = 0;
-	int same_first_id = 0;
-	int bigger_than = 0;
-	while (f_gets(buffer_first_id, 64, &fil) != NULL)
-	{
-		buffer_first_id[4] = '\0';
-		buffer_first_id[10] = '\0';
-		buffer_second_id = atoi(&(buffer_first_id[5]));
-		buffer_pos = atoi(&(buffer_first_id[11]));
-
-		if (strcmp(first_id, buffer_first_id) == 0)
-			same_first_id = 1;
-		else
-		{
-			if (same_first_id == 1)
-			{
-				f_close(&fil);
-				return before_pos;
-			}
-
-			same_first_id = 0;
-			before_pos = buffer_pos;
-			bigger_than = 0;
-			continue;
-		}
-
-		if (bigger_than == 1 && second_id < buffer_second_id)
-		{
-			f_close(&fil);
-			return before_pos;
-		}
-
-		if (second_id >= buffer_second_id)
-			bigger_than = 1;
-		else
-			bigger_than = 0;
-		before_pos = buffer_pos;
-	}
-	if (same_first_id == 1 && bigger_than == 1){
-		f_close(&fil);
-		return before_pos;
-	}
-	f_close(&fil);
-	return 0;
-}
-
-
-struct title_info {
-	char* id;
-	char* name;
-};
-
-#define MAX_TITLE_INFO_CACHE_SIZE 100
-static struct title_info title_info_cache[MAX_TITLE_INFO_CACHE_SIZE] = {{0,0},};
-static int cache_first = 0;
-static int cache_last = 0;
-
-static const char* cache_find(const char* title_id)
-{
-	int current_index = cache_first;
-	while(current_index != cache_last)
-	{
-		if (strcmp(title_info_cache[current_index].id, title_id) == 0)
-			return title_info_cache[current_index].name;
-		current_index++;
-		current_index = current_index % MAX_TITLE_INFO_CACHE_SIZE;
-	}
-	return NULL;
-}
-static void cache_insert(const char* title_id, const char* title_name){
-	if (title_info_cache[cache_last].id){
-		free(title_info_cache[cache_last].id);
-		title_info_cache[cache_last].id = 0;
-	}
-	if (title_info_cache[cache_last].name){
-		free(title_info_cache[cache_last].name);
-		title_info_cache[cache_last].name = 0;
-	}
-	title_info_cache[cache_last].id = strdup(title_id);
-	title_info_cache[cache_last].name = strdup(title_name);
-	cache_last++;
-	cache_last = cache_last % MAX_TITLE_INFO_CACHE_SIZE;
-	if (cache_first == cache_last)
-	{
-		cache_first++;
-		cache_first = cache_first % MAX_TITLE_INFO_CACHE_SIZE;
-	}
-}
-
-
-
-void title_id_make_index()
-{
-	FIL fil;
-	FIL out_fil;
-	FRESULT fr = f_open(&out_fil, "titleid_name.index.txt", FA_CREATE_NEW | FA_WRITE);
-	if(FR_OK != fr)
-		return;
-
-	fr = f_open(&fil, "titleid_name.txt", FA_READ);
-	if(FR_OK != fr){
-		f_close(&out_fil);
-		return;
-	}
-
-	
-
-	char buffer[256];
-
-	f_lseek(&fil, 0);
-
-	char first_id[5] = "";
-	char second_id[6] = "";
-
-	char b_first_id[5] = "";
-	char titleid_and_filepos[64] = "";
-
-	long cur_pos = f_tell(&fil);
-
-	int i=0;
-	int id_count=0;
-	while (f_gets(buffer, 256, &fil) != NULL)
-	{
-
-		first_id[0] = buffer[0];
-		first_id[1] = buffer[1];
-		first_id[2] = buffer[2];
-		first_id[3] = buffer[3];
-		first_id[4] = '\0';
-
-		second_id[0] = buffer[5];
-		second_id[1] = buffer[6];
-		second_id[2] = buffer[7];
-		second_id[3] = buffer[8];
-		second_id[4] = buffer[9];
-		second_id[5] = '\0';
-
-		if (strcmp(b_first_id, first_id) != 0 || id_count == 500){
-
-			sprintf(titleid_and_filepos, "%s-%s %d\n",first_id, second_id, cur_pos);
-			UINT n;
-			f_write(&out_fil, titleid_and_filepos, strlen(titleid_and_filepos), &n);
-			
-			if (strcmp(b_first_id, first_id) != 0)
-				strcpy(b_first_id, first_id);
-			
-			id_count = 0;
-			cur_pos = f_tell(&fil);
-			
-		}else
-		{
-			id_count++;
-		}
-
-	}
-
-	f_close(&fil);
-	f_close(&out_fil);
-}
-
-
-static char out_titlename[256] = "";
-const char* title_id_find_name(const char* title_id)
-{
-	const char* title_name = cache_find(title_id);
-	if (title_name)
-		return title_name;
-
-	char buffer[256];
-	int pos = find_index_pos(title_id);
-	out_titlename[0] ='\0';
-
-	FIL fil;
-	FRESULT fr = f_open(&fil, "titleid_name.txt", FA_READ);
-	if(FR_OK != fr)
-		return out_titlename;
-
-	f_lseek(&fil, pos);
-	
-	while (f_gets(buffer, 256, &fil) != NULL)
-	{
-		buffer[10] = '\0';
-		if (strcmp(title_id, buffer) == 0)
-		{
-			strcpy(out_titlename, &(buffer[11]));
-			break;
-		}
-	}
-	f_close(&fil);
-	cache_insert(title_id, out_titlename);
-	return out_titlename;
-}
\ No newline at end of file
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "sd_config.h"
+#include "config.h"
+#include "checksum.h"
+#include "title_id.h"
+#include "title_prefix.h"
+#ifdef TITLE_DB_FLASH
+#include "title_db.h"
+#endif
+
+/***
+ *	Names of games are looked up in titleid_name.txt (one "SLUS-00594 Name" per line)
+ *	through a binary index stored next to it.
+ *
+ *	Each title ID is packed in a 32-bit key: position of its prefix in TITLE_PREFIXES
+ *	(plus one) followed by the 17 bits of its 5-digit number. The index is a header
+ *	sector followed by pages of sorted {key, line offset} records, one page per sector,
+ *	and by a table holding the first key of every page (fences). Fences are kept in
+ *	RAM, so a lookup is a binary search on them, one page read and one line read.
+ *
+ *	The header records size and date of titleid_name.txt and a checksum of the prefix
+ *	table, the index is rebuilt whenever any of them changes.
+ *
+ *	When the firmware is built with the title database in flash (TITLE_DB_FLASH) that
+ *	is searched first, the SD card is only used for titles added to the text file.
+ */
+
+#define TITLE_DB_FILE			"titleid_name.txt"
+#define TITLE_INDEX_FILE		"titleid_name.idx"
+#define OLD_TITLE_INDEX_FILE	"titleid_name.index.txt"	// text index used by previous versions
+#define TITLE_INDEX_MAGIC		0x58495450	// "PTIX"
+#define TITLE_NUMBER_BITS		17			// enough for 5 digits
+#define TITLE_KEY_NONE			0			// never produced by title_key(), also used to pad the last page
+#define TITLE_RECORDS_PER_PAGE	(BLOCK_SIZE / sizeof(title_record_t))
+#define TITLE_PAGE_OFS(page)	((FSIZE_t) BLOCK_SIZE * ((page) + 1))	// first sector holds the header
+#define MAX_TITLE_LINE_LEN		256
+
+typedef struct {
+	uint32_t key;
+	uint32_t offset;	// offset of the line inside titleid_name.txt
+} title_record_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t prefix_checksum;
+	FSIZE_t source_size;
+	uint16_t source_date;
+	uint16_t source_time;
+	uint32_t count;			// number of records
+	uint32_t page_count;
+} title_index_header_t;
+
+#define PREFIX_STRING(p) #p
+static const char prefix_list[] = TITLE_PREFIXES(PREFIX_STRING);
+
+static uint32_t* fences = NULL;	// first key of every page
+static uint32_t page_count = 0;
+
+/***
+ *	Packs a title ID ("SLUS-00594") into its key, TITLE_KEY_NONE if not valid.
+ */
+static uint32_t title_key(const char* title_id) {
+	uint32_t prefix = 0;
+	for(uint32_t i = 0; i < sizeof(prefix_list) / 4; i++) {
+		if(!strncmp(&prefix_list[i * 4], title_id, 4)) {
+			prefix = i + 1;
+			break;
+		}
+	}
+	if(!prefix || title_id[4] != '-')
+		return TITLE_KEY_NONE;
+	uint32_t number = 0;
+	for(int i = 5; i < 10; i++) {
+		if(title_id[i] < '0' || title_id[i] > '9')
+			return TITLE_KEY_NONE;
+		number = number * 10 + (title_id[i] - '0');
+	}
+	return (prefix << TITLE_NUMBER_BITS) | number;
+}
+
+static int compare_records(const void* a, const void* b) {
+	uint32_t key_a = ((const title_record_t*) a)->key;
+	uint32_t key_b = ((const title_record_t*) b)->key;
+	return key_a < key_b ? -1 : key_a > key_b;
+}
+
+static bool write_page(FIL* index, uint32_t page, title_record_t* records, uint32_t count) {
+	UINT bytes_written;
+	for(uint32_t i = count; i < TITLE_RECORDS_PER_PAGE; i++) {
+		records[i].key = TITLE_KEY_NONE;
+		records[i].offset = 0;
+	}
+	return FR_OK == f_lseek(index, TITLE_PAGE_OFS(page)) &&
+		FR_OK == f_write(index, records, BLOCK_SIZE, &bytes_written) && bytes_written == BLOCK_SIZE;
+}
+
+/***
+ *	Rewrites the pages of an index whose records were not sorted, sorting them in RAM.
+ */
+static bool sort_index(FIL* index, uint32_t count) {
+	title_record_t* records = malloc(page_count * BLOCK_SIZE);
+	if(!records)
+		return false;
+	UINT bytes_read;
+	bool ok = FR_OK == f_lseek(index, TITLE_PAGE_OFS(0)) &&
+		FR_OK == f_read(index, records, page_count * BLOCK_SIZE, &bytes_read) && bytes_read == page_count * BLOCK_SIZE;
+	if(ok) {
+		/* pages are full except the last one, padding records are at the end */
+		for(uint32_t i = 0, src = 0; i < count; src++) {
+			if(records[src].key != TITLE_KEY_NONE)
+				records[i++] = records[src];
+		}
+		qsort(records, count, sizeof(title_record_t), compare_records);
+		for(uint32_t page = 0; page < page_count && ok; page++) {
+			uint32_t first = page * TITLE_RECORDS_PER_PAGE;
+			uint32_t in_page = count - first < TITLE_RECORDS_PER_PAGE ? count - first : TITLE_RECORDS_PER_PAGE;
+			fences[page] = records[first].key;
+			ok = write_page(index, page, &records[first], in_page);	// padding of the last page stays in the buffer
+		}
+	}
+	free(records);
+	return ok;
+}
+
+static bool build_index(FILINFO* source_info, uint32_t prefix_checksum) {
+	FIL source, index;
+	if(FR_OK != f_open(&source, TITLE_DB_FILE, FA_READ))
+		return false;
+	if(FR_OK != f_open(&index, TITLE_INDEX_FILE, FA_CREATE_ALWAYS | FA_READ | FA_WRITE)) {
+		f_close(&source);
+		return false;
+	}
+
+	title_record_t page[TITLE_RECORDS_PER_PAGE];
+	char buffer[MAX_TITLE_LINE_LEN];
+	uint32_t in_page = 0, count = 0, capacity = 0;
+	uint32_t last_key = TITLE_KEY_NONE;
+	bool sorted = true, ok = true;
+	page_count = 0;
+	FSIZE_t line_offset = f_tell(&source);
+	while(ok && f_gets(buffer, sizeof(buffer), &source) != NULL) {
+		uint32_t key = title_key(buffer);
+		if(key != TITLE_KEY_NONE) {
+			if(key <= last_key)
+				sorted = false;
+			last_key = key;
+			page[in_page].key = key;
+			page[in_page].offset = line_offset;
+			if(in_page++ == 0) {
+				/* new page, record its fence */
+				if(page_count == capacity) {
+					capacity = capacity ? capacity * 2 : 64;
+					uint32_t* new_fences = realloc(fences, capacity * sizeof(uint32_t));
+					if(!new_fences) {
+						ok = false;
+						break;
+					}
+					fences = new_fences;
+				}
+				fences[page_count] = key;
+			}
+			++count;
+			if(in_page == TITLE_RECORDS_PER_PAGE) {
+				ok = write_page(&index, page_count++, page, in_page);
+				in_page = 0;
+			}
+		}
+		line_offset = f_tell(&source);
+	}
+	f_close(&source);
+	if(ok && in_page)
+		ok = write_page(&index, page_count++, page, in_page);
+	if(ok && !sorted)
+		ok = sort_index(&index, count);
+
+	/* fences, then header last so that an interrupted build is never considered valid */
+	UINT bytes_written;
+	title_index_header_t header = {
+		.magic = TITLE_INDEX_MAGIC,
+		.prefix_checksum = prefix_checksum,
+		.source_size = source_info->fsize,
+		.source_date = source_info->fdate,
+		.source_time = source_info->ftime,
+		.count = count,
+		.page_count = page_count,
+	};
+	if(ok && page_count)
+		ok = FR_OK == f_lseek(&index, TITLE_PAGE_OFS(page_count)) &&
+			FR_OK == f_write(&index, fences, page_count * sizeof(uint32_t), &bytes_written) && bytes_written == page_count * sizeof(uint32_t);
+	if(ok)
+		ok = FR_OK == f_lseek(&index, 0) &&
+			FR_OK == f_write(&index, &header, sizeof(header), &bytes_written) && bytes_written == sizeof(header);
+	if(FR_OK != f_close(&index))
+		ok = false;
+	if(!ok)
+		f_unlink(TITLE_INDEX_FILE);
+	return ok;
+}
+
+static bool load_index(FILINFO* source_info, uint32_t prefix_checksum) {
+	FIL index;
+	UINT bytes_read;
+	title_index_header_t header;
+	if(FR_OK != f_open(&index, TITLE_INDEX_FILE, FA_READ))
+		return false;
+	bool ok = FR_OK == f_read(&index, &header, sizeof(header), &bytes_read) && bytes_read == sizeof(header) &&
+		header.magic == TITLE_INDEX_MAGIC && header.prefix_checksum == prefix_checksum &&
+		header.source_size == source_info->fsize && header.source_date == source_info->fdate &&
+		header.source_time == source_info->ftime && header.page_count > 0;
+	if(ok) {
+		fences = malloc(header.page_count * sizeof(uint32_t));
+		ok = fences && FR_OK == f_lseek(&index, TITLE_PAGE_OFS(header.page_count)) &&
+			FR_OK == f_read(&index, fences, header.page_count * sizeof(uint32_t), &bytes_read) &&
+			bytes_read == header.page_count * sizeof(uint32_t);
+		page_count = header.page_count;
+	}
+	f_close(&index);
+	return ok;
+}
+
+static void free_index() {
+	free(fences);
+	fences = NULL;
+	page_count = 0;
+}
+
+/***
+ *	Loads the title index, rebuilding it if titleid_name.txt changed since it was built.
+ */
+void title_id_make_index()
+{
+	FILINFO source_info;
+	free_index();
+	if(FR_OK != f_stat(TITLE_DB_FILE, &source_info))
+		return;	// no title database, ids are shown as they are
+	uint32_t prefix_checksum = crc32((const uint8_t*) prefix_list, sizeof(prefix_list) - 1);
+	if(load_index(&source_info, prefix_checksum))
+		return;
+	free_index();
+	f_unlink(OLD_TITLE_INDEX_FILE);
+	if(!build_index(&source_info, prefix_checksum))
+		free_index();
+}
+
+/***
+ *	Returns the offset of the line describing a title, -1 if not found.
+ */
+static int32_t find_line_offset(uint32_t key) {
+	if(!fences || key == TITLE_KEY_NONE)
+		return -1;
+	/* last page starting with a key not bigger than the searched one */
+	uint32_t low = 0, high = page_count;
+	while(low < high) {
+		uint32_t mid = low + (high - low) / 2;
+		if(fences[mid] <= key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if(low == 0)
+		return -1;
+	uint32_t page_n = low - 1;
+
+	FIL index;
+	UINT bytes_read;
+	title_record_t page[TITLE_RECORDS_PER_PAGE];
+	if(FR_OK != f_open(&index, TITLE_INDEX_FILE, FA_READ))
+		return -1;
+	bool ok = FR_OK == f_lseek(&index, TITLE_PAGE_OFS(page_n)) &&
+		FR_OK == f_read(&index, page, BLOCK_SIZE, &bytes_read) && bytes_read == BLOCK_SIZE;
+	f_close(&index);
+	if(!ok)
+		return -1;
+	title_record_t searched = { .key = key };
+	uint32_t in_page = TITLE_RECORDS_PER_PAGE;
+	while(in_page > 0 && page[in_page - 1].key == TITLE_KEY_NONE)
+		--in_page;	// padding of the last page
+	title_record_t* record = bsearch(&searched, page, in_page, sizeof(title_record_t), compare_records);
+	return record ? (int32_t) record->offset : -1;
+}
+
+
+/***
+ *	Cache of recent lookups, including misses so that unknown titles do not hit the SD card again.
+ *	Entries live in a fixed array with their names, a hash table with linear probing maps
+ *	title keys to entries. When full, the entry to replace is chosen with the CLOCK algorithm.
+ */
+#define TITLE_CACHE_ENTRIES		32
+#define TITLE_CACHE_BUCKET_BITS	6			// twice as many buckets as entries keeps probe sequences short
+#define TITLE_CACHE_BUCKETS		(1 << TITLE_CACHE_BUCKET_BITS)
+#define TITLE_CACHE_NAME_LEN	64			// longer names are truncated, the LCD only shows 16 characters anyway
+
+typedef struct {
+	uint32_t key;
+	bool referenced;	// used since the clock hand last passed
+	bool found;			// false for titles not in the database
+	char name[TITLE_CACHE_NAME_LEN];
+} title_cache_entry_t;
+
+static title_cache_entry_t cache_entries[TITLE_CACHE_ENTRIES];
+static uint8_t cache_buckets[TITLE_CACHE_BUCKETS];	// entry index + 1, 0 when empty
+static uint32_t cache_used = 0;
+static uint32_t clock_hand = 0;
+static title_cache_stats_t cache_stats;
+
+static uint32_t cache_bucket(uint32_t key) {
+	return (key * 0x9E3779B1u) >> (32 - TITLE_CACHE_BUCKET_BITS);	// Fibonacci hashing
+}
+
+static title_cache_entry_t* cache_find(uint32_t key)
+{
+	for(uint32_t b = cache_bucket(key); cache_buckets[b]; b = (b + 1) % TITLE_CACHE_BUCKETS) {
+		title_cache_entry_t* entry = &cache_entries[cache_buckets[b] - 1];
+		if(entry->key == key)
+			return entry;
+	}
+	return NULL;
+}
+
+/* Removes a key from the hash table, following entries are shifted back to keep probe sequences unbroken */
+static void cache_unlink(uint32_t key)
+{
+	uint32_t b = cache_bucket(key);
+	while(cache_entries[cache_buckets[b] - 1].key != key)
+		b = (b + 1) % TITLE_CACHE_BUCKETS;
+	uint32_t hole = b;
+	for(b = (hole + 1) % TITLE_CACHE_BUCKETS; cache_buckets[b]; b = (b + 1) % TITLE_CACHE_BUCKETS) {
+		uint32_t home = cache_bucket(cache_entries[cache_buckets[b] - 1].key);
+		/* move back only entries whose home bucket is not between the hole and their position */
+		if((b > hole && (home <= hole || home > b)) || (b < hole && home <= hole && home > b)) {
+			cache_buckets[hole] = cache_buckets[b];
+			hole = b;
+		}
+	}
+	cache_buckets[hole] = 0;
+}
+
+static title_cache_entry_t* cache_insert(uint32_t key, const char* title_name)
+{
+	uint32_t index;
+	if(cache_used < TITLE_CACHE_ENTRIES) {
+		index = cache_used++;
+	} else {
+		/* second chance: skip entries used since last pass */
+		while(cache_entries[clock_hand].referenced) {
+			cache_entries[clock_hand].referenced = false;
+			clock_hand = (clock_hand + 1) % TITLE_CACHE_ENTRIES;
+		}
+		index = clock_hand;
+		clock_hand = (clock_hand + 1) % TITLE_CACHE_ENTRIES;
+		cache_unlink(cache_entries[index].key);
+		++cache_stats.evictions;
+	}
+	title_cache_entry_t* entry = &cache_entries[index];
+	entry->key = key;
+	entry->referenced = false;
+	entry->found = title_name != NULL;
+	entry->name[0] = '\0';
+	if(title_name)
+		strncat(entry->name, title_name, TITLE_CACHE_NAME_LEN - 1);
+	uint32_t b = cache_bucket(key);
+	while(cache_buckets[b])
+		b = (b + 1) % TITLE_CACHE_BUCKETS;
+	cache_buckets[b] = index + 1;
+	return entry;
+}
+
+void title_id_get_cache_stats(title_cache_stats_t* out_stats)
+{
+	if(out_stats)
+		*out_stats = cache_stats;
+}
+
+static char out_titlename[MAX_TITLE_LINE_LEN] = "";
+
+static const char* lookup_name(const char* title_id, uint32_t key)
+{
+#ifdef TITLE_DB_FLASH
+	if (title_db_find(key, out_titlename, sizeof(out_titlename)))
+		return out_titlename;
+#endif
+	int32_t offset = find_line_offset(key);
+	if (offset < 0)
+		return NULL;
+
+	char buffer[MAX_TITLE_LINE_LEN];
+	FIL fil;
+	FRESULT fr = f_open(&fil, TITLE_DB_FILE, FA_READ);
+	if(FR_OK != fr)
+		return NULL;
+	bool found = FR_OK == f_lseek(&fil, offset) && f_gets(buffer, sizeof(buffer), &fil) != NULL && !strncmp(title_id, buffer, 10);
+	f_close(&fil);
+	if (!found)
+		return NULL;	// database changed without index being rebuilt
+
+	strcpy(out_titlename, &(buffer[11]));
+	out_titlename[strcspn(out_titlename, "\r\n")] = '\0';
+	return out_titlename;
+}
+
+/***
+ *	Returns the name of a game given its title ID, NULL if unknown.
+ *	The returned string is only valid until the next call.
+ */
+const char* title_id_find_name(const char* title_id)
+{
+	uint32_t key = title_key(title_id);
+	if (key == TITLE_KEY_NONE)
+		return NULL;
+
+	title_cache_entry_t* entry = cache_find(key);
+	if (entry)
+	{
+		++cache_stats.hits;
+		entry->referenced = true;
+		return entry->found ? entry->name : NULL;
+	}
+	++cache_stats.misses;
+
+	entry = cache_insert(key, lookup_name(title_id, key));
+	return entry->found ? entry->name : NULL;
+}
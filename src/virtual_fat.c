@@ -0,0 +1,516 @@
+#include "virtual_fat.h"
+#include <stdio.h>
+#include <string.h>
+#include "ff.h"
+#include "config.h"
+#include "sd_config.h"
+#include "memory_card.h"
+#include "memcard_manager.h"
+#include "block_store.h"
+#include "image_format.h"
+#include "card_fs.h"
+#include "byte_order.h"
+
+/***
+ *	FAT16 volume synthesised from the image index, exposed over USB instead of the raw SD card.
+ *
+ *	The root directory holds one folder per image (named after the image without extension),
+ *	each folder holds one .mcs file per save: the directory frame of the first block followed
+ *	by the blocks of the save in link order. Nothing is stored, every sector is generated when
+ *	the host reads it: cluster numbers are fixed for each image (VF_POOL_CLUSTERS per image,
+ *	the first one for the folder) so only the images touched by a request are parsed, and the
+ *	last few parsed images are kept in a small cache.
+ *
+ *	Writes to the clusters of an existing save are written back into the image (.MCR only),
+ *	the host rewriting FAT and directory entries (e.g. modification time) is accepted and
+ *	ignored. Writes to any other cluster are refused, so new files fail instead of vanishing.
+ */
+
+#define VF_SECTOR_SIZE		512
+#define VF_CLUSTER_SECTORS	(MC_BLOCK_SIZE / VF_SECTOR_SIZE)		// one save block per cluster
+#define VF_CLUSTER_SIZE		(VF_CLUSTER_SECTORS * VF_SECTOR_SIZE)
+#define VF_POOL_CLUSTERS	32		// folder + (MC_BLOCK_COUNT - 1) blocks + one extra cluster per save for the .mcs header
+#define VF_SAVE_SLOTS		(MC_BLOCK_COUNT - 1)
+#define VF_HEADER_SIZE		MC_SEC_SIZE		// .mcs header is the directory frame of the first block
+
+#define VF_DIR_ENTRY_SIZE	32
+#define VF_ROOT_SLOT		4		// 3 long name entries + short name entry per image folder
+#define VF_FOLDER_SLOT		3		// 2 long name entries + short name entry per save
+#define VF_FOLDER_FIRST		2		// "." and ".." come first in a folder
+#define VF_LFN_CHARS		13
+
+#define VF_CLUSTER_COUNT	(VFAT_MAX_IMAGES * VF_POOL_CLUSTERS)
+#define VF_FAT_SECTORS		(((VF_CLUSTER_COUNT + 2) * 2 + VF_SECTOR_SIZE - 1) / VF_SECTOR_SIZE)
+#define VF_FAT_COUNT		2
+#define VF_ROOT_ENTRIES		(((1 + VFAT_MAX_IMAGES * VF_ROOT_SLOT) + 15) & ~15)	// volume label + images, whole sectors
+#define VF_ROOT_SECTORS		(VF_ROOT_ENTRIES * VF_DIR_ENTRY_SIZE / VF_SECTOR_SIZE)
+#define VF_FAT_START		1
+#define VF_ROOT_START		(VF_FAT_START + VF_FAT_COUNT * VF_FAT_SECTORS)
+#define VF_DATA_START		(VF_ROOT_START + VF_ROOT_SECTORS)
+#define VF_SECTOR_COUNT		(VF_DATA_START + VF_CLUSTER_COUNT * VF_CLUSTER_SECTORS)
+
+#define VF_FAT_EOC			0xFFFF
+#define VF_ATTR_DIR			0x10
+#define VF_ATTR_ARCHIVE		0x20
+#define VF_ATTR_VOLUME		0x08
+#define VF_ATTR_LFN			0x0F
+#define VF_DELETED			0xE5
+#define VF_DATE				((2022 - 1980) << 9 | 1 << 5 | 1)	// 2022-01-01, images have no timestamp of their own
+
+#if VF_CLUSTER_COUNT < 4085 || VF_CLUSTER_COUNT >= 65525
+#error "VFAT_MAX_IMAGES does not give a FAT16 cluster count"
+#endif
+
+typedef struct {
+	uint8_t first_block;		// 0 = no save starting at this slot
+	uint8_t block_count;
+	uint8_t first_cluster;		// cluster of the .mcs file, relative to the image pool
+	uint8_t blocks[VF_SAVE_SLOTS];	// blocks of the save in link order
+	char name[CF_NAME_LEN + 1];
+} vf_save_t;
+
+typedef struct {
+	int32_t image;				// position in the image index, -1 = unused entry
+	uint32_t last_use;
+	bool manifest;
+	block_hash_t block_hash[MC_BLOCK_COUNT];	// blocks of a manifest image
+	char file_name[MAX_MC_FILENAME_LEN + 1];
+	vf_save_t saves[VF_SAVE_SLOTS];	// indexed by first block - 1
+} vf_image_t;
+
+static vf_image_t image_cache[VFAT_IMAGE_CACHE];
+static uint32_t use_tick = 0;
+static bool mounted = false;
+
+/* file kept open between sector accesses, hosts read files sequentially */
+static FIL open_fil;
+static bool fil_open = false;
+static int32_t open_image = -1;		// image open in open_fil, -1 = none or a block file of a manifest
+static BYTE open_mode = 0;
+static FSIZE_t open_offset = 0;		// start of the card data in open_fil
+
+static void close_image() {
+	if(fil_open)
+		f_close(&open_fil);
+	fil_open = false;
+	open_image = -1;
+}
+
+/***
+ *	Opens the image file (or the block file of a manifest image) holding offset, positioned at offset.
+ */
+static bool seek_image(vf_image_t* img, uint32_t offset, BYTE mode) {
+	if(img->manifest) {
+		close_image();
+		if(BS_OK != block_store_open_block(img->block_hash[offset / MC_BLOCK_SIZE], &open_fil))
+			return false;
+		fil_open = true;
+		return FR_OK == f_lseek(&open_fil, offset % MC_BLOCK_SIZE);
+	}
+	if(open_image != img->image || (open_mode & mode) != mode) {
+		close_image();
+		if(IF_OK != image_format_open(&open_fil, img->file_name, mode, &open_offset))
+			return false;
+		fil_open = true;
+		open_image = img->image;
+		open_mode = mode;
+	}
+	return FR_OK == f_lseek(&open_fil, open_offset + offset);
+}
+
+static bool read_image(vf_image_t* img, uint32_t offset, uint8_t* out, uint32_t len) {
+	UINT bytes_read;
+	while(len) {
+		uint32_t chunk = MC_BLOCK_SIZE - offset % MC_BLOCK_SIZE;	// manifests are read one block at a time
+		if(chunk > len)
+			chunk = len;
+		if(!seek_image(img, offset, FA_READ) || FR_OK != f_read(&open_fil, out, chunk, &bytes_read) || bytes_read != chunk)
+			return false;
+		offset += chunk;
+		out += chunk;
+		len -= chunk;
+	}
+	return true;
+}
+
+static bool write_image(vf_image_t* img, uint32_t offset, const uint8_t* data, uint32_t len) {
+	UINT bytes_written;
+	if(!seek_image(img, offset, FA_READ | FA_WRITE))
+		return false;
+	if(FR_OK != f_write(&open_fil, data, len, &bytes_written) || bytes_written != len)
+		return false;
+	return FR_OK == f_sync(&open_fil);
+}
+
+/***
+ *	Rebuilds the list of saves of an image from its directory frames.
+ */
+static bool parse_image(vf_image_t* img) {
+	uint8_t frames[VF_SAVE_SLOTS + 1][MC_SEC_SIZE];	// frame 0 is the header of the directory block
+	card_fs_t fs;
+
+	img->manifest = block_store_is_manifest(img->file_name);
+	if(img->manifest) {
+		block_manifest_t manifest;
+		if(BS_OK != block_store_read_manifest(img->file_name, &manifest))
+			return false;
+		memcpy(img->block_hash, manifest.blocks, sizeof(img->block_hash));
+	}
+	if(!read_image(img, 0, (uint8_t*) frames, sizeof(frames)))
+		return false;
+
+	card_fs_build(&fs, (uint8_t*) frames);
+	uint8_t next_cluster = 1;		// cluster 0 of the pool is the folder
+	for(uint32_t slot = 0; slot < VF_SAVE_SLOTS; slot++) {
+		vf_save_t* save = &img->saves[slot];
+		card_fs_save_t* parsed = &fs.saves[slot];
+		save->first_block = 0;
+		if(!parsed->first_block || next_cluster + parsed->block_count + 1 > VF_POOL_CLUSTERS)
+			continue;
+		save->first_block = parsed->first_block;
+		save->block_count = parsed->block_count;
+		memcpy(save->blocks, parsed->blocks, parsed->block_count);
+		save->first_cluster = next_cluster;
+		next_cluster += save->block_count + 1;
+		strcpy(save->name, parsed->name);
+	}
+	return true;
+}
+
+/***
+ *	Returns the parsed image at position image of the index, parsing it if not cached.
+ */
+static vf_image_t* get_image(uint32_t image) {
+	vf_image_t* victim = &image_cache[0];
+	for(uint32_t i = 0; i < VFAT_IMAGE_CACHE; i++) {
+		if(image_cache[i].image == (int32_t) image) {
+			image_cache[i].last_use = ++use_tick;
+			return &image_cache[i];
+		}
+		if(image_cache[i].last_use < victim->last_use)
+			victim = &image_cache[i];
+	}
+	if(image >= memcard_manager_count() || image >= VFAT_MAX_IMAGES)
+		return NULL;
+	if(open_image == victim->image)
+		close_image();
+	victim->image = image;
+	victim->last_use = ++use_tick;
+	if(MM_OK != memcard_manager_get(image, victim->file_name) || !parse_image(victim)) {
+		victim->image = -1;
+		victim->last_use = 0;
+		return NULL;
+	}
+	return victim;
+}
+
+static uint32_t save_file_size(vf_save_t* save) {
+	return VF_HEADER_SIZE + save->block_count * MC_BLOCK_SIZE;
+}
+
+/***
+ *	Finds the save owning cluster (relative to the image pool), returns the byte offset of the cluster in the .mcs file.
+ */
+static vf_save_t* find_save(vf_image_t* img, uint32_t cluster, uint32_t* out_offset) {
+	for(uint32_t slot = 0; slot < VF_SAVE_SLOTS; slot++) {
+		vf_save_t* save = &img->saves[slot];
+		if(save->first_block && cluster >= save->first_cluster && cluster <= save->first_cluster + save->block_count) {
+			*out_offset = (cluster - save->first_cluster) * VF_CLUSTER_SIZE;
+			return save;
+		}
+	}
+	return NULL;
+}
+
+/***
+ *	Maps an offset of the .mcs file to the image, returns the bytes contiguous in the image (0 past the end of the file).
+ */
+static uint32_t map_offset(vf_save_t* save, uint32_t offset, uint32_t* out_image_offset) {
+	if(offset < VF_HEADER_SIZE) {
+		*out_image_offset = save->first_block * MC_SEC_SIZE + offset;	// directory frame of first block
+		return VF_HEADER_SIZE - offset;
+	}
+	offset -= VF_HEADER_SIZE;
+	if(offset >= save->block_count * MC_BLOCK_SIZE)
+		return 0;
+	*out_image_offset = save->blocks[offset / MC_BLOCK_SIZE] * MC_BLOCK_SIZE + offset % MC_BLOCK_SIZE;
+	return MC_BLOCK_SIZE - offset % MC_BLOCK_SIZE;
+}
+
+/* Directory entries */
+
+static void make_short_entry(uint8_t* entry, const char* short_name, uint8_t attr, uint16_t cluster, uint32_t size) {
+	memcpy(entry, short_name, 11);
+	entry[11] = attr;
+	put16(entry + 16, VF_DATE);		// creation date
+	put16(entry + 18, VF_DATE);		// last access date
+	put16(entry + 24, VF_DATE);		// write date
+	put16(entry + 26, cluster);
+	put32(entry + 28, size);
+}
+
+static uint8_t short_name_checksum(const char* short_name) {
+	uint8_t sum = 0;
+	for(int i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t) short_name[i];
+	return sum;
+}
+
+/***
+ *	Fills a directory slot of slot_entries entries: long name entries (unused ones marked deleted) then the short entry.
+ *	Only the entries of the slot within [first, first + count) are written to out.
+ */
+static void make_slot(uint8_t* out, uint32_t first, uint32_t count, uint32_t slot_entries, const char* long_name,
+	const char* short_name, uint8_t attr, uint16_t cluster, uint32_t size) {
+	uint8_t entries[VF_ROOT_SLOT][VF_DIR_ENTRY_SIZE] = {0};
+	uint32_t len = strlen(long_name);
+	uint32_t parts = (len + VF_LFN_CHARS - 1) / VF_LFN_CHARS;	// terminating 0 only when there is room for it
+	static const uint8_t char_pos[VF_LFN_CHARS] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+	uint8_t checksum = short_name_checksum(short_name);
+
+	if(parts > slot_entries - 1)
+		parts = slot_entries - 1;
+	for(uint32_t i = 0; i < slot_entries - 1 - parts; i++)
+		entries[i][0] = VF_DELETED;
+	for(uint32_t part = 0; part < parts; part++) {
+		/* long name entries are stored last part first */
+		uint8_t* entry = entries[slot_entries - 2 - part];
+		entry[0] = (part + 1) | (part == parts - 1 ? 0x40 : 0);
+		entry[11] = VF_ATTR_LFN;
+		entry[13] = checksum;
+		for(uint32_t c = 0; c < VF_LFN_CHARS; c++) {
+			uint32_t pos = part * VF_LFN_CHARS + c;
+			uint16_t ch = pos < len ? (uint8_t) long_name[pos] : (pos == len ? 0x0000 : 0xFFFF);
+			put16(entry + char_pos[c], ch);
+		}
+	}
+	make_short_entry(entries[slot_entries - 1], short_name, attr, cluster, size);
+	for(uint32_t i = first; i < first + count; i++)
+		memcpy(out + (i - first) * VF_DIR_ENTRY_SIZE, entries[i], VF_DIR_ENTRY_SIZE);
+}
+
+static uint16_t pool_cluster(uint32_t image) {
+	return 2 + image * VF_POOL_CLUSTERS;
+}
+
+/***
+ *	Long name of a folder or save, replacing characters hosts do not accept in file names.
+ */
+static void make_long_name(char* out, const char* name, uint32_t max_len, const char* ext) {
+	uint32_t len = 0;
+	for(; name[len] && name[len] != '.' && len < max_len; len++) {
+		char c = name[len];
+		out[len] = (c < 0x20 || c > 0x7E || strchr("\\/:*?\"<>|", c)) ? '_' : c;
+	}
+	while(len && out[len - 1] == ' ')
+		len--;
+	strcpy(out + len, ext);
+}
+
+/* Sector generators */
+
+static void read_boot_sector(uint8_t* out) {
+	static const uint8_t jump[3] = {0xEB, 0x3C, 0x90};
+	memcpy(out, jump, 3);
+	memcpy(out + 3, "MSDOS5.0", 8);
+	put16(out + 11, VF_SECTOR_SIZE);
+	out[13] = VF_CLUSTER_SECTORS;
+	put16(out + 14, VF_FAT_START);	// reserved sectors
+	out[16] = VF_FAT_COUNT;
+	put16(out + 17, VF_ROOT_ENTRIES);
+	out[21] = 0xF8;					// fixed disk
+	put16(out + 22, VF_FAT_SECTORS);
+	put16(out + 24, 63);			// sectors per track
+	put16(out + 26, 255);			// heads
+	put32(out + 32, VF_SECTOR_COUNT);
+	out[36] = 0x80;					// drive number
+	out[38] = 0x29;					// extended boot signature
+	put32(out + 39, 0x50494D43);	// volume serial
+	memcpy(out + 43, "PICOMEMCARD", 11);
+	memcpy(out + 54, "FAT16   ", 8);
+	out[510] = 0x55;
+	out[511] = 0xAA;
+}
+
+static void read_fat_sector(uint32_t fat_sector, uint8_t* out) {
+	uint32_t entries = VF_SECTOR_SIZE / 2;
+	for(uint32_t i = 0; i < entries; i++) {
+		uint32_t cluster = fat_sector * entries + i;
+		uint16_t value = 0;
+		if(cluster < 2) {
+			value = cluster == 0 ? 0xFFF8 : VF_FAT_EOC;
+		} else if(cluster < VF_CLUSTER_COUNT + 2) {
+			uint32_t image = (cluster - 2) / VF_POOL_CLUSTERS;
+			uint32_t rel = (cluster - 2) % VF_POOL_CLUSTERS;
+			vf_image_t* img;
+			uint32_t offset;
+			vf_save_t* save;
+			if(image >= memcard_manager_count() || image >= VFAT_MAX_IMAGES)
+				value = 0;
+			else if(rel == 0)
+				value = VF_FAT_EOC;		// folder fits in its cluster
+			else if((img = get_image(image)) && (save = find_save(img, rel, &offset)))
+				value = rel < save->first_cluster + save->block_count ? cluster + 1 : VF_FAT_EOC;
+		}
+		put16(out + i * 2, value);
+	}
+}
+
+static void read_root_sector(uint32_t root_sector, uint8_t* out) {
+	uint32_t per_sector = VF_SECTOR_SIZE / VF_DIR_ENTRY_SIZE;
+	uint32_t count = memcard_manager_count();
+	if(count > VFAT_MAX_IMAGES)
+		count = VFAT_MAX_IMAGES;
+	for(uint32_t i = 0; i < per_sector;) {
+		uint32_t entry = root_sector * per_sector + i;
+		uint8_t* out_entry = out + i * VF_DIR_ENTRY_SIZE;
+		if(entry == 0) {
+			make_short_entry(out_entry, "PICOMEMCARD", VF_ATTR_VOLUME, 0, 0);
+			i++;
+			continue;
+		}
+		uint32_t image = (entry - 1) / VF_ROOT_SLOT;
+		uint32_t first = (entry - 1) % VF_ROOT_SLOT;
+		uint32_t run = VF_ROOT_SLOT - first;
+		if(run > per_sector - i)
+			run = per_sector - i;
+		if(image >= count)
+			break;		// rest of the directory is empty (0)
+		char file_name[MAX_MC_FILENAME_LEN + 1];
+		char long_name[MAX_MC_FILENAME_LEN + 1];
+		char short_name[12];
+		memcard_manager_get(image, file_name);
+		make_long_name(long_name, file_name, MAX_MC_FILENAME_LEN, "");
+		snprintf(short_name, sizeof(short_name), "IMG%05lu   ", image);
+		make_slot(out_entry, first, run, VF_ROOT_SLOT, long_name, short_name, VF_ATTR_DIR, pool_cluster(image), 0);
+		i += run;
+	}
+}
+
+static void read_folder_sector(vf_image_t* img, uint32_t sector, uint8_t* out) {
+	uint32_t per_sector = VF_SECTOR_SIZE / VF_DIR_ENTRY_SIZE;
+	for(uint32_t i = 0; i < per_sector;) {
+		uint32_t entry = sector * per_sector + i;
+		uint8_t* out_entry = out + i * VF_DIR_ENTRY_SIZE;
+		if(entry < VF_FOLDER_FIRST) {
+			make_short_entry(out_entry, entry == 0 ? ".          " : "..         ", VF_ATTR_DIR, entry == 0 ? pool_cluster(img->image) : 0, 0);
+			i++;
+			continue;
+		}
+		uint32_t slot = (entry - VF_FOLDER_FIRST) / VF_FOLDER_SLOT;
+		uint32_t first = (entry - VF_FOLDER_FIRST) % VF_FOLDER_SLOT;
+		uint32_t run = VF_FOLDER_SLOT - first;
+		if(run > per_sector - i)
+			run = per_sector - i;
+		if(slot >= VF_SAVE_SLOTS)
+			break;
+		vf_save_t* save = &img->saves[slot];
+		if(save->first_block) {
+			char long_name[CF_NAME_LEN + 5];
+			char short_name[12];
+			make_long_name(long_name, save->name, CF_NAME_LEN, ".mcs");
+			if(long_name[0] == '.')
+				snprintf(long_name, sizeof(long_name), "BLOCK%02u.mcs", (unsigned) save->first_block);
+			snprintf(short_name, sizeof(short_name), "BLOCK%02u MCS", (unsigned) save->first_block);
+			make_slot(out_entry, first, run, VF_FOLDER_SLOT, long_name, short_name, VF_ATTR_ARCHIVE,
+				pool_cluster(img->image) + save->first_cluster, save_file_size(save));
+		} else {
+			for(uint32_t e = 0; e < run; e++)
+				out_entry[e * VF_DIR_ENTRY_SIZE] = VF_DELETED;
+		}
+		i += run;
+	}
+}
+
+/***
+ *	Reads or writes the part of a .mcs file held by one sector, ignoring bytes past the end of the file.
+ */
+static uint32_t transfer_save_sector(vf_image_t* img, vf_save_t* save, uint32_t offset, uint8_t* data, bool write) {
+	for(uint32_t done = 0; done < VF_SECTOR_SIZE;) {
+		uint32_t image_offset;
+		uint32_t len = map_offset(save, offset + done, &image_offset);
+		if(!len)
+			break;
+		if(len > VF_SECTOR_SIZE - done)
+			len = VF_SECTOR_SIZE - done;
+		if(write && offset + done >= VF_HEADER_SIZE) {
+			/* the header only mirrors the directory frame, saves are moved around by rewriting their blocks */
+			if(!write_image(img, image_offset, data + done, len))
+				return VF_FILE_WRITE_ERR;
+		} else if(!write && !read_image(img, image_offset, data + done, len)) {
+			return VF_FILE_READ_ERR;
+		}
+		done += len;
+	}
+	return VF_OK;
+}
+
+uint32_t virtual_fat_init() {
+	sd_card_t *p_sd = sd_get_by_num(0);
+	mounted = false;
+	if(!p_sd || FR_OK != f_mount(&p_sd->fatfs, "", 1))
+		return VF_NOT_MOUNTED;
+	if(MM_OK != memcard_manager_init())
+		return VF_NOT_MOUNTED;
+	for(uint32_t i = 0; i < VFAT_IMAGE_CACHE; i++) {
+		image_cache[i].image = -1;
+		image_cache[i].last_use = 0;
+	}
+	close_image();
+	mounted = true;
+	return VF_OK;
+}
+
+bool virtual_fat_is_ready() {
+	return mounted;
+}
+
+uint32_t virtual_fat_sector_count() {
+	return VF_SECTOR_COUNT;
+}
+
+uint32_t virtual_fat_read(uint32_t sector, uint8_t* out_buffer) {
+	if(!mounted)
+		return VF_NOT_MOUNTED;
+	memset(out_buffer, 0, VF_SECTOR_SIZE);
+	if(sector == 0) {
+		read_boot_sector(out_buffer);
+	} else if(sector < VF_ROOT_START) {
+		read_fat_sector((sector - VF_FAT_START) % VF_FAT_SECTORS, out_buffer);	// every FAT copy is the same
+	} else if(sector < VF_DATA_START) {
+		read_root_sector(sector - VF_ROOT_START, out_buffer);
+	} else if(sector < VF_SECTOR_COUNT) {
+		uint32_t cluster = (sector - VF_DATA_START) / VF_CLUSTER_SECTORS;
+		uint32_t in_cluster = (sector - VF_DATA_START) % VF_CLUSTER_SECTORS;
+		vf_image_t* img = get_image(cluster / VF_POOL_CLUSTERS);
+		uint32_t rel = cluster % VF_POOL_CLUSTERS;
+		uint32_t offset;
+		vf_save_t* save;
+		if(!img)
+			return VF_OK;		// free cluster
+		if(rel == 0) {
+			read_folder_sector(img, in_cluster, out_buffer);
+		} else if((save = find_save(img, rel, &offset))) {
+			return transfer_save_sector(img, save, offset + in_cluster * VF_SECTOR_SIZE, out_buffer, false);
+		}
+	}
+	return VF_OK;
+}
+
+uint32_t virtual_fat_write(uint32_t sector, const uint8_t* buffer) {
+	if(!mounted)
+		return VF_NOT_MOUNTED;
+	if(sector < VF_DATA_START)
+		return VF_OK;		// metadata is generated, host updates are dropped
+	uint32_t cluster = (sector - VF_DATA_START) / VF_CLUSTER_SECTORS;
+	uint32_t in_cluster = (sector - VF_DATA_START) % VF_CLUSTER_SECTORS;
+	vf_image_t* img = get_image(cluster / VF_POOL_CLUSTERS);
+	uint32_t rel = cluster % VF_POOL_CLUSTERS;
+	uint32_t offset;
+	vf_save_t* save;
+	if(img && rel == 0)
+		return VF_OK;		// folder entries
+	if(!img || img->manifest || !(save = find_save(img, rel, &offset)))
+		return VF_READ_ONLY;
+	return transfer_save_sector(img, save, offset + in_cluster * VF_SECTOR_SIZE, (uint8_t*) buffer, true);
+}